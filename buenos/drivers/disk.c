@@ -47,6 +47,9 @@
 #include "drivers/gbd.h"
 #include "drivers/disk.h"
 #include "drivers/disksched.h"
+#ifdef CHANGED_1
+    #include "kernel/defer.h"
+#endif
 
 
 /**@name Disk driver
@@ -62,6 +65,9 @@ static int disk_read_block(gbd_t *gbd, gbd_request_t *request);
 static int disk_write_block(gbd_t *gbd, gbd_request_t *request);
 static int disk_submit_request(gbd_t *gbd, gbd_request_t *request);
 static void disk_next_request(gbd_t *gbd);
+#ifdef CHANGED_1
+static void disk_next_request_deferred(void *gbd);
+#endif
 static uint32_t disk_block_size(gbd_t *gbd);
 static uint32_t disk_total_blocks(gbd_t *gbd);
 
@@ -102,6 +108,10 @@ device_t *disk_init(io_descriptor_t *desc)
     spinlock_reset(&real_dev->slock);
     real_dev->request_queue = NULL;
     real_dev->request_served = NULL;
+#ifdef CHANGED_1
+    defer_item_init(&real_dev->next_request_work,
+                    disk_next_request_deferred, gbd);
+#endif
 
     irq_mask = 1 << (desc->irq + 10);
     interrupt_register(irq_mask, disk_interrupt_handle, dev);
@@ -146,7 +156,15 @@ static void disk_interrupt_handle(device_t *device)
        some other function.*/
     semaphore_V(real_dev->request_served->sem);
     real_dev->request_served = NULL;
+#ifdef CHANGED_1
+    /* Starting the next request can wait until the interrupt is
+       over. New requests start it themselves meanwhile if the queue
+       was empty. */
+    if (real_dev->request_queue != NULL)
+        defer_work(&real_dev->next_request_work);
+#else
     disk_next_request(device->generic_device);
+#endif
     
     spinlock_release(&real_dev->slock);
 }
@@ -218,6 +236,14 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request)
     request->return_value = -1;
 
     sem_null = (request->sem == NULL);
+#ifdef CHANGED_1
+    if(sem_null) {
+        /* Synchronous request, wait on the completion semaphore of
+           this thread. It is signaled by the interrupt handler and
+           cannot run out like created semaphores. */
+        request->sem = semaphore_get_completion();
+    }
+#else
     if(sem_null) {
         /* Semaphore is null so this is synchronous request.
            Create a new semaphore with value 0. This will cause
@@ -228,6 +254,7 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request)
         if(request->sem == NULL)
             return 0;   /* failure */
     }
+#endif
 
     intr_status = _interrupt_disable();
     spinlock_acquire(&real_dev->slock);
@@ -247,7 +274,9 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request)
            handled the request. After this semaphore created earlier
            in this function is no longer needed. */
         semaphore_P(request->sem);
+#ifndef CHANGED_1
         semaphore_destroy(request->sem);
+#endif
         request->sem = NULL;
 
         /* Request is handled. Check the retrun value. */
@@ -264,6 +293,29 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request)
 }
 
 
+#ifdef CHANGED_1
+/**
+ * Deferred part of the disk interrupt. Puts the next request under
+ * work, unless a new request has already done it.
+ *
+ * @param gbd Pointer to the gbd-device
+ */
+static void disk_next_request_deferred(void *gbd)
+{
+    interrupt_status_t intr_status;
+    disk_real_device_t *real_dev = ((gbd_t *)gbd)->device->real_device;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&real_dev->slock);
+
+    if (real_dev->request_served == NULL)
+        disk_next_request(gbd);
+
+    spinlock_release(&real_dev->slock);
+    _interrupt_set_state(intr_status);
+}
+#endif
+
 /**
  * Gets one request from request queue and puts the disk in
  * work. Assumes that interrupts are disabled and device spinlock is
@@ -43,6 +43,9 @@
 #include "drivers/device.h"
 #include "drivers/yams.h"
 #include "drivers/gbd.h"
+#ifdef CHANGED_1
+#include "kernel/defer.h"
+#endif
 
 
 #define DISK_COMMAND_READ            0x1
@@ -90,6 +93,11 @@ typedef struct {
 
     /* Request currently served by the driver. If NULL device is idle. */
     volatile gbd_request_t     *request_served;
+
+#ifdef CHANGED_1
+    /* Deferred start of the next request after an interrupt. */
+    defer_item_t               next_request_work;
+#endif
 } disk_real_device_t;
 
 
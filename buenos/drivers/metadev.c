@@ -40,6 +40,9 @@
 #include "kernel/assert.h"
 #include "kernel/kmalloc.h"
 #include "kernel/interrupt.h"
+#ifdef CHANGED_4
+#include "vm/tlb.h"
+#endif
 
 /**@name Metadevices
  *
@@ -222,8 +225,8 @@ void cpustatus_generate_irq(device_t *dev)
     intr_status = _interrupt_disable();
     spinlock_acquire(&cpu->slock);
 
-    /* If you really want to do something with inter-cpu interrupts,
-       do it here.*/
+    /* The scheduler uses this to wake up an idle CPU when a thread
+       is placed on its run queue. */
 
     /* Generate the IRQ */
     iobase->command = CPU_COMMAND_RAISE_IRQ;
@@ -257,13 +260,20 @@ void cpustatus_interrupt_handle(device_t *dev){
 
     spinlock_acquire(&cpu->slock);
 
-    /* If you really want to do something with inter-cpu interrupts,
-       do it here. */
+    /* Nothing else to do: interrupt_handle() runs the scheduler
+       whenever the idle thread was interrupted, which picks up the
+       work that caused this interrupt. */
 
     /* Clear the interrupt */
     iobase->command = CPU_COMMAND_CLEAR_IRQ;
     
     spinlock_release(&cpu->slock);
+
+#ifdef CHANGED_4
+    /* Served after clearing the interrupt, so that a request posted
+       meanwhile raises it again instead of being lost. */
+    tlb_shootdown_handle();
+#endif
 }
 
 /** 
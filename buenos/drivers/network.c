@@ -12,12 +12,18 @@
 #include "drivers/yams.h"
 #include "drivers/gnd.h"
 #include "drivers/network.h"
+#ifdef CHANGED_1
+    #include "kernel/defer.h"
+#endif
 
 static void nic_interrupt_handle(device_t *device);
 static int nic_send(gnd_t *gnd, void *frame, network_address_t addr);
 static int nic_recv(gnd_t *gnd, void *frame);
 static uint32_t nic_frame_size(gnd_t *gnd);
 static network_address_t nic_hwaddr(gnd_t *gnd);
+#ifdef CHANGED_1
+static void nic_wake_deferred(void *device);
+#endif
 
 device_t *nic_init(io_descriptor_t *desc) {
     device_t *dev;
@@ -53,6 +59,10 @@ device_t *nic_init(io_descriptor_t *desc) {
     real_dev->recv_sleepq = 0;
     real_dev->msg_recvd = 0;
     real_dev->recv_done_sleepq = 0;
+#ifdef CHANGED_1
+    real_dev->pending = 0;
+    defer_item_init(&real_dev->wake_work, nic_wake_deferred, dev);
+#endif
 
     irq_mask = 1 << (desc->irq + 10);
     interrupt_register(irq_mask, nic_interrupt_handle, dev);
@@ -61,6 +71,60 @@ device_t *nic_init(io_descriptor_t *desc) {
 }
 
 
+#ifdef CHANGED_1
+/* Deferred part of the NIC interrupt, wakes the threads waiting for
+   the events the interrupt reported. */
+static void nic_wake_deferred(void *device) {
+    nic_real_device_t *real_dev = ((device_t *)device)->real_device;
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&real_dev->slock);
+
+    if (real_dev->pending & NIC_PENDING_SEND)
+        sleepq_wake(&real_dev->send_sleepq);
+    if (real_dev->pending & NIC_PENDING_RECV)
+        sleepq_wake(&real_dev->recv_sleepq);
+    if (real_dev->pending & NIC_PENDING_RECV_DONE)
+        sleepq_wake(&real_dev->recv_done_sleepq);
+    real_dev->pending = 0;
+
+    spinlock_release(&real_dev->slock);
+    _interrupt_set_state(intr_status);
+}
+
+static void nic_interrupt_handle(device_t *device) {
+    
+    nic_real_device_t *real_dev = device->real_device;
+    nic_io_area_t *io = (nic_io_area_t*)device->io_address;
+    uint8_t was_pending;
+
+    spinlock_acquire(&real_dev->slock);
+
+    was_pending = real_dev->pending;
+    
+    if (NIC_STATUS_SIRQ(io->status)) {
+        io->command = NIC_COMMAND_CLEAR_SIRQ;
+        real_dev->pending |= NIC_PENDING_SEND;
+    }
+    if (NIC_STATUS_RXIRQ(io->status)) {
+        io->command = NIC_COMMAND_CLEAR_RXIRQ;
+        real_dev->msg_recvd = 1;
+        real_dev->pending |= NIC_PENDING_RECV;
+    }
+    if(NIC_STATUS_RIRQ(io->status)) {
+        io->command = NIC_COMMAND_CLEAR_RIRQ;
+        io->command = NIC_COMMAND_CLEAR_RXBUSY;
+        real_dev->pending |= NIC_PENDING_RECV_DONE;
+    }
+
+    /* the wakes are already queued if events were pending before */
+    if (!was_pending && real_dev->pending)
+        defer_work(&real_dev->wake_work);
+    
+    spinlock_release(&real_dev->slock);
+}
+#else
 static void nic_interrupt_handle(device_t *device) {
     
     nic_real_device_t *real_dev = device->real_device;
@@ -85,6 +149,7 @@ static void nic_interrupt_handle(device_t *device) {
     
     spinlock_release(&real_dev->slock);
 }
+#endif
 
 static int nic_send(gnd_t *gnd, void *frame, network_address_t addr) {
     
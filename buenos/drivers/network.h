@@ -9,6 +9,9 @@
 #include "drivers/device.h"
 #include "drivers/yams.h"
 #include "drivers/gbd.h"
+#ifdef CHANGED_1
+#include "kernel/defer.h"
+#endif
 
 
 #define NIC_COMMAND_DMA_RECV        0x01
@@ -47,8 +50,20 @@ typedef struct {
     uint8_t send_sleepq;
     uint8_t recv_sleepq;
     uint8_t recv_done_sleepq;
+#ifdef CHANGED_1
+    /* NIC_PENDING_* events whose waiters are not yet woken */
+    uint8_t pending;
+    /* deferred wake of the threads waiting for the pending events */
+    defer_item_t wake_work;
+#endif
 } nic_real_device_t;
 
+#ifdef CHANGED_1
+#define NIC_PENDING_SEND      0x1
+#define NIC_PENDING_RECV      0x2
+#define NIC_PENDING_RECV_DONE 0x4
+#endif
+
 device_t *nic_init(io_descriptor_t *desc);
 
 #endif // Include guard
@@ -40,6 +40,7 @@
 #include "lib/types.h"
 
 void timer_set_ticks(uint32_t ticks);
+uint32_t timer_get_ticks(void);
 
 #endif /* DRIVERS_POLLTTY_H */
 
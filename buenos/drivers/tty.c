@@ -45,6 +45,9 @@
 #include "drivers/device.h"
 #include "drivers/gcd.h"
 #include "drivers/tty.h"
+#ifdef CHANGED_1
+    #include "kernel/defer.h"
+#endif
 
 /**@name TTY driver
  *
@@ -55,6 +58,10 @@
 
 static int tty_write(gcd_t *gcd, const void *buf, int len);
 static int tty_read(gcd_t *gcd, void *buf, int len);
+#ifdef CHANGED_1
+static void tty_write_deferred(void *device);
+static void tty_read_deferred(void *device);
+#endif
 
 /* We need this spinlock so that we can synchronise with the polling
  * tty drivers writes, since this driver cannot be used in some parts
@@ -118,12 +125,114 @@ device_t *tty_init(io_descriptor_t *desc) {
     tty_rd->read_head = 0;
     tty_rd->read_count = 0;
 
+#ifdef CHANGED_1
+    defer_item_init(&tty_rd->write_work, tty_write_deferred, dev);
+    defer_item_init(&tty_rd->read_work, tty_read_deferred, dev);
+#endif
+
     irq_mask = 1 << (desc->irq + 10);
     interrupt_register(irq_mask, tty_interrupt_handle, dev);
 
     return dev;
 }
 
+#ifdef CHANGED_1
+/* Deferred part of the write interrupt. Writes the internal buffer to
+   the device while it accepts characters and wakes the writers when
+   the buffer is empty. */
+static void tty_write_deferred(void *device) {
+    volatile tty_io_area_t *iobase =
+        (tty_io_area_t *)((device_t *)device)->io_address;
+    volatile tty_real_device_t *tty_rd
+        = (tty_real_device_t *)((device_t *)device)->real_device;
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(tty_rd->slock);
+
+    while(!TTY_STATUS_WBUSY(iobase->status) && tty_rd->write_count > 0) {
+        iobase->command = TTY_COMMAND_WIRQ;
+        iobase->data = tty_rd->write_buf[tty_rd->write_head];
+        tty_rd->write_head = (tty_rd->write_head + 1) % TTY_BUF_SIZE;
+        tty_rd->write_count--;
+    }
+    iobase->command = TTY_COMMAND_WIRQE;
+
+    if (tty_rd->write_count == 0)
+        sleepq_wake_all((void *)tty_rd->write_buf);
+
+    spinlock_release(tty_rd->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/* Deferred part of the read interrupt. Moves the available characters
+   to the internal buffer and wakes the readers. */
+static void tty_read_deferred(void *device) {
+    volatile tty_io_area_t *iobase =
+        (tty_io_area_t *)((device_t *)device)->io_address;
+    volatile tty_real_device_t *tty_rd
+        = (tty_real_device_t *)((device_t *)device)->real_device;
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(tty_rd->slock);
+
+    while (TTY_STATUS_RAVAIL(iobase->status)) {
+        char data = iobase->data;
+        int index;
+
+        if (tty_rd->read_count > TTY_BUF_SIZE)
+            continue;
+
+        index = (tty_rd->read_head + tty_rd->read_count) % TTY_BUF_SIZE;
+
+        tty_rd->read_buf[index] = data;
+        tty_rd->read_count++;
+    }
+
+    spinlock_release(tty_rd->slock);
+    sleepq_wake_all((void *)tty_rd->read_buf);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * TTY's interrupt handler. Acknowledges the interrupt and leaves the
+ * actual work for the deferred work thread. On WIRQ write interrupts
+ * are disabled until the internal buffer of tty_real_device_t has
+ * been written to the data port. On RIRQ the data port is read to
+ * the internal buffer.
+ *
+ * @param device Pointer to the TTY device.
+ */
+void tty_interrupt_handle(device_t *device) {
+    volatile tty_io_area_t *iobase = (tty_io_area_t *)device->io_address;
+    volatile tty_real_device_t *tty_rd
+        = (tty_real_device_t *)device->real_device;
+
+    if(TTY_STATUS_WIRQ(iobase->status)) {
+        spinlock_acquire(tty_rd->slock);
+
+        iobase->command = TTY_COMMAND_WIRQD;
+        iobase->command = TTY_COMMAND_WIRQ;
+        defer_work((defer_item_t *)&tty_rd->write_work);
+
+        spinlock_release(tty_rd->slock);
+    }
+
+    if(TTY_STATUS_RIRQ(iobase->status)) {
+        spinlock_acquire(tty_rd->slock);
+
+        iobase->command = TTY_COMMAND_RIRQ;
+
+        if (TTY_STATUS_ERROR(iobase->status))
+            KERNEL_PANIC("Could not issue RIRQ to TTY.");
+
+        defer_work((defer_item_t *)&tty_rd->read_work);
+
+        spinlock_release(tty_rd->slock);
+    }
+}
+#else
 /**
  * TTY's interrupt handler. Functinality depends on status of TTY's
  * status port. On WIRQ status writes internal buffer from
@@ -184,6 +293,8 @@ void tty_interrupt_handle(device_t *device) {
     }
 }
 
+#endif
+
 /**
  * Writes len bytes from buffer buf to tty-device
  * pointed by gcd. Implements write from the gbd interface.
@@ -40,6 +40,9 @@
 #include "kernel/spinlock.h"
 #include "drivers/gcd.h"
 #include "drivers/yams.h"
+#ifdef CHANGED_1
+#include "kernel/defer.h"
+#endif
 
 /* The structure of the YAMS TTY IO area */
 typedef struct {
@@ -98,6 +101,11 @@ typedef struct {
     char write_buf[TTY_BUF_SIZE]; /* write buffer */
     int write_head;               /* index to the beginning of data */
     int write_count;              /* number of chars in buffers */
+
+#ifdef CHANGED_1
+    defer_item_t write_work;      /* deferred part of WIRQ */
+    defer_item_t read_work;       /* deferred part of RIRQ */
+#endif
 } tty_real_device_t;
 
 
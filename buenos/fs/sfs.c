@@ -3,6 +3,7 @@
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
 #include "kernel/semaphore.h"
+#include "kernel/rwlock.h"
 #include "vm/pagepool.h"
 #include "drivers/gbd.h"
 #include "fs/vfs.h"
@@ -15,10 +16,8 @@
 /* Data structure used to represent an open file in sfs file system */
 
 typedef struct {
-    //lock guarding write
-    lock_t *lock;
-    //semaphore guarding concurrent readers
-    semaphore_t *sem; 
+    //reader-writer lock, writes exclude everything else
+    rwlock_t *rwlock;
     int open_count, is_deleted;
     uint32_t file_block;
 } sfs_open_file_t;
@@ -516,14 +515,9 @@ int sfs_open(fs_t *fs, char *filename) {
             goto error;
 
         sfs_open_file_t f;
-        f.lock = lock_create();
-        if(f.lock == NULL)
-            goto error;
-        f.sem = semaphore_create(SFS_MAX_READERS);
-        if(f.sem == NULL) {
-            lock_destroy(f.lock);
+        f.rwlock = rwlock_create();
+        if(f.rwlock == NULL)
             goto error;
-        }
         f.is_deleted = 0;
         f.file_block = file_inode;
         f.open_count = 0;
@@ -900,13 +894,9 @@ int sfs_close(fs_t *fs, int fileid)
             sfs_write_bab_cache(sfs);
         }
 
-        lock_acquire(f->lock);
-        int i;
-        for(i = 0; i < SFS_MAX_READERS; i++) {
-            semaphore_P(f->sem);
-        }
-        semaphore_destroy(f->sem);
-        lock_destroy(f->lock);
+        //wait for operations still in progress
+        rwlock_write_acquire(f->rwlock);
+        rwlock_destroy(f->rwlock);
     }
     lock_release(sfs->lock);
     return VFS_OK;
@@ -1056,7 +1046,7 @@ int sfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 {
     sfs_t *sfs = fs->internal;
     sfs_open_file_t* f = &(sfs->open_files[fileid]);
-    semaphore_P(f->sem);
+    rwlock_read_acquire(f->rwlock);
 
     DEBUG("sfsdebug", "SFS_read: start with offset %d, size %d open count %d\n", offset, bufsize, f->open_count);
 
@@ -1064,7 +1054,7 @@ int sfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 
     uint32_t addr = pagepool_get_phys_page();
     if (addr == 0) {
-        semaphore_V(f->sem);
+        rwlock_read_release(f->rwlock);
         return VFS_ERROR;
     }
     addr = ADDR_PHYS_TO_KERNEL(addr);
@@ -1116,11 +1106,11 @@ int sfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 success:
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
     DEBUG("sfsdebug", "SFS_read: end with offset %d,  open count %d\n", offset, f->open_count);
-    semaphore_V(f->sem);
+    rwlock_read_release(f->rwlock);
     return read;
 error:
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
-    semaphore_V(f->sem);
+    rwlock_read_release(f->rwlock);
     return VFS_ERROR;
 }
 
@@ -1218,23 +1208,17 @@ int sfs_write_indirect3_blocks(sfs_t *sfs, void **buffer, char *raw_buffer, uint
  */ 
 int sfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 {
-    int i;
     int retval = 0;
     sfs_t *sfs = fs->internal;
     
     DEBUG("sfsdebug", "SFS_write: file with handle %d. offset %d, len %d datasize\n", fileid, offset, datasize);
     sfs_open_file_t* f = &(sfs->open_files[fileid]);
     DEBUG("sfsdebug", "SFS_write: file with handle %d open_count %d\n", fileid, f->open_count);
-    //lock this up so that only one thread can access the semaphore
+    //exclude other writers and all readers
     DEBUG("sfsdebug", "SFS_write: file  waiting for lock\n");
-    lock_acquire(f->lock);
-    DEBUG("sfsdebug", "SFS_write: file  got lock waiting sem\n");
-    //starve all the readers out
-    for(i = 0; i < SFS_MAX_READERS; i++) {
-        semaphore_P(f->sem);
-    }
+    rwlock_write_acquire(f->rwlock);
     KERNEL_ASSERT(!(f->file_block <= sfs->bab_count || f->file_block >= sfs->block_count));
-    DEBUG("sfsdebug", "SFS_write: got all readers\n");
+    DEBUG("sfsdebug", "SFS_write: got lock\n");
 
     uint32_t addr = pagepool_get_phys_page();
     if (addr == 0) {
@@ -1300,13 +1284,8 @@ int sfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 exit1:
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
 exit2:
-    //free all readers 
-    DEBUG("sfsdebug", "SFS_write: DONE release the hounds(readers)\n");
-    for(i = 0; i < SFS_MAX_READERS; i++) {
-        semaphore_V(f->sem);
-    }
-    DEBUG("sfsdebug", "SFS_write: release read lock\n");
-    lock_release(f->lock);
+    DEBUG("sfsdebug", "SFS_write: release lock\n");
+    rwlock_write_release(f->rwlock);
     return retval;
 }
 
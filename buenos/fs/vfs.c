@@ -36,12 +36,20 @@
 
 #include "fs/vfs.h"
 #include "kernel/semaphore.h"
+#include "kernel/rwlock.h"
+#include "kernel/lock_cond.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleepq.h"
+#include "kernel/interrupt.h"
 #include "kernel/assert.h"
 #include "kernel/config.h"
 #include "lib/libc.h"
 #include "drivers/device.h"
 #include "fs/tfs.h"
 #include "fs/filesystems.h"
+#ifdef CHANGED_4
+#include "proc/textcache.h"
+#endif
 
 /** @name Virtual Filesystem
  *
@@ -70,6 +78,17 @@ typedef struct {
 
     /* Current seek position in the file. */
     int seek_position;
+
+    /* Serializes read, write and seek of this open file, so that
+       each of them sees the position left by the previous one. */
+    lock_t *lock;
+
+    /* Number of operations in progress, protected by the spinlock of
+       the table. The file is closed when it drops to zero. */
+    int refcount;
+
+    /* 1 while the file is being closed, no new operations start. */
+    int closing;
 } openfile_entry_t;
 
 
@@ -85,8 +104,14 @@ static struct {
 
 /* Table of open files. */
 static struct {
-    /* Binary semaphore for locking this table. */
-    semaphore_t *sem;
+    /* Lock for this table. Operations on one open file (read, write,
+       seek) hold it for reading while they pin the entry, allocating
+       and freeing entries holds it for writing. The filesystem call
+       is made without it. */
+    rwlock_t *rwlock;
+
+    /* Protects the reference counts and closing flags of the entries */
+    spinlock_t slock;
 
     /* Table of open files. */
     openfile_entry_t files[CONFIG_MAX_OPEN_FILES];
@@ -123,9 +148,10 @@ void vfs_init(void)
     int i;
 
     vfs_table.sem = semaphore_create(1);
-    openfile_table.sem = semaphore_create(1);
+    openfile_table.rwlock = rwlock_create();
+    spinlock_reset(&openfile_table.slock);
 
-    KERNEL_ASSERT(vfs_table.sem != NULL && openfile_table.sem != NULL);
+    KERNEL_ASSERT(vfs_table.sem != NULL && openfile_table.rwlock != NULL);
 
     /* Clear table of mounted filesystems. */
     for(i=0; i<CONFIG_MAX_FILESYSTEMS; i++) {
@@ -135,6 +161,8 @@ void vfs_init(void)
     /* Clear table of open files. */
     for (i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
         openfile_table.files[i].filesystem = NULL;
+        openfile_table.files[i].refcount = 0;
+        openfile_table.files[i].closing = 0;
     }
 
     vfs_op_sem = semaphore_create(1);
@@ -174,7 +202,7 @@ void vfs_deinit(void)
     }
 
     semaphore_P(vfs_table.sem);
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(openfile_table.rwlock);
     
     for (row = 0; row < CONFIG_MAX_FILESYSTEMS; row++) {
         fs = vfs_table.filesystems[row].filesystem;
@@ -186,7 +214,7 @@ void vfs_deinit(void)
         }
     }
 
-    semaphore_V(openfile_table.sem);
+    rwlock_write_release(openfile_table.rwlock);
     semaphore_V(vfs_table.sem);
     semaphore_V(vfs_op_sem);
 }
@@ -521,10 +549,10 @@ int vfs_unmount(char *name)
         return VFS_NOT_FOUND;
     }
     
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(openfile_table.rwlock);
     for(i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
         if(openfile_table.files[i].filesystem == fs) {
-            semaphore_V(openfile_table.sem);
+            rwlock_write_release(openfile_table.rwlock);
             semaphore_V(vfs_table.sem);
             vfs_end_op();
             return VFS_IN_USE;
@@ -534,7 +562,7 @@ int vfs_unmount(char *name)
     fs->unmount(fs);
     vfs_table.filesystems[row].filesystem = NULL;
     
-    semaphore_V(openfile_table.sem);
+    rwlock_write_release(openfile_table.rwlock);
     semaphore_V(vfs_table.sem);
     vfs_end_op();
     return VFS_OK;
@@ -572,7 +600,7 @@ openfile_t vfs_open(char *pathname)
     }
 
     semaphore_P(vfs_table.sem);
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(openfile_table.rwlock);
     
     for(file=0; file<CONFIG_MAX_OPEN_FILES; file++) {
         if(openfile_table.files[file].filesystem == NULL) {
@@ -581,7 +609,7 @@ openfile_t vfs_open(char *pathname)
     }
 
     if(file >= CONFIG_MAX_OPEN_FILES) {
-        semaphore_V(openfile_table.sem);
+        rwlock_write_release(openfile_table.rwlock);
         semaphore_V(vfs_table.sem);
         kprintf("VFS: Warning, maximum number of open files exceeded.");
         vfs_end_op();
@@ -591,7 +619,7 @@ openfile_t vfs_open(char *pathname)
     fs = vfs_get_filesystem(volumename);
 
     if(fs == NULL) {
-        semaphore_V(openfile_table.sem);
+        rwlock_write_release(openfile_table.rwlock);
         semaphore_V(vfs_table.sem);
         vfs_end_op();
         return VFS_NO_SUCH_FS;
@@ -599,19 +627,29 @@ openfile_t vfs_open(char *pathname)
 
     openfile_table.files[file].filesystem = fs;
 
-    semaphore_V(openfile_table.sem);
+    rwlock_write_release(openfile_table.rwlock);
     semaphore_V(vfs_table.sem);
 
     fileid = fs->open(fs, filename);
 
     if(fileid < 0) {
-        semaphore_P(openfile_table.sem);
+        rwlock_write_acquire(openfile_table.rwlock);
         openfile_table.files[file].filesystem = NULL;
-        semaphore_V(openfile_table.sem);
+        rwlock_write_release(openfile_table.rwlock);
         vfs_end_op();
         return fileid; /* negative -> error*/
     }
 
+    openfile_table.files[file].lock = lock_create();
+    if (openfile_table.files[file].lock == NULL) {
+        fs->close(fs, fileid);
+        rwlock_write_acquire(openfile_table.rwlock);
+        openfile_table.files[file].filesystem = NULL;
+        rwlock_write_release(openfile_table.rwlock);
+        vfs_end_op();
+        return VFS_LIMIT;
+    }
+
     openfile_table.files[file].fileid = fileid;
     openfile_table.files[file].seek_position = 0;
 
@@ -640,6 +678,58 @@ static openfile_entry_t *vfs_verify_open(openfile_t file)
     return openfile;
 }
 
+/**
+ * Pins an open file for the duration of an operation, so that it is
+ * not closed under the operation. The table lock is not held after
+ * this returns. Release with vfs_unpin_open().
+ *
+ * @param file Openfile id.
+ *
+ * @return Pointer to openfile table row, NULL if the file is being
+ * closed.
+ */
+
+static openfile_entry_t *vfs_pin_open(openfile_t file)
+{
+    openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
+
+    rwlock_read_acquire(openfile_table.rwlock);
+    openfile = vfs_verify_open(file);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile_table.slock);
+    if (openfile->closing)
+        openfile = NULL;
+    else
+        openfile->refcount++;
+    spinlock_release(&openfile_table.slock);
+    _interrupt_set_state(intr_status);
+
+    rwlock_read_release(openfile_table.rwlock);
+    return openfile;
+}
+
+/**
+ * Releases an open file pinned with vfs_pin_open(), waking up a
+ * close waiting for the operation.
+ *
+ * @param openfile Pointer to openfile table row.
+ */
+
+static void vfs_unpin_open(openfile_entry_t *openfile)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile_table.slock);
+    KERNEL_ASSERT(openfile->refcount > 0);
+    if (--openfile->refcount == 0 && openfile->closing)
+        sleepq_wake(&openfile->refcount);
+    spinlock_release(&openfile_table.slock);
+    _interrupt_set_state(intr_status);
+}
+
 
 /**
  * Close open file.
@@ -653,21 +743,53 @@ static openfile_entry_t *vfs_verify_open(openfile_t file)
 int vfs_close(openfile_t file)
 {
     openfile_entry_t *openfile;
+    interrupt_status_t intr_status;
     fs_t *fs;
     int ret;
 
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(openfile_table.rwlock);
 
     openfile = vfs_verify_open(file);
     fs = openfile->filesystem;
 
+    /* stop new operations and wait for the ones in progress; the
+       entry stays allocated meanwhile */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile_table.slock);
+    if (openfile->closing) {
+        spinlock_release(&openfile_table.slock);
+        _interrupt_set_state(intr_status);
+        rwlock_write_release(openfile_table.rwlock);
+        vfs_end_op();
+        return VFS_ERROR;
+    }
+    openfile->closing = 1;
+    spinlock_release(&openfile_table.slock);
+    _interrupt_set_state(intr_status);
+
+    rwlock_write_release(openfile_table.rwlock);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&openfile_table.slock);
+    while (openfile->refcount > 0) {
+        sleepq_add(&openfile->refcount);
+        spinlock_release(&openfile_table.slock);
+        thread_switch();
+        spinlock_acquire(&openfile_table.slock);
+    }
+    spinlock_release(&openfile_table.slock);
+    _interrupt_set_state(intr_status);
+
     ret = fs->close(fs, openfile->fileid);
-    openfile->filesystem = NULL;
+    lock_destroy(openfile->lock);
 
-    semaphore_V(openfile_table.sem);
+    rwlock_write_acquire(openfile_table.rwlock);
+    openfile->closing = 0;
+    openfile->filesystem = NULL;
+    rwlock_write_release(openfile_table.rwlock);
     
     vfs_end_op();
     return ret;
@@ -694,16 +816,58 @@ int vfs_seek(openfile_t file, int seek_position)
         return VFS_UNUSABLE;
 
     KERNEL_ASSERT(seek_position >= 0);
-    semaphore_P(openfile_table.sem);
 
-    openfile = vfs_verify_open(file);
+    openfile = vfs_pin_open(file);
+    if (openfile == NULL) {
+        vfs_end_op();
+        return VFS_ERROR;
+    }
+
+    lock_acquire(openfile->lock);
     openfile->seek_position = seek_position;
+    lock_release(openfile->lock);
+
+    vfs_unpin_open(openfile);
+
+    vfs_end_op();
+    return VFS_OK;
+}
+
+
+#ifdef CHANGED_4
+/**
+ * Tells which file an open file is. Two open files are the same file
+ * when both the filesystem and the file id are the same.
+ *
+ * @param file Open file
+ *
+ * @param filesystem The filesystem of the file is returned here
+ *
+ * @param fileid The filesystem specific id of the file is returned here
+ *
+ * @return VFS_OK on success, negative (VFS_*) on error.
+ *
+ */
+
+int vfs_getidentity(openfile_t file, fs_t **filesystem, int *fileid)
+{
+    openfile_entry_t *openfile;
+
+    if (vfs_start_op() != VFS_OK)
+        return VFS_UNUSABLE;
+
+    rwlock_read_acquire(openfile_table.rwlock);
+
+    openfile = vfs_verify_open(file);
+    *filesystem = openfile->filesystem;
+    *fileid = openfile->fileid;
 
-    semaphore_V(openfile_table.sem);
+    rwlock_read_release(openfile_table.rwlock);
 
     vfs_end_op();
     return VFS_OK;
 }
+#endif
 
 
 /**
@@ -731,20 +895,28 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    openfile = vfs_verify_open(file);
+    /* keep the file from being closed under us */
+    openfile = vfs_pin_open(file);
+    if (openfile == NULL) {
+        vfs_end_op();
+        return VFS_ERROR;
+    }
     fs = openfile->filesystem;
 
     KERNEL_ASSERT(bufsize >= 0 && buffer != NULL);
 
+    lock_acquire(openfile->lock);
+
     ret = fs->read(fs, openfile->fileid, buffer, bufsize, 
                         openfile->seek_position);
 
     if(ret > 0) {
-        semaphore_P(openfile_table.sem);
         openfile->seek_position += ret;
-        semaphore_V(openfile_table.sem);
     }
 
+    lock_release(openfile->lock);
+    vfs_unpin_open(openfile);
+
     vfs_end_op();
     return ret;
 }
@@ -771,23 +943,43 @@ int vfs_write(openfile_t file, void *buffer, int datasize)
     openfile_entry_t *openfile;
     fs_t *fs;
     int ret;
+#ifdef CHANGED_4
+    int fileid;
+#endif
 
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    openfile = vfs_verify_open(file);
+    /* keep the file from being closed under us */
+    openfile = vfs_pin_open(file);
+    if (openfile == NULL) {
+        vfs_end_op();
+        return VFS_ERROR;
+    }
     fs = openfile->filesystem;
 
     KERNEL_ASSERT(datasize >= 0 && buffer != NULL);
 
+    lock_acquire(openfile->lock);
+
     ret = fs->write(fs, openfile->fileid, buffer, datasize, 
                          openfile->seek_position);
 
     if(ret > 0) {
-        semaphore_P(openfile_table.sem);
         openfile->seek_position += ret;
-        semaphore_V(openfile_table.sem);
     }
+#ifdef CHANGED_4
+    fileid = openfile->fileid;
+#endif
+
+    lock_release(openfile->lock);
+    vfs_unpin_open(openfile);
+
+#ifdef CHANGED_4
+    /* new processes must not share the old text of an executable */
+    if (ret > 0)
+        textcache_invalidate(fs, fileid);
+#endif
 
     vfs_end_op();
     return ret;
@@ -864,6 +1056,9 @@ int vfs_remove(char *pathname)
     #endif
     fs_t *fs = NULL;
     int ret;
+#ifdef CHANGED_4
+    int fileid;
+#endif
 
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
@@ -883,7 +1078,19 @@ int vfs_remove(char *pathname)
         return VFS_NO_SUCH_FS;
     }
 
+#ifdef CHANGED_4
+    /* a file created later under this name may get the same id */
+    fileid = fs->open(fs, filename);
+    if (fileid >= 0)
+        fs->close(fs, fileid);
+#endif
+
     ret = fs->remove(fs, filename);
+
+#ifdef CHANGED_4
+    if (ret == VFS_OK && fileid >= 0)
+        textcache_invalidate(fs, fileid);
+#endif
     
     semaphore_V(vfs_table.sem);
 
@@ -150,6 +150,9 @@ int vfs_close(openfile_t file);
 int vfs_seek(openfile_t file, int seek_position);
 int vfs_read(openfile_t file, void *buffer, int bufsize);
 int vfs_write(openfile_t file, void *buffer, int datasize);
+#ifdef CHANGED_4
+int vfs_getidentity(openfile_t file, fs_t **filesystem, int *fileid);
+#endif
 
 int vfs_create(char *pathname, int size);
 int vfs_remove(char *pathname);
@@ -56,6 +56,13 @@
 #include "net/network.h"
 #include "proc/process.h"
 #include "vm/vm.h"
+#ifdef CHANGED_1
+    #include "kernel/rwlock.h"
+    #include "kernel/defer.h"
+#endif
+#ifdef CHANGED_2
+    #include "proc/futex.h"
+#endif
 
 #ifdef CHANGED_1
     #include "kernel_tests/lock_test.h"
@@ -63,6 +70,7 @@
     #include "kernel_tests/sleep_test.h"
     #include "kernel_tests/phone_system.h"
     #include "kernel_tests/priority_test.h"
+    #include "kernel_tests/thread_test.h"
 #endif
 
 #ifdef CHANGED_3
@@ -129,6 +137,9 @@ void init_startup_fallback(void) {
         if (bootargs_get("priority_test") != NULL) {
             priority_test_main();
         }
+        if (bootargs_get("thread_test") != NULL) {
+            thread_test_main();
+        }
 
     #endif
 
@@ -253,6 +264,9 @@ void init(void)
     #ifdef CHANGED_1
       kwrite("Initializing locks and condition variables\n");
       lock_cond_init();
+
+      kwrite("Initializing reader-writer locks\n");
+      rwlock_init();
     #endif
 
     #ifdef CHANGED_2
@@ -272,6 +286,18 @@ void init(void)
     kwrite("Initializing virtual memory\n");
     vm_init();
 
+    #ifdef CHANGED_2
+      /* needs the size of the virtual page pool */
+      kwrite("Initializing futexes\n");
+      futex_init();
+    #endif
+
+    #ifdef CHANGED_1
+      /* needs the page pool for the thread stacks */
+      kwrite("Starting deferred work threads\n");
+      defer_init(numcpus);
+    #endif
+
     kprintf("Creating initialization thread\n");
     startup_thread = thread_create(&init_startup_thread, 0);
     thread_run(startup_thread);
@@ -40,7 +40,12 @@
 /* Define the maximum number of threads supported by the kernel 
  * Range from 2 (idle + init) to 256 (ASID size)
  */
-#define CONFIG_MAX_THREADS 32
+#ifdef CHANGED_1
+  /* kernel stacks are allocated on demand, so the table is cheap */
+  #define CONFIG_MAX_THREADS 256
+#else
+  #define CONFIG_MAX_THREADS 32
+#endif
 
 /* Size of the stack of a kernel thread */
 #define CONFIG_THREAD_STACKSIZE 4096
@@ -63,21 +68,70 @@
  */ 
 #define CONFIG_BOOTARGS_MAX 32
 
-/* Define the maximum number of semaphores.
+/* Define the maximum number of semaphores. With CHANGED_1 this is
+ * the size of the static table, more are allocated from the page pool.
  * Range from 16 to 1024
  */
 #define CONFIG_MAX_SEMAPHORES 128
 
 #ifdef CHANGED_1
-  /* Define the maximum number of locks.
+  /* Define the number of statically allocated locks, more are
+   * allocated from the page pool when needed.
    * Range from 16 to 1024
    */
   #define CONFIG_MAX_LOCKS 128
 
-  /* Define the maximum number of condition variables.
+  /* Define the number of statically allocated condition variables, more are
+   * allocated from the page pool when needed.
    * Range from 16 to 1024
    */
   #define CONFIG_MAX_CONDITION_VARIABLES 128
+
+  /* Define the number of statically allocated reader-writer locks, more are
+   * allocated from the page pool when needed.
+   * Range from 16 to 1024
+   */
+  #define CONFIG_MAX_RWLOCKS 128
+
+  /* Define how many times lock_acquire() polls a lock whose owner is
+   * running on another CPU before going to sleep. 0 disables spinning.
+   * Range from 0 to 100000
+   */
+  #define CONFIG_LOCK_SPIN_COUNT 1000
+
+  /* Define the number of levels in the multi-level feedback queue
+   * scheduler. Level 0 is the highest priority level and is used only
+   * by PRIORITY_HIGH threads. The timeslice doubles on every level.
+   * Range from 2 to 8
+   */
+  #define CONFIG_SCHEDULER_LEVELS 4
+
+  /* Define the interval in milliseconds after which all ready threads
+   * are moved back to their base scheduling level, so that threads
+   * demoted to the lowest levels cannot starve.
+   * Range from 10 to 10000
+   */
+  #define CONFIG_SCHEDULER_BOOST_INTERVAL 250
+
+  /* Define whether idle CPUs stop the periodic timer interrupt. When
+   * enabled, a CPU with nothing to run programs its timer only for
+   * the next thread_sleep() deadline and is otherwise woken up by an
+   * inter-CPU interrupt when work arrives.
+   * Range from 0 to 1
+   */
+  #define CONFIG_SCHEDULER_TICKLESS 1
+
+  /* Define whether the scheduler records events and per-thread run
+   * time statistics (see kernel/schedtrace.h). When 0 the tracing
+   * code is not compiled in at all.
+   * Range from 0 to 1
+   */
+  #define CONFIG_SCHEDULER_TRACE 1
+
+  /* Define the number of events in the trace ring buffer of each CPU.
+   * Range from 16 to 4096
+   */
+  #define CONFIG_SCHEDULER_TRACE_EVENTS 256
 #endif
 
 /* Define maximum number of devices.
@@ -128,4 +182,49 @@
     #define CONFIG_MAX_PROCESS_COUNT 64
 #endif
 
+#ifdef CHANGED_4
+  /* The pageout daemon starts freeing physical pages when fewer than
+   * the low watermark are free, and stops at the high watermark.
+   * Range from 1 to 64
+   */
+  #define CONFIG_PAGEOUT_LOW_WATERMARK 4
+  #define CONFIG_PAGEOUT_HIGH_WATERMARK 8
+
+  /* Maximum number of page writes the pageout daemon has in progress
+   * at a time.
+   * Range from 1 to 64
+   */
+  #define CONFIG_PAGEOUT_BATCH 4
+
+  /* Maximum number of pages read ahead after a fault when a process
+   * faults on consecutive pages.
+   * Range from 0 to 64
+   */
+  #define CONFIG_READAHEAD_MAX_PAGES 8
+
+  /* Number of read-ahead requests that can wait for the pageout
+   * daemon. Requests beyond this are dropped.
+   * Range from 1 to 256
+   */
+  #define CONFIG_READAHEAD_QUEUE_SIZE 16
+
+  /* Number of distinct executables whose read-only segment can be
+   * shared between the processes running it at a time.
+   * Range from 1 to 64
+   */
+  #define CONFIG_TEXTCACHE_ENTRIES 16
+
+  /* Maximum number of threads in one userland process, including the
+   * first one. Each has its own stack of CONFIG_USERLAND_STACK_SIZE
+   * pages below USERLAND_STACK_TOP.
+   * Range from 1 to 64
+   */
+  #define CONFIG_MAX_PROCESS_THREADS 8
+
+  /* Number of shared memory segments that can exist at a time.
+   * Range from 1 to 32
+   */
+  #define CONFIG_SHM_SEGMENTS 16
+#endif
+
 #endif /* BUENOS_CONFIG_H */
@@ -0,0 +1,163 @@
+#ifdef CHANGED_1
+
+#include "kernel/defer.h"
+#include "kernel/config.h"
+#include "kernel/thread.h"
+#include "kernel/sleepq.h"
+#include "kernel/interrupt.h"
+#include "kernel/panic.h"
+#include "kernel/spinlock.h"
+#include "lib/libc.h"
+
+/** @name Deferred work
+ *
+ * Interrupt handlers do only what must be done at once, usually
+ * acknowledging the device, and leave the rest to defer_work(). The
+ * work is run soon after by a high priority kernel thread of the
+ * same CPU, with interrupts enabled.
+ *
+ * Each CPU has its own queue of items. An item stays in the driver
+ * data of its device and is queued at most once, so the queues never
+ * fill up and the work is never run in the interrupt, where it could
+ * deadlock on the locks held by the interrupted code or the handler.
+ * The queues and the pending flags of the items are protected by
+ * defer_slock, because the interrupts of a device may be taken on
+ * any CPU.
+ *
+ * @{
+ */
+
+typedef struct {
+    /* oldest and newest queued item */
+    defer_item_t *head;
+    defer_item_t *tail;
+    /* whether the worker thread sleeps waiting for work */
+    int idle;
+} defer_queue_t;
+
+static defer_queue_t defer_queues[CONFIG_MAX_CPUS];
+static spinlock_t defer_slock;
+
+/* Worker thread of a CPU. Runs the queued work in FIFO order. */
+static void defer_worker(uint32_t cpu)
+{
+    defer_queue_t *queue = &defer_queues[cpu];
+    interrupt_status_t intr_status;
+    defer_item_t *item;
+
+    /* stay on our own CPU, only it adds to the queue */
+    if (thread_set_affinity(1 << cpu) < 0)
+        KERNEL_PANIC("Deferred work thread could not be pinned");
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&defer_slock);
+    while (1) {
+        while (queue->head == NULL) {
+            queue->idle = 1;
+            sleepq_add(queue);
+            spinlock_release(&defer_slock);
+            thread_switch();
+            spinlock_acquire(&defer_slock);
+        }
+
+        item = queue->head;
+        queue->head = item->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        /* work arriving from now on queues the item again */
+        item->pending = 0;
+
+        spinlock_release(&defer_slock);
+        _interrupt_set_state(intr_status);
+        item->func(item->arg);
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&defer_slock);
+    }
+}
+
+/**
+ * Initializes the queues and starts a worker thread for each CPU.
+ *
+ * @param num_cpus Number of CPUs in the system
+ */
+void defer_init(int num_cpus)
+{
+    TID_t worker;
+    int i;
+
+    spinlock_reset(&defer_slock);
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        defer_queues[i].head = NULL;
+        defer_queues[i].tail = NULL;
+        defer_queues[i].idle = 0;
+    }
+
+    for (i = 0; i < num_cpus; i++) {
+        worker = thread_create_priority(&defer_worker, i, PRIORITY_HIGH);
+        if (worker < 0)
+            KERNEL_PANIC("Could not create deferred work threads");
+        thread_run(worker);
+    }
+}
+
+/**
+ * Initializes a deferred work item, which calls func(arg) each time
+ * it is run.
+ *
+ * @param item The item to initialize
+ * @param func Function to call, must not block
+ * @param arg Argument given to func
+ */
+void defer_item_init(defer_item_t *item, defer_func_t func, void *arg)
+{
+    item->func = func;
+    item->arg = arg;
+    item->pending = 0;
+    item->next = NULL;
+}
+
+/**
+ * Queues the item to be run by the worker thread of the current CPU,
+ * unless it is already queued. May be called from interrupt handlers.
+ *
+ * @param item The work to do
+ */
+void defer_work(defer_item_t *item)
+{
+    interrupt_status_t intr_status;
+    defer_queue_t *queue;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&defer_slock);
+
+    if (item->pending) {
+        /* the queued run will do this work too */
+        spinlock_release(&defer_slock);
+        _interrupt_set_state(intr_status);
+        return;
+    }
+
+    queue = &defer_queues[_interrupt_getcpu()];
+    item->pending = 1;
+    item->next = NULL;
+    if (queue->tail == NULL)
+        queue->head = item;
+    else
+        queue->tail->next = item;
+    queue->tail = item;
+
+    if (queue->idle) {
+        queue->idle = 0;
+        sleepq_wake(queue);
+        /* reschedule when the interrupt returns, the worker has
+           higher priority than most threads */
+        _interrupt_generate_sw0();
+    }
+
+    spinlock_release(&defer_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
+
+#endif
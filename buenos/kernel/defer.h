@@ -0,0 +1,26 @@
+#ifdef CHANGED_1
+
+#ifndef BUENOS_KERNEL_DEFER_H
+#define BUENOS_KERNEL_DEFER_H
+
+/* A function to be called later by the deferred work thread */
+typedef void (*defer_func_t)(void *arg);
+
+/* A piece of deferred work, kept in the driver data of a device. It
+   is queued at most once at a time: deferring it again before it has
+   run does nothing, so func must do all the work piled up meanwhile. */
+typedef struct defer_item_struct {
+    defer_func_t func;
+    void *arg;
+    /* whether the item is queued */
+    int pending;
+    struct defer_item_struct *next;
+} defer_item_t;
+
+void defer_init(int num_cpus);
+void defer_item_init(defer_item_t *item, defer_func_t func, void *arg);
+void defer_work(defer_item_t *item);
+
+#endif
+
+#endif
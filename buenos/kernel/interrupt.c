@@ -59,6 +59,24 @@ uint32_t interrupt_stacks[CONFIG_MAX_CPUS];
 /* Table for the registered interrupt handlers */
 static interrupt_entry_t interrupt_handlers[CONFIG_MAX_DEVICES];
 
+#ifdef CHANGED_1
+/* Number of interrupt lines, the Cause bits 8-15 */
+#define INTERRUPT_LINES 8
+#define INTERRUPT_LINE_SHIFT 8
+
+/* Handlers of each interrupt line as indices to interrupt_handlers,
+   in registration order. A handler registered for several lines is
+   in the list of each of them. */
+#if CONFIG_MAX_DEVICES > 256
+#error "interrupt_line_handlers holds handler indices in bytes"
+#endif
+static uint8_t interrupt_line_handlers[INTERRUPT_LINES][CONFIG_MAX_DEVICES];
+static int interrupt_line_count[INTERRUPT_LINES];
+
+/* Number of registered handlers */
+static int interrupt_handler_count;
+#endif
+
 
 /** Initializes interrupt handling. Allocates interrupt stacks for
  * each processor, initializes the interrupt vectors and initializes
@@ -99,6 +117,12 @@ void interrupt_init(int num_cpus) {
         interrupt_handlers[i].irq = 0;
         interrupt_handlers[i].handler = NULL;
     }
+
+#ifdef CHANGED_1
+    for (i=0; i<INTERRUPT_LINES; i++)
+        interrupt_line_count[i] = 0;
+    interrupt_handler_count = 0;
+#endif
 }
 
 
@@ -116,6 +140,9 @@ void interrupt_register(uint32_t irq,
                         device_t *device)
 {
     int i = 0;
+#ifdef CHANGED_1
+    int line;
+#endif
 
     /* Check that IRQ mask is sane */
     if ((irq & ~(uint32_t)INTERRUPT_MASK_ALL)!= 0) {
@@ -127,7 +154,11 @@ void interrupt_register(uint32_t irq,
      * are enabled.
      */
 
+#ifdef CHANGED_1
+    i = interrupt_handler_count;
+#else
     while (interrupt_handlers[i].device != NULL && i < CONFIG_MAX_DEVICES) i++;
+#endif
 
     if (i >= CONFIG_MAX_DEVICES)
         KERNEL_PANIC("Interrupt handler table is full");
@@ -135,7 +166,49 @@ void interrupt_register(uint32_t irq,
     interrupt_handlers[i].device = device;
     interrupt_handlers[i].irq = irq;
     interrupt_handlers[i].handler = handler;
+
+#ifdef CHANGED_1
+    interrupt_handler_count++;
+
+    for (line = 0; line < INTERRUPT_LINES; line++) {
+        if (irq & (1 << (line + INTERRUPT_LINE_SHIFT))) {
+            interrupt_line_handlers[line][interrupt_line_count[line]] = i;
+            interrupt_line_count[line]++;
+        }
+    }
+#endif
+}
+
+#ifdef CHANGED_1
+/* Calls the handlers registered for the pending interrupt lines. The
+ * pending bits are taken highest first with count leading zeros, so
+ * only the lines which actually fired are looked at. A handler
+ * registered for several pending lines is called once, on the
+ * highest of them, like when the whole table was scanned.
+ */
+static void interrupt_dispatch(uint32_t cause)
+{
+    uint32_t pending = cause & INTERRUPT_MASK_ALL;
+    uint32_t bit, above;
+    interrupt_entry_t *entry;
+    int line, i;
+
+    while (pending != 0) {
+        line = 31 - _interrupt_clz(pending);
+        bit = 1 << line;
+        pending &= ~bit;
+        /* pending lines above this one, already dispatched */
+        above = (cause & INTERRUPT_MASK_ALL) & ~((bit << 1) - 1);
+
+        line -= INTERRUPT_LINE_SHIFT;
+        for (i = 0; i < interrupt_line_count[line]; i++) {
+            entry = &interrupt_handlers[interrupt_line_handlers[line][i]];
+            if ((entry->irq & above) == 0)
+                entry->handler(entry->device);
+        }
+    }
 }
+#endif
 
 
 /** Handles an interrupt (exception code 0). All interrupt handlers
@@ -148,7 +221,11 @@ void interrupt_register(uint32_t irq,
  * @param cause The Cause register from CP0
  */
 void interrupt_handle(uint32_t cause) {
+#ifdef CHANGED_1
+    int this_cpu;
+#else
     int this_cpu, i;
+#endif
     
     if(cause & INTERRUPT_CAUSE_SOFTWARE_0) {
         _interrupt_clear_sw0();
@@ -163,6 +240,9 @@ void interrupt_handle(uint32_t cause) {
     }
 
 
+#ifdef CHANGED_1
+    interrupt_dispatch(cause);
+#else
     /* Call appropiate interrupt handlers.  Handlers cannot be
      * unregistered, so after the first empty * entry all others are
      * also empty.
@@ -177,6 +257,7 @@ void interrupt_handle(uint32_t cause) {
         if ((cause & interrupt_handlers[i].irq) != 0)
             interrupt_handlers[i].handler(interrupt_handlers[i].device);
     }
+#endif
 
 
     /* Timer interrupt (HW5) or requested context switch (SW0)
@@ -188,7 +269,7 @@ void interrupt_handle(uint32_t cause) {
         scheduler_schedule();
         
         #ifdef CHANGED_4
-        _tlb_set_asid(thread_get_current_thread());
+        tlb_activate(thread_get_current_thread_entry()->pagetable);
         #else
         /* Until we have proper VM we must manually fill
            the TLB with pagetable entries before running code using
@@ -99,6 +99,9 @@ void _interrupt_clear_sw(void);
 void _interrupt_clear_sw0(void);
 void _interrupt_clear_sw1(void);
 int _interrupt_getcpu(void);
+#ifdef CHANGED_1
+int _interrupt_clz(uint32_t bits);
+#endif
 
 void _interrupt_set_EXL(void);
 void _interrupt_clear_EXL(void);
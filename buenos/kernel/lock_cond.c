@@ -6,84 +6,96 @@
 #include "kernel/config.h"
 #include "kernel/assert.h"
 #include "kernel/thread.h"
+#include "kernel/objpool.h"
 #include "lib/libc.h"
 #include "lib/debug.h"
 
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+
 /** Table containing all locks in the system */
 static lock_t lock_table[CONFIG_MAX_LOCKS];
 
-/** Lock which must be held before accessing the lock_table */
-static spinlock_t lock_table_slock;
+/** Free locks, starting with the lock_table */
+static objpool_t lock_pool;
 
 /** Table containing all condition variables in the system */
 static cond_t cond_table[CONFIG_MAX_CONDITION_VARIABLES];
 
-/** Lock which must be held before accessing the cond_table */
-static spinlock_t cond_table_slock;
+/** Free condition variables, starting with the cond_table */
+static objpool_t cond_pool;
 
 void lock_cond_init(void) {
-    int i;
-
-    spinlock_reset(&lock_table_slock);
-    for(i = 0; i < CONFIG_MAX_LOCKS; i++)
-        lock_table[i].created = 0;
-
-    spinlock_reset(&cond_table_slock);
-    for(i = 0; i < CONFIG_MAX_CONDITION_VARIABLES; i++)
-        cond_table[i].created = 0;
+    objpool_init(&lock_pool, lock_table, sizeof(lock_t), CONFIG_MAX_LOCKS);
+    objpool_init(&cond_pool, cond_table, sizeof(cond_t),
+                 CONFIG_MAX_CONDITION_VARIABLES);
 }
 
 lock_t *lock_create(void) {
-    interrupt_status_t intr_status;
-    static int next = 0;
-    int i;
-    int lock_id;
-
-    intr_status = _interrupt_disable();
-    spinlock_acquire(&lock_table_slock);
-
-    // find a free lock
-    for(i = 0; i < CONFIG_MAX_LOCKS; i++) {
-        lock_id = next;
-        next = (next + 1) % CONFIG_MAX_LOCKS;
-        if (lock_table[lock_id].created == 0) {
-            lock_table[lock_id].created = 1;
-            break;
-        }
-    }
-
-    spinlock_release(&lock_table_slock);
-    _interrupt_set_state(intr_status);
+    lock_t *lock;
 
-    if (i == CONFIG_MAX_LOCKS) {
-	/* lock table does not have any free locks, creation fails */
+    /* the pool grows past the table, so this fails only when out
+       of memory */
+    lock = objpool_get(&lock_pool);
+    if (lock == NULL)
         return NULL;
-    }
 
-    lock_table[lock_id].thread_count = 0;
-    spinlock_reset(&lock_table[lock_id].slock);
+    lock->created = 1;
+    lock->owner = -1;
+    lock->waiters = 0;
+    spinlock_reset(&lock->slock);
 
-    return &lock_table[lock_id];
+    return lock;
 }
 
 void lock_destroy(lock_t *lock) {
-    lock->created = 0; 
+    lock->created = 0;
+    objpool_put(&lock_pool, lock);
 }
 
+/* Whether it is worth spinning while the given thread holds a lock:
+   it must be running right now, on some other CPU than ours. */
+static int lock_owner_running(TID_t owner) {
+    return thread_table[owner].state == THREAD_RUNNING
+        && thread_table[owner].cpu != _interrupt_getcpu();
+}
+
+/**
+ * Acquires the lock. If the lock is held by a thread running on
+ * another CPU, it will likely be released soon, so the lock is
+ * polled up to CONFIG_LOCK_SPIN_COUNT times before going to sleep.
+ * A woken thread competes for the lock again with any newcomers.
+ */
 void lock_acquire(lock_t *lock) {
     interrupt_status_t intr_status;
+    volatile TID_t *owner = &lock->owner;
+    TID_t holder;
+    int spins = 0;
 
     intr_status = _interrupt_disable();
     spinlock_acquire(&lock->slock);
 
-    lock->thread_count++;
-    if (lock->thread_count > 1) {
+    while (lock->owner >= 0) {
+        holder = lock->owner;
+        if (spins < CONFIG_LOCK_SPIN_COUNT && lock_owner_running(holder)) {
+            /* spin without the spinlock until the owner changes */
+            spinlock_release(&lock->slock);
+            while (spins < CONFIG_LOCK_SPIN_COUNT && *owner == holder
+                   && lock_owner_running(holder))
+                spins++;
+            spinlock_acquire(&lock->slock);
+            continue;
+        }
+
+        lock->waiters++;
         sleepq_add(lock);
         spinlock_release(&lock->slock);
         thread_switch();
-    } else {
-        spinlock_release(&lock->slock);
+        spinlock_acquire(&lock->slock);
     }
+
+    lock->owner = thread_get_current_thread();
+
+    spinlock_release(&lock->slock);
     _interrupt_set_state(intr_status);
 }
 
@@ -93,8 +105,9 @@ void lock_release(lock_t *lock) {
     intr_status = _interrupt_disable();
     spinlock_acquire(&lock->slock);
 
-    lock->thread_count--;
-    if (lock->thread_count > 0) {
+    lock->owner = -1;
+    if (lock->waiters > 0) {
+        lock->waiters--;
         sleepq_wake(lock);
     }
 
@@ -103,37 +116,19 @@ void lock_release(lock_t *lock) {
 }
 
 cond_t *condition_create(void) {
-    interrupt_status_t intr_status;
-    static int next = 0;
-    int i;
-    int cond_id;
+    cond_t *cond;
 
-    intr_status = _interrupt_disable();
-    spinlock_acquire(&cond_table_slock);
-
-    // find a free condition variable
-    for(i = 0; i < CONFIG_MAX_CONDITION_VARIABLES; i++) {
-        cond_id = next;
-        next = (next + 1) % CONFIG_MAX_CONDITION_VARIABLES;
-        if (cond_table[cond_id].created == 0) {
-            cond_table[cond_id].created = 1;
-            break;
-        }
-    }
-
-    spinlock_release(&cond_table_slock);
-    _interrupt_set_state(intr_status);
-
-    if (i == CONFIG_MAX_CONDITION_VARIABLES) {
-	/* cond table does not have any free condition variables, creation fails */
+    cond = objpool_get(&cond_pool);
+    if (cond == NULL)
         return NULL;
-    }
 
-    return &cond_table[cond_id];
+    cond->created = 1;
+    return cond;
 }
 
 void condition_destroy(cond_t *cond) {
     cond->created = 0;
+    objpool_put(&cond_pool, cond);
 }
 
 void condition_wait(cond_t *cond, lock_t *condition_lock) {
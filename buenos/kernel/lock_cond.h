@@ -7,7 +7,10 @@
 
 typedef struct {
   spinlock_t slock;
-  int thread_count;
+  /* TID of the thread holding the lock, negative if free */
+  int owner;
+  /* number of threads sleeping on the lock */
+  int waiters;
   int created;
 } lock_t;
 
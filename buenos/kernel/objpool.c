@@ -0,0 +1,94 @@
+#ifdef CHANGED_1
+
+#include "kernel/objpool.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "vm/pagepool.h"
+#include "drivers/yams.h"
+#include "lib/libc.h"
+
+/* Links 'count' objects starting at 'first' into the free list of
+   the pool. The pool spinlock must be held. */
+static void objpool_add(objpool_t *pool, void *first, int count)
+{
+    uint8_t *obj = (uint8_t *)first + (count - 1) * pool->size;
+
+    for (; count > 0; count--, obj -= pool->size) {
+        *(void **)obj = pool->free;
+        pool->free = obj;
+    }
+}
+
+/**
+ * Initializes a pool whose first 'count' objects of 'size' bytes
+ * are in 'table'.
+ */
+void objpool_init(objpool_t *pool, void *table, uint32_t size, int count)
+{
+    KERNEL_ASSERT(size >= sizeof(void *));
+
+    spinlock_reset(&pool->slock);
+    pool->free = NULL;
+    pool->size = size;
+    objpool_add(pool, table, count);
+}
+
+/**
+ * Takes a free object from the pool. If there are none, a new page
+ * is taken from the page pool and split into objects. Pages are never
+ * given back, so the pool only grows as far as the peak number of
+ * live objects.
+ *
+ * @return The object, or NULL if out of memory.
+ */
+void *objpool_get(objpool_t *pool)
+{
+    interrupt_status_t intr_status;
+    uint32_t page;
+    void *obj;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pool->slock);
+
+    while (pool->free == NULL) {
+        spinlock_release(&pool->slock);
+        page = pagepool_get_phys_page();
+        spinlock_acquire(&pool->slock);
+
+        if (page == 0) {
+            /* Another thread may have freed an object meanwhile */
+            if (pool->free != NULL)
+                break;
+            spinlock_release(&pool->slock);
+            _interrupt_set_state(intr_status);
+            return NULL;
+        }
+        objpool_add(pool, (void *)ADDR_PHYS_TO_KERNEL(page),
+                    PAGE_SIZE / pool->size);
+    }
+
+    obj = pool->free;
+    pool->free = *(void **)obj;
+
+    spinlock_release(&pool->slock);
+    _interrupt_set_state(intr_status);
+
+    return obj;
+}
+
+/** Returns an object taken with objpool_get() to the pool. */
+void objpool_put(objpool_t *pool, void *obj)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pool->slock);
+
+    *(void **)obj = pool->free;
+    pool->free = obj;
+
+    spinlock_release(&pool->slock);
+    _interrupt_set_state(intr_status);
+}
+
+#endif
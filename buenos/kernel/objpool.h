@@ -0,0 +1,27 @@
+#ifdef CHANGED_1
+
+#ifndef BUENOS_KERNEL_OBJPOOL_H
+#define BUENOS_KERNEL_OBJPOOL_H
+
+#include "lib/types.h"
+#include "kernel/spinlock.h"
+
+/* A pool of fixed size kernel objects. Free objects are kept in a
+   list linked through their first word, so allocating and freeing
+   are O(1). The pool starts with a static table and grows a page at
+   a time when the table runs out. */
+typedef struct {
+    spinlock_t slock;
+    /* first free object, NULL if none */
+    void *free;
+    /* object size in bytes, at least one word */
+    uint32_t size;
+} objpool_t;
+
+void objpool_init(objpool_t *pool, void *table, uint32_t size, int count);
+void *objpool_get(objpool_t *pool);
+void objpool_put(objpool_t *pool, void *obj);
+
+#endif
+
+#endif
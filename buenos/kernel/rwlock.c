@@ -0,0 +1,129 @@
+#ifdef CHANGED_1
+
+#include "kernel/interrupt.h"
+#include "kernel/sleepq.h"
+#include "kernel/rwlock.h"
+#include "kernel/config.h"
+#include "kernel/assert.h"
+#include "kernel/thread.h"
+#include "kernel/objpool.h"
+#include "lib/libc.h"
+
+/** Table containing all reader-writer locks in the system */
+static rwlock_t rwlock_table[CONFIG_MAX_RWLOCKS];
+
+/** Free reader-writer locks, starting with the rwlock_table */
+static objpool_t rwlock_pool;
+
+void rwlock_init(void) {
+    objpool_init(&rwlock_pool, rwlock_table, sizeof(rwlock_t),
+                 CONFIG_MAX_RWLOCKS);
+}
+
+rwlock_t *rwlock_create(void) {
+    rwlock_t *rwlock;
+
+    rwlock = objpool_get(&rwlock_pool);
+    if (rwlock == NULL)
+        return NULL;
+
+    rwlock->created = 1;
+    rwlock->readers = 0;
+    rwlock->writer = 0;
+    rwlock->waiting_readers = 0;
+    rwlock->waiting_writers = 0;
+    spinlock_reset(&rwlock->slock);
+
+    return rwlock;
+}
+
+void rwlock_destroy(rwlock_t *rwlock) {
+    rwlock->created = 0;
+    objpool_put(&rwlock_pool, rwlock);
+}
+
+/**
+ * Acquires the lock for reading. Blocks while a writer holds the lock
+ * or is waiting for it, so that writers are not starved.
+ */
+void rwlock_read_acquire(rwlock_t *rwlock) {
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    while (rwlock->writer || rwlock->waiting_writers > 0) {
+        rwlock->waiting_readers++;
+        sleepq_add(&rwlock->waiting_readers);
+        spinlock_release(&rwlock->slock);
+        thread_switch();
+        spinlock_acquire(&rwlock->slock);
+        rwlock->waiting_readers--;
+    }
+    rwlock->readers++;
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+void rwlock_read_release(rwlock_t *rwlock) {
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    KERNEL_ASSERT(rwlock->readers > 0);
+    rwlock->readers--;
+    if (rwlock->readers == 0 && rwlock->waiting_writers > 0)
+        sleepq_wake(&rwlock->waiting_writers);
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Acquires the lock for writing. Blocks while any reader or another
+ * writer holds the lock.
+ */
+void rwlock_write_acquire(rwlock_t *rwlock) {
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    while (rwlock->writer || rwlock->readers > 0) {
+        rwlock->waiting_writers++;
+        sleepq_add(&rwlock->waiting_writers);
+        spinlock_release(&rwlock->slock);
+        thread_switch();
+        spinlock_acquire(&rwlock->slock);
+        rwlock->waiting_writers--;
+    }
+    rwlock->writer = 1;
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Releases write access. A waiting writer gets the lock next, the
+ * waiting readers are let in only when no writers are waiting.
+ */
+void rwlock_write_release(rwlock_t *rwlock) {
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    KERNEL_ASSERT(rwlock->writer);
+    rwlock->writer = 0;
+    if (rwlock->waiting_writers > 0)
+        sleepq_wake(&rwlock->waiting_writers);
+    else if (rwlock->waiting_readers > 0)
+        sleepq_wake_all(&rwlock->waiting_readers);
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+#endif
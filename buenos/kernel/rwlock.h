@@ -0,0 +1,34 @@
+#ifdef CHANGED_1
+
+#ifndef BUENOS_KERNEL_RWLOCK_H
+#define BUENOS_KERNEL_RWLOCK_H
+
+#include "kernel/spinlock.h"
+
+/* Reader-writer lock. Any number of readers or one writer may hold
+   the lock. Waiting writers are preferred over new readers. */
+typedef struct {
+  spinlock_t slock;
+  /* number of readers holding the lock */
+  int readers;
+  /* 1 if a writer holds the lock */
+  int writer;
+  /* number of threads sleeping for read or write access, readers
+     sleep on &waiting_readers and writers on &waiting_writers */
+  int waiting_readers;
+  int waiting_writers;
+  int created;
+} rwlock_t;
+
+void rwlock_init(void);
+
+rwlock_t *rwlock_create(void);
+void rwlock_destroy(rwlock_t *rwlock);
+void rwlock_read_acquire(rwlock_t *rwlock);
+void rwlock_read_release(rwlock_t *rwlock);
+void rwlock_write_acquire(rwlock_t *rwlock);
+void rwlock_write_release(rwlock_t *rwlock);
+
+#endif
+
+#endif
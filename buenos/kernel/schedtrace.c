@@ -0,0 +1,203 @@
+#ifdef CHANGED_1
+
+#include "kernel/schedtrace.h"
+#include "kernel/config.h"
+#include "kernel/thread.h"
+#include "kernel/interrupt.h"
+#include "drivers/timer.h"
+#include "lib/libc.h"
+
+#if CONFIG_SCHEDULER_TRACE
+
+/** @name Scheduler tracing
+ *
+ * Records scheduling events into a ring buffer per CPU and keeps
+ * run time, ready queue wait time and context switch counts per
+ * thread. Each ring buffer is written only by its own CPU with
+ * interrupts disabled, so writers need no locks. Readers copy the
+ * ring and afterwards drop the entries that may have been
+ * overwritten while copying.
+ *
+ * Timestamps are CP0 cycle counters of the CPU recording the event.
+ * The counters of different CPUs are not in step, so a ready wait is
+ * accounted only if the thread is put on a run queue and switched in
+ * on the same CPU.
+ *
+ * @{
+ */
+
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+
+typedef struct {
+    /* Number of events ever written, the next one goes to
+       events[head % CONFIG_SCHEDULER_TRACE_EVENTS] */
+    volatile uint32_t head;
+    /* Ticks this CPU has spent in the idle thread */
+    uint32_t idle_ticks;
+    volatile schedtrace_event_t events[CONFIG_SCHEDULER_TRACE_EVENTS];
+} schedtrace_cpu_t;
+
+static schedtrace_cpu_t schedtrace_cpus[CONFIG_MAX_CPUS];
+
+/** Statistics of each thread, indexed by TID */
+static schedstat_t schedtrace_stats[CONFIG_MAX_THREADS];
+
+/** Time when each thread was last put on a run queue, and the CPU
+    whose counter the time was read from */
+static uint32_t schedtrace_ready_since[CONFIG_MAX_THREADS];
+static int schedtrace_ready_cpu[CONFIG_MAX_THREADS];
+
+void schedtrace_init(void)
+{
+    memoryset(schedtrace_cpus, 0, sizeof(schedtrace_cpus));
+    memoryset(schedtrace_stats, 0, sizeof(schedtrace_stats));
+    memoryset(schedtrace_ready_since, 0, sizeof(schedtrace_ready_since));
+    memoryset(schedtrace_ready_cpu, 0, sizeof(schedtrace_ready_cpu));
+}
+
+/* Appends an event to the ring buffer of the given CPU, which must
+   be the calling CPU. */
+static void schedtrace_record(int cpu, TID_t t, int type, uint32_t now)
+{
+    schedtrace_cpu_t *ring = &schedtrace_cpus[cpu];
+    volatile schedtrace_event_t *event;
+
+    event = &ring->events[ring->head % CONFIG_SCHEDULER_TRACE_EVENTS];
+    event->time = now;
+    event->thread = t;
+    event->type = type;
+    event->cpu = cpu;
+    ring->head++;
+}
+
+/** Clears the statistics of a newly created thread. */
+void schedtrace_thread_created(TID_t t)
+{
+    memoryset(&schedtrace_stats[t], 0, sizeof(schedstat_t));
+}
+
+/** Called when a thread is put on a run queue, the ready wait
+    starts from here. */
+void schedtrace_ready(TID_t t)
+{
+    schedtrace_ready_since[t] = timer_get_ticks();
+    schedtrace_ready_cpu[t] = _interrupt_getcpu();
+}
+
+/** Called when a thread becomes runnable after sleeping or being
+    created. */
+void schedtrace_wakeup(int cpu, TID_t t)
+{
+    schedtrace_record(cpu, t, SCHEDTRACE_EVENT_WAKEUP, timer_get_ticks());
+}
+
+/** Called when the current thread of a CPU goes to sleep. */
+void schedtrace_sleep(int cpu, TID_t t, uint32_t now)
+{
+    schedtrace_record(cpu, t, SCHEDTRACE_EVENT_SLEEP, now);
+}
+
+/**
+ * Called by the scheduler when the thread 'from', which ran for
+ * 'ran' ticks, is replaced by 'to' on the given CPU. 'voluntary'
+ * tells whether 'from' is leaving because it blocks or exits.
+ */
+void schedtrace_schedule(int cpu, TID_t from, TID_t to, uint32_t now,
+                         uint32_t ran, int voluntary)
+{
+    if (from == IDLE_THREAD_TID)
+        schedtrace_cpus[cpu].idle_ticks += ran;
+    else
+        schedtrace_stats[from].run_ticks += ran;
+
+    if (from == to)
+        return;
+
+    if (from != IDLE_THREAD_TID) {
+        if (voluntary)
+            schedtrace_stats[from].voluntary_switches++;
+        else
+            schedtrace_stats[from].involuntary_switches++;
+    }
+    schedtrace_record(cpu, from, SCHEDTRACE_EVENT_SWITCH_OUT, now);
+
+    if (to != IDLE_THREAD_TID && schedtrace_ready_cpu[to] == cpu)
+        schedtrace_stats[to].wait_ticks += now - schedtrace_ready_since[to];
+    schedtrace_record(cpu, to, SCHEDTRACE_EVENT_SWITCH_IN, now);
+}
+
+/**
+ * Copies the statistics of thread 't' to 'stats'.
+ *
+ * @return 0 on success, -1 if 't' is not a valid thread.
+ */
+int schedtrace_get_stats(TID_t t, schedstat_t *stats)
+{
+    int i;
+
+    if (t < 0 || t >= CONFIG_MAX_THREADS)
+        return -1;
+
+    if (t == IDLE_THREAD_TID) {
+        memoryset(stats, 0, sizeof(schedstat_t));
+        for (i = 0; i < CONFIG_MAX_CPUS; i++)
+            stats->run_ticks += schedtrace_cpus[i].idle_ticks;
+        return 0;
+    }
+
+    if (thread_table[t].state == THREAD_FREE)
+        return -1;
+
+    *stats = schedtrace_stats[t];
+    return 0;
+}
+
+/**
+ * Copies at most 'count' of the latest events of the given CPU to
+ * 'events', oldest first.
+ *
+ * @return The number of events copied, or -1 if 'cpu' is invalid.
+ */
+int schedtrace_get_events(int cpu, schedtrace_event_t *events, int count)
+{
+    schedtrace_cpu_t *ring;
+    uint32_t head, after, first;
+    int i, n, lost;
+
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS || count < 0)
+        return -1;
+
+    ring = &schedtrace_cpus[cpu];
+    head = ring->head;
+    n = MIN((uint32_t)count, MIN(head, CONFIG_SCHEDULER_TRACE_EVENTS));
+    first = head - n;
+
+    for (i = 0; i < n; i++) {
+        volatile schedtrace_event_t *event =
+            &ring->events[(first + i) % CONFIG_SCHEDULER_TRACE_EVENTS];
+        events[i].time = event->time;
+        events[i].thread = event->thread;
+        events[i].type = event->type;
+        events[i].cpu = event->cpu;
+    }
+
+    /* The writer may have run meanwhile and overwritten the oldest
+       copied entries, including the one it is writing right now. */
+    after = ring->head;
+    lost = (int)(after + 1 - CONFIG_SCHEDULER_TRACE_EVENTS - first);
+    if (lost > 0) {
+        if (lost > n)
+            lost = n;
+        for (i = lost; i < n; i++)
+            events[i - lost] = events[i];
+        n -= lost;
+    }
+
+    return n;
+}
+
+/** @} */
+
+#endif
+
+#endif
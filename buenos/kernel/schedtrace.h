@@ -0,0 +1,70 @@
+#ifdef CHANGED_1
+
+#ifndef BUENOS_KERNEL_SCHEDTRACE_H
+#define BUENOS_KERNEL_SCHEDTRACE_H
+
+#include "lib/types.h"
+#include "kernel/config.h"
+#include "kernel/thread.h"
+
+/* Scheduling event types recorded in the trace ring buffers */
+#define SCHEDTRACE_EVENT_SWITCH_IN  1
+#define SCHEDTRACE_EVENT_SWITCH_OUT 2
+#define SCHEDTRACE_EVENT_WAKEUP     3
+#define SCHEDTRACE_EVENT_SLEEP      4
+
+/* Accumulated scheduling statistics of one thread. Times are in CPU
+   timer ticks (cycles). For the idle thread run_ticks is the idle
+   time of all CPUs together. wait_ticks leaves out the waits that
+   started on another CPU than the one the thread then ran on. */
+typedef struct {
+    uint32_t run_ticks;
+    uint32_t wait_ticks;
+    uint32_t voluntary_switches;
+    uint32_t involuntary_switches;
+} schedstat_t;
+
+/* One entry in the per-CPU trace ring buffer. */
+typedef struct {
+    uint32_t time;
+    int16_t thread;
+    uint8_t type;
+    uint8_t cpu;
+} schedtrace_event_t;
+
+#if CONFIG_SCHEDULER_TRACE
+
+void schedtrace_init(void);
+void schedtrace_thread_created(TID_t t);
+void schedtrace_ready(TID_t t);
+void schedtrace_wakeup(int cpu, TID_t t);
+void schedtrace_sleep(int cpu, TID_t t, uint32_t now);
+void schedtrace_schedule(int cpu, TID_t from, TID_t to, uint32_t now,
+                         uint32_t ran, int voluntary);
+
+int schedtrace_get_stats(TID_t t, schedstat_t *stats);
+int schedtrace_get_events(int cpu, schedtrace_event_t *events, int count);
+
+#define SCHEDTRACE_INIT() schedtrace_init()
+#define SCHEDTRACE_THREAD_CREATED(t) schedtrace_thread_created(t)
+#define SCHEDTRACE_READY(t) schedtrace_ready(t)
+#define SCHEDTRACE_WAKEUP(cpu, t) schedtrace_wakeup(cpu, t)
+#define SCHEDTRACE_SLEEP(cpu, t, now) schedtrace_sleep(cpu, t, now)
+#define SCHEDTRACE_SCHEDULE(cpu, from, to, now, ran, voluntary) \
+    schedtrace_schedule(cpu, from, to, now, ran, voluntary)
+
+#else
+
+/* Tracing is compiled out, the hooks in the scheduler vanish */
+#define SCHEDTRACE_INIT()
+#define SCHEDTRACE_THREAD_CREATED(t)
+#define SCHEDTRACE_READY(t)
+#define SCHEDTRACE_WAKEUP(cpu, t)
+#define SCHEDTRACE_SLEEP(cpu, t, now)
+#define SCHEDTRACE_SCHEDULE(cpu, from, to, now, ran, voluntary)
+
+#endif
+
+#endif
+
+#endif
@@ -42,15 +42,31 @@
 #include "lib/libc.h"
 #include "kernel/config.h"
 #include "drivers/timer.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
 #ifdef CHANGED_1
     #include "lib/debug.h"
-    #include "drivers/metadev.h"
+    #include "kernel/schedtrace.h"
 #endif
 
 /** @name Scheduler
  *
  * This module implements simple round robin scheduler.
  *
+ * Ready threads are kept on a multi-level feedback queue. Threads
+ * which use up the timeslice of their level are demoted to the next,
+ * lower level with a twice as long timeslice, and threads which block
+ * before that are promoted back up. Every
+ * CONFIG_SCHEDULER_BOOST_INTERVAL milliseconds all ready threads are
+ * returned to their base level so CPU hogs cannot starve anyone.
+ *
+ * Every CPU has its own run queue protected by its own spinlock, so
+ * CPUs do not contend with each other when they reschedule. A CPU
+ * whose run queue is empty steals work from the busiest sibling, and
+ * threads made ready on behalf of an idle CPU wake it up with an
+ * inter-CPU interrupt.
+ *
  */
 
 /* Import thread table and its lock from thread.c */
@@ -60,39 +76,206 @@ extern thread_table_t thread_table[CONFIG_MAX_THREADS];
 /** Currently running thread on each CPU */
 TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
 
-/** List of normal priority threads ready to be run. */
-static struct {
-    TID_t head; /* the first thread in ready to run queue, negative if none */
-    TID_t tail; /* the last thread in ready to run queue, negative if none */
-} scheduler_ready_to_run = {-1, -1};
+#ifdef CHANGED_1
+    #define SCHEDULER_LEVELS CONFIG_SCHEDULER_LEVELS
+#else
+    #define SCHEDULER_LEVELS 1
+#endif
 
 #ifdef CHANGED_1
-    /** List of threads that are ready to run, but in thread_sleep */
-    static struct {
-        TID_t head; /* the first thread, negative if none */
-        TID_t tail; /* the last thread, negative if none */
-    } scheduler_sleeping_for_time = {-1, -1};
-    
-    /** List of high priority threads that are ready to run */
-    static struct {
-        TID_t head;
-        TID_t tail;
-    } scheduler_high_priority_ready_to_run = {-1, -1};
+/* Length of the timeslice on the given level in timer ticks */
+#define SCHEDULER_LEVEL_TIMESLICE(level) \
+    ((uint32_t)CONFIG_SCHEDULER_TIMESLICE << (level))
+#endif
+
+/* Whether the affinity of the thread allows it to run on the CPU */
+#ifdef CHANGED_1
+    #define SCHEDULER_CPU_ALLOWED(t, cpu) \
+        (thread_table[(t)].affinity & (1 << (cpu)))
+#else
+    #define SCHEDULER_CPU_ALLOWED(t, cpu) 1
+#endif
+
+/** A FIFO list of threads linked through the next field of the
+ * thread table. */
+typedef struct {
+    TID_t head; /* the first thread in the list, negative if none */
+    TID_t tail; /* the last thread in the list, negative if none */
+} scheduler_list_t;
+
+/** Run queue of one CPU */
+typedef struct {
+    /* spinlock which must be held when accessing this run queue */
+    spinlock_t slock;
+    /* number of threads on the ready lists of this run queue */
+    int ready_count;
+    /* threads ready to be run, one list per scheduler level */
+    scheduler_list_t ready_to_run[SCHEDULER_LEVELS];
+#ifdef CHANGED_1
+    /* timer ticks when the running thread was put on the CPU */
+    uint32_t dispatched_at;
+    /* timer ticks when the ready threads are boosted next */
+    uint32_t next_boost;
+    /* threads that are ready to run, but in thread_sleep. This is a
+       binary min-heap ordered by sleeps_until, so the thread that
+       should wake up first is always sleeping_for_time[0]. */
+    TID_t sleeping_for_time[CONFIG_MAX_THREADS];
+    /* number of threads in sleeping_for_time */
+    int sleeping_count;
+#endif
+} scheduler_runqueue_t;
+
+/** The run queues, indexed by CPU number */
+static scheduler_runqueue_t scheduler_runqueues[CONFIG_MAX_CPUS];
+
+/** Number of CPUs in the system */
+static int scheduler_num_cpus = 1;
+
+/** CPU status devices, used to interrupt idle CPUs */
+static device_t *scheduler_cpu_devices[CONFIG_MAX_CPUS];
+
+#ifdef CHANGED_1
+/** Number of CPU cycles (timer ticks) in one millisecond */
+static uint32_t scheduler_cycles_per_msec;
 #endif
 
 /**
- * Initializes the scheduler current thread table to 0 for each processor.
+ * Initializes the scheduler current thread table to 0 for each
+ * processor and empties the run queues. Must be called after the
+ * device drivers have been initialized.
  */
 void scheduler_init(void) {
-    int i;
-    for (i=0; i<CONFIG_MAX_CPUS; i++)
+    int i, level;
+    for (i=0; i<CONFIG_MAX_CPUS; i++) {
 	scheduler_current_thread[i] = 0;
+
+        spinlock_reset(&scheduler_runqueues[i].slock);
+        scheduler_runqueues[i].ready_count = 0;
+        for (level = 0; level < SCHEDULER_LEVELS; level++) {
+            scheduler_runqueues[i].ready_to_run[level].head = -1;
+            scheduler_runqueues[i].ready_to_run[level].tail = -1;
+        }
+#ifdef CHANGED_1
+        scheduler_runqueues[i].dispatched_at = 0;
+        scheduler_runqueues[i].next_boost = 0;
+        scheduler_runqueues[i].sleeping_count = 0;
+#endif
+
+        scheduler_cpu_devices[i] = 
+            device_get(YAMS_TYPECODE_CPUSTATUS + i, 0);
+    }
+
+    scheduler_num_cpus = cpustatus_count();
+    KERNEL_ASSERT(scheduler_num_cpus >= 1 
+                  && scheduler_num_cpus <= CONFIG_MAX_CPUS);
+
+#ifdef CHANGED_1
+    scheduler_cycles_per_msec = rtc_get_clockspeed() / 1000;
+    if (scheduler_cycles_per_msec == 0)
+        scheduler_cycles_per_msec = 1;
+
+    SCHEDTRACE_INIT();
+#endif
+}
+
+/* Appends the given thread to the end of the given list. */
+static void scheduler_list_append(scheduler_list_t *list, TID_t t)
+{
+    thread_table[t].next = -1;
+    if (list->tail < 0) {
+        /* list was empty */
+        list->head = t;
+    } else {
+        /* list was not empty */
+        thread_table[list->tail].next = t;
+    }
+    list->tail = t;
+}
+
+/* Removes the first thread from the given list and returns it, or
+ * returns negative if the list was empty. */
+static TID_t scheduler_list_pop(scheduler_list_t *list)
+{
+    TID_t t = list->head;
+
+    if (t >= 0) {
+        if (list->tail == t)
+            list->tail = -1;
+        list->head = thread_table[t].next;
+        thread_table[t].next = -1;
+    }
+
+    return t;
+}
+
+/**
+ * Adds given thread to the ready lists of the given run queue. The
+ * run queue spinlock must be held and interrupts disabled.
+ */
+static void scheduler_runqueue_add(scheduler_runqueue_t *rq, TID_t t)
+{
+    #ifdef CHANGED_1
+        thread_table[t].sleeps_until = 0;
+        SCHEDTRACE_READY(t);
+    #endif
+
+    thread_table[t].state = THREAD_READY;
+    rq->ready_count++;
+
+    #ifdef CHANGED_1
+    // Add to appropriate ready list according to scheduler level
+    scheduler_list_append(&rq->ready_to_run[thread_table[t].level], t);
+    #else
+    scheduler_list_append(&rq->ready_to_run[0], t);
+    #endif
+}
+
+/**
+ * Selects the CPU whose run queue a newly ready thread is placed
+ * on. Only CPUs in the affinity mask of the thread are considered.
+ * The CPU the thread last ran on is preferred to keep its TLB
+ * entries warm, unless it is busy and some other allowed CPU is
+ * sitting idle. The selection is only a hint, so the per-CPU state
+ * is read without locking.
+ *
+ * @param t The thread becoming ready
+ *
+ * @return The selected CPU
+ */
+static int scheduler_select_cpu(TID_t t)
+{
+    int cpu, i;
+
+    cpu = thread_table[t].cpu;
+    if (cpu >= scheduler_num_cpus || !SCHEDULER_CPU_ALLOWED(t, cpu)) {
+        /* fall back to the first allowed CPU */
+        for (cpu = 0; cpu < scheduler_num_cpus - 1; cpu++) {
+            if (SCHEDULER_CPU_ALLOWED(t, cpu))
+                break;
+        }
+    }
+
+    if (scheduler_current_thread[cpu] == IDLE_THREAD_TID)
+        return cpu;
+
+    for (i = 0; i < scheduler_num_cpus; i++) {
+        if (SCHEDULER_CPU_ALLOWED(t, i)
+            && scheduler_current_thread[i] == IDLE_THREAD_TID
+            && scheduler_runqueues[i].ready_count == 0)
+            return i;
+    }
+
+    return cpu;
 }
 
 /**
  * Adds given thread to scheduler's ready to run list. Doesn't do 
- * any synchronization, it is assumed that spinlock to the thread table
- * is held and interrups are disabled when calling this function.
+ * any synchronization on the thread table, it is assumed that
+ * interrupts are disabled when calling this function. The run queue
+ * of the target CPU is locked here, so this may be called while
+ * holding the thread table spinlock. If the thread is queued for an
+ * idle CPU other than the calling one, that CPU is interrupted so it
+ * will schedule the thread right away.
  * 
  * @param t thread to add to ready list
  *
@@ -100,116 +283,195 @@ void scheduler_init(void) {
 
 void scheduler_add_to_ready_list(TID_t t)
 {
+    scheduler_runqueue_t *rq;
+    int cpu;
+
     /* Idle thread should never go into the ready list */
     KERNEL_ASSERT(t != IDLE_THREAD_TID);
 
     /* Sanity check */
     KERNEL_ASSERT(t >= 0 && t < CONFIG_MAX_THREADS);
 
-    #ifdef CHANGED_1
-        thread_table[t].sleeps_until = 0;
-    #endif
+    cpu = scheduler_select_cpu(t);
+    rq = &scheduler_runqueues[cpu];
+
+    spinlock_acquire(&rq->slock);
+    thread_table[t].cpu = cpu;
+    scheduler_runqueue_add(rq, t);
+    spinlock_release(&rq->slock);
 
     #ifdef CHANGED_1
-    // Add to appropriate ready list according to priority
-    DEBUG("priority", "thread priority: %d\n", thread_table[t].priority);
-    if (thread_table[t].priority == PRIORITY_NORMAL) {
+        SCHEDTRACE_WAKEUP(_interrupt_getcpu(), t);
     #endif
-        if (scheduler_ready_to_run.tail < 0) {
-            /* ready queue was empty */
-            scheduler_ready_to_run.head = t;
-            scheduler_ready_to_run.tail = t;
-            thread_table[t].next = -1;
-        } else {
-            /* ready queue was not empty */
-            thread_table[scheduler_ready_to_run.tail].next = t;
-            thread_table[t].next = -1;
-            scheduler_ready_to_run.tail = t;
-        }
-    #ifdef CHANGED_1
-    } else {
-        if (scheduler_high_priority_ready_to_run.tail < 0) {
-            /* ready queue was empty */
-            scheduler_high_priority_ready_to_run.head = t;
-            scheduler_high_priority_ready_to_run.tail = t;
-            thread_table[t].next = -1;
-        } else {
-            /* ready queue was not empty */
-            thread_table[scheduler_high_priority_ready_to_run.tail].next = t;
-            thread_table[t].next = -1;
-            scheduler_high_priority_ready_to_run.tail = t;
-        }
+
+    if (cpu != _interrupt_getcpu()
+        && scheduler_current_thread[cpu] == IDLE_THREAD_TID
+        && scheduler_cpu_devices[cpu] != NULL) {
+        cpustatus_generate_irq(scheduler_cpu_devices[cpu]);
     }
-    #endif
 }
 
 /**
- * Removes the first thread from the ready to run list and returns it.
- * if the list was empty, returns the idle thread (TID 0). It is assumed
- * that interrupts are disabled and thread table spinlock is held when
- * this function is called.
+ * Removes the first thread from the ready to run lists of the given
+ * run queue and returns it. Higher scheduler levels are served
+ * first. If the lists were empty, returns
+ * negative. It is assumed that interrupts are disabled and the run
+ * queue spinlock is held when this function is called.
  *
  * @return The removed thread.
  *
  */
 
-static TID_t scheduler_remove_first_ready(void)
+static TID_t scheduler_remove_first_ready(scheduler_runqueue_t *rq)
 {
     TID_t t;
+    int level;
 
-    t = scheduler_ready_to_run.head;
+    /* Take the first thread from the highest non-empty level */
+    t = -1;
+    for (level = 0; level < SCHEDULER_LEVELS && t < 0; level++)
+        t = scheduler_list_pop(&rq->ready_to_run[level]);
 
-    #ifdef CHANGED_1
-        TID_t high_priority_t;
-        high_priority_t = scheduler_high_priority_ready_to_run.head;
-    #endif
+    if (t < 0)
+        return t;
 
     /* Idle thread should never be on the ready list. */
     KERNEL_ASSERT(t != IDLE_THREAD_TID);
-
+    /* Threads in ready queue should be in state Ready */
+    KERNEL_ASSERT(thread_table[t].state == THREAD_READY);
     #ifdef CHANGED_1
-        if(high_priority_t >= 0) {
-            /* Threads in ready queue should be in state Ready */
-            KERNEL_ASSERT(thread_table[high_priority_t].state == THREAD_READY);
-            KERNEL_ASSERT(thread_table[high_priority_t].sleeps_until == 0);
+        KERNEL_ASSERT(thread_table[t].sleeps_until == 0);
+    #endif
 
-            if(scheduler_high_priority_ready_to_run.tail == high_priority_t) {
-                scheduler_high_priority_ready_to_run.tail = -1;
-            }
-            scheduler_high_priority_ready_to_run.head =
-                thread_table[scheduler_high_priority_ready_to_run.head].next;
+    rq->ready_count--;
 
+    return t;
+}
+
+/**
+ * Removes the first thread which may run on the given CPU from the
+ * ready lists of the run queue of another CPU. Higher scheduler
+ * levels are served first. Interrupts must be disabled and the run
+ * queue spinlock held.
+ *
+ * @return The removed thread, or negative if there was none.
+ */
+static TID_t scheduler_remove_first_allowed(scheduler_runqueue_t *rq,
+                                            int cpu)
+{
+    scheduler_list_t *list;
+    TID_t t, prev;
+    int level;
+
+    for (level = 0; level < SCHEDULER_LEVELS; level++) {
+        list = &rq->ready_to_run[level];
+        prev = -1;
+        for (t = list->head; t >= 0; prev = t, t = thread_table[t].next) {
+            if (!SCHEDULER_CPU_ALLOWED(t, cpu))
+                continue;
+
+            if (prev < 0)
+                list->head = thread_table[t].next;
+            else
+                thread_table[prev].next = thread_table[t].next;
+            if (list->tail == t)
+                list->tail = prev;
+            thread_table[t].next = -1;
+
+            rq->ready_count--;
+            return t;
         }
-        if (high_priority_t >= 0)
-            return high_priority_t;
-    #endif
+    }
+
+    return -1;
+}
 
-    if(t >= 0) {
-        /* Threads in ready queue should be in state Ready */
-        KERNEL_ASSERT(thread_table[t].state == THREAD_READY);
-        #ifdef CHANGED_1
-            KERNEL_ASSERT(thread_table[t].sleeps_until == 0);
-        #endif
+/* Steals a thread allowed on this_cpu from the given CPU, or returns
+   negative. Takes the run queue spinlock of the victim. */
+static TID_t scheduler_steal_from(int victim, int this_cpu)
+{
+    scheduler_runqueue_t *rq = &scheduler_runqueues[victim];
+    TID_t t;
+
+    spinlock_acquire(&rq->slock);
+    t = scheduler_remove_first_allowed(rq, this_cpu);
+    spinlock_release(&rq->slock);
 
-        if(scheduler_ready_to_run.tail == t) {
-            scheduler_ready_to_run.tail = -1;
+    return t;
+}
+
+/**
+ * Steals a ready thread from the run queue of the busiest CPU other
+ * than the given one. Only threads whose affinity allows this CPU
+ * are taken; if the busiest CPU has none, the other CPUs are tried.
+ * Interrupts must be disabled and no run queue spinlock may be held
+ * when calling this function.
+ *
+ * @param this_cpu The CPU doing the stealing
+ *
+ * @return The stolen thread, or the idle thread if there was nothing
+ * to steal.
+ */
+static TID_t scheduler_steal(int this_cpu)
+{
+    TID_t t;
+    int i, busiest, busiest_count;
+
+    /* Pick the victim without locking, recheck under its lock */
+    busiest = -1;
+    busiest_count = 0;
+    for (i = 0; i < scheduler_num_cpus; i++) {
+        if (i != this_cpu 
+            && scheduler_runqueues[i].ready_count > busiest_count) {
+            busiest = i;
+            busiest_count = scheduler_runqueues[i].ready_count;
         }
-        scheduler_ready_to_run.head =
-            thread_table[scheduler_ready_to_run.head].next;
+    }
 
+    if (busiest < 0)
+        return IDLE_THREAD_TID;
+
+    t = scheduler_steal_from(busiest, this_cpu);
+    for (i = 0; t < 0 && i < scheduler_num_cpus; i++) {
+        if (i != this_cpu && i != busiest
+            && scheduler_runqueues[i].ready_count > 0)
+            t = scheduler_steal_from(i, this_cpu);
     }
 
-    if(t < 0) {
-	return IDLE_THREAD_TID;
-    } else {
-	return t;
+    if (t < 0)
+        return IDLE_THREAD_TID;
+
+    return t;
+}
+
+#if defined(CHANGED_1) && CONFIG_SCHEDULER_TICKLESS
+/**
+ * Interrupts one idle CPU other than the given one, so that it steals
+ * work from the busy CPUs. Needed because idle CPUs do not take timer
+ * interrupts in tickless mode. Interrupts must be disabled.
+ *
+ * @param this_cpu The calling CPU, which has surplus ready threads
+ */
+static void scheduler_kick_idle_cpu(int this_cpu)
+{
+    int i;
+
+    for (i = 0; i < scheduler_num_cpus; i++) {
+        if (i != this_cpu
+            && scheduler_current_thread[i] == IDLE_THREAD_TID
+            && scheduler_runqueues[i].ready_count == 0
+            && scheduler_cpu_devices[i] != NULL) {
+            cpustatus_generate_irq(scheduler_cpu_devices[i]);
+            return;
+        }
     }
 }
+#endif
 
 /**
  * Adds given thread to scheduler's ready to run list. This function
  * handles syncronization and can be called from anywhere where
- * needed. Must not be called if thread table spinlock is already held.
+ * needed. Must not be called if a run queue spinlock is already held.
  *
  * @param t Thread to add. The thread must not already be on the ready
  * list or running.
@@ -222,51 +484,86 @@ void scheduler_add_ready(TID_t t)
     
     intr_status = _interrupt_disable();
 
-    spinlock_acquire(&thread_table_slock);
-
     scheduler_add_to_ready_list(t);
-    thread_table[t].state = THREAD_READY;
-
-    spinlock_release(&thread_table_slock);
 
     _interrupt_set_state(intr_status);
 }
 
 #ifdef CHANGED_1
-    void move_done_sleeping_threads_to_ready() {
+    /* Sift the thread at index i of the sleeping heap up towards the
+       root until its parent wakes up no later than it does. */
+    static void scheduler_sleepers_sift_up(scheduler_runqueue_t *rq, int i)
+    {
+        TID_t *heap = rq->sleeping_for_time;
+        TID_t t = heap[i];
+
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (thread_table[heap[parent]].sleeps_until
+                <= thread_table[t].sleeps_until)
+                break;
+            heap[i] = heap[parent];
+            i = parent;
+        }
+        heap[i] = t;
+    }
+
+    /* Sift the thread at index i of the sleeping heap down until
+       both of its children wake up no earlier than it does. */
+    static void scheduler_sleepers_sift_down(scheduler_runqueue_t *rq, int i)
+    {
+        TID_t *heap = rq->sleeping_for_time;
+        TID_t t = heap[i];
+        int n = rq->sleeping_count;
+
+        while (2 * i + 1 < n) {
+            int child = 2 * i + 1;
+            if (child + 1 < n 
+                && thread_table[heap[child + 1]].sleeps_until
+                   < thread_table[heap[child]].sleeps_until)
+                child++;
+            if (thread_table[t].sleeps_until
+                <= thread_table[heap[child]].sleeps_until)
+                break;
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = t;
+    }
+
+    /* Moves the threads whose sleep is over to the ready lists. Only
+       the expired threads at the top of the heap are looked at.
+       Must be called while holding the run queue spinlock. */
+    static void move_done_sleeping_threads_to_ready(scheduler_runqueue_t *rq) {
         TID_t t;
-        TID_t next_t;
-        TID_t prev_t;
         uint32_t now_ms;
 
-        t = scheduler_sleeping_for_time.head;
-        prev_t = -1;
-
-        /* Idle thread should never be on the sleeping list. */
-        KERNEL_ASSERT(t != IDLE_THREAD_TID);
+        if (rq->sleeping_count == 0)
+            return;
 
         now_ms = rtc_get_msec();
-        while(t >= 0) {
-            next_t = thread_table[t].next;
-            if (now_ms >= thread_table[t].sleeps_until) {
-                scheduler_add_to_ready_list(t);
-                if (prev_t == -1) {
-                    scheduler_sleeping_for_time.head = next_t;
-                } else {
-                    thread_table[prev_t].next = next_t;
-                }
-                if (t == scheduler_sleeping_for_time.tail) {
-                    scheduler_sleeping_for_time.tail = prev_t;
-                }
-            } else {
-                prev_t = t;
+        while (rq->sleeping_count > 0) {
+            t = rq->sleeping_for_time[0];
+            /* Idle thread should never be on the sleeping list. */
+            KERNEL_ASSERT(t != IDLE_THREAD_TID);
+
+            if (now_ms < thread_table[t].sleeps_until)
+                break;
+
+            rq->sleeping_count--;
+            if (rq->sleeping_count > 0) {
+                rq->sleeping_for_time[0] = 
+                    rq->sleeping_for_time[rq->sleeping_count];
+                scheduler_sleepers_sift_down(rq, 0);
             }
-            t = next_t;
+            scheduler_runqueue_add(rq, t);
+            SCHEDTRACE_WAKEUP(_interrupt_getcpu(), t);
         }
     }
 
-    /* must be called while holding the thread_table_slock */
-    void scheduler_add_to_sleeping_list(TID_t t)
+    /* must be called while holding the run queue spinlock */
+    static void scheduler_add_to_sleeping_list(scheduler_runqueue_t *rq,
+                                               TID_t t)
     {
         /* Idle thread should never go into the ready list */
         KERNEL_ASSERT(t != IDLE_THREAD_TID);
@@ -274,22 +571,99 @@ void scheduler_add_ready(TID_t t)
         /* Sanity check */
         KERNEL_ASSERT(t >= 0 && t < CONFIG_MAX_THREADS);
         KERNEL_ASSERT(thread_table[t].sleeps_until > 0);
+        KERNEL_ASSERT(rq->sleeping_count < CONFIG_MAX_THREADS);
 
-        if (scheduler_sleeping_for_time.tail < 0) {
-            /* sleeping queue was empty */
-            scheduler_sleeping_for_time.head = t;
-            scheduler_sleeping_for_time.tail = t;
-            thread_table[t].next = -1;
-        } else {
-            /* sleeping queue was not empty */
-            thread_table[scheduler_sleeping_for_time.tail].next = t;
-            thread_table[t].next = -1;
-            scheduler_sleeping_for_time.tail = t;
+        thread_table[t].state = THREAD_READY;
+        thread_table[t].next = -1;
+        rq->sleeping_for_time[rq->sleeping_count] = t;
+        rq->sleeping_count++;
+        scheduler_sleepers_sift_up(rq, rq->sleeping_count - 1);
+    }
+
+    /* Returns the number of timer ticks until the first thread
+       sleeping on the given run queue should wake up, but at most
+       max_ticks. Must be called while holding the run queue spinlock. */
+    static uint32_t scheduler_ticks_to_next_wakeup(scheduler_runqueue_t *rq,
+                                                   uint32_t max_ticks)
+    {
+        uint32_t now_ms, until;
+
+        if (rq->sleeping_count == 0)
+            return max_ticks;
+
+        now_ms = rtc_get_msec();
+        until = thread_table[rq->sleeping_for_time[0]].sleeps_until;
+        if (until <= now_ms)
+            return 1;
+        if (until - now_ms >= max_ticks / scheduler_cycles_per_msec)
+            return max_ticks;
+        return (until - now_ms) * scheduler_cycles_per_msec;
+    }
+#endif
+
+#ifdef CHANGED_1
+    /* Updates the scheduler level of a thread which is leaving the
+       CPU after running for the given number of timer ticks. Threads
+       which block are promoted one level, threads which have run for
+       the whole timeslice of their level are demoted one level. */
+    static void scheduler_account(thread_table_t *thread, uint32_t ran,
+                                  int blocking)
+    {
+        thread->slice_used += ran;
+
+        if (blocking) {
+            if (thread->level > thread->base_level)
+                thread->level--;
+            thread->slice_used = 0;
+        } else if (thread->slice_used 
+                   >= SCHEDULER_LEVEL_TIMESLICE(thread->level)) {
+            if (thread->level < SCHEDULER_LEVELS - 1)
+                thread->level++;
+            thread->slice_used = 0;
+        }
+    }
+
+    /* Moves all threads on the ready lists of the given run queue back
+       to their base level. Must be called while holding the run queue
+       spinlock. */
+    static void scheduler_boost(scheduler_runqueue_t *rq)
+    {
+        scheduler_list_t list;
+        TID_t t;
+        int level;
+
+        for (level = 1; level < SCHEDULER_LEVELS; level++) {
+            list = rq->ready_to_run[level];
+            rq->ready_to_run[level].head = -1;
+            rq->ready_to_run[level].tail = -1;
+
+            while ((t = scheduler_list_pop(&list)) >= 0) {
+                thread_table[t].level = thread_table[t].base_level;
+                thread_table[t].slice_used = 0;
+                scheduler_list_append(
+                    &rq->ready_to_run[thread_table[t].level], t);
+            }
         }
     }
 #endif
 
 
+/* Puts the thread which was running on this CPU back on a ready
+   list. It stays on this CPU unless its affinity no longer allows
+   that. Interrupts must be disabled. */
+static void scheduler_requeue(scheduler_runqueue_t *rq, int this_cpu, 
+                              TID_t t)
+{
+    if (!SCHEDULER_CPU_ALLOWED(t, this_cpu)) {
+        scheduler_add_to_ready_list(t);
+        return;
+    }
+
+    spinlock_acquire(&rq->slock);
+    scheduler_runqueue_add(rq, t);
+    spinlock_release(&rq->slock);
+}
+
 /**
  * Select next thread for running. Removes the currently running
  * thread running on this CPU and selects new running thread.
@@ -299,54 +673,146 @@ void scheduler_add_ready(TID_t t)
  *
  * Scheduler also handles thread table row freeing when thread is
  * DYING and removes threads wishing to sleep (sleeps_on != 0) from
- * ready status and places them SLEEPING. Syncronizes access to thread
- * table by acquiring the thread table spinlock.
+ * ready status and places them SLEEPING. Only the run queue of this
+ * CPU is locked in the common case; the thread table spinlock is
+ * taken only when the current thread dies or goes to sleep, because
+ * sleepq_wake() may race with us there. If this CPU has nothing to
+ * run, a thread is stolen from the busiest other CPU.
+ *
+ * Before the current thread is put back on a ready list its
+ * scheduler level is updated from the time it ran and whether it is
+ * blocking.
  *
  * After selecting new thread for running the scheduler will reset the
- * CP0 timer to cause timer interrupt after thread's timeslice is
- * over.
+ * CP0 timer to cause timer interrupt after the rest of thread's
+ * timeslice on its level is over. In tickless mode an idle CPU only
+ * sets the timer for the next thread_sleep() deadline of its run
+ * queue, if any.
  *
  */
 
 void scheduler_schedule(void)
 {
     TID_t t;
+    TID_t current;
     thread_table_t *current_thread;
+    scheduler_runqueue_t *rq;
     int this_cpu;
+    uint32_t ticks;
+#ifdef CHANGED_1
+    uint32_t now;
+    uint32_t wakeup_ticks;
+    int blocking;
+#endif
 
     this_cpu = _interrupt_getcpu();
+    rq = &scheduler_runqueues[this_cpu];
 
-    spinlock_acquire(&thread_table_slock);
+    current = scheduler_current_thread[this_cpu];
+    current_thread = &(thread_table[current]);
 
-    current_thread = &(thread_table[scheduler_current_thread[this_cpu]]);
+#ifdef CHANGED_1
+    now = timer_get_ticks();
+    blocking = current_thread->state == THREAD_DYING
+        || current_thread->sleeps_on != 0 
+        || current_thread->sleeps_until > 0;
+    if (current != IDLE_THREAD_TID 
+        && current_thread->state != THREAD_DYING) {
+        scheduler_account(current_thread, now - rq->dispatched_at,
+                          blocking);
+    }
+#endif
 
     if(current_thread->state == THREAD_DYING) {
+        spinlock_acquire(&thread_table_slock);
+#ifdef CHANGED_1
+        thread_table_free(current);
+#else
 	current_thread->state = THREAD_FREE;
+#endif
+        spinlock_release(&thread_table_slock);
     } else if(current_thread->sleeps_on != 0) {
-	current_thread->state = THREAD_SLEEPING;
+        /* sleepq_wake() clears sleeps_on while holding the thread
+           table spinlock, so recheck it under the same lock. */
+        spinlock_acquire(&thread_table_slock);
+        if (current_thread->sleeps_on != 0) {
+            current_thread->state = THREAD_SLEEPING;
+            #ifdef CHANGED_1
+                SCHEDTRACE_SLEEP(this_cpu, current, now);
+            #endif
+        } else {
+            scheduler_requeue(rq, this_cpu, current);
+        }
+        spinlock_release(&thread_table_slock);
 #ifdef CHANGED_1
     } else if(current_thread->sleeps_until > 0) {
-        scheduler_add_to_sleeping_list(scheduler_current_thread[this_cpu]); 
-	current_thread->state = THREAD_READY;
+        spinlock_acquire(&rq->slock);
+        scheduler_add_to_sleeping_list(rq, current); 
+        spinlock_release(&rq->slock);
+        SCHEDTRACE_SLEEP(this_cpu, current, now);
 #endif
+    } else if(current != IDLE_THREAD_TID) {
+        scheduler_requeue(rq, this_cpu, current);
     } else {
-	if(scheduler_current_thread[this_cpu] != IDLE_THREAD_TID)
-	    scheduler_add_to_ready_list(scheduler_current_thread[this_cpu]);
 	current_thread->state = THREAD_READY;
     }
 
+    spinlock_acquire(&rq->slock);
+
     #ifdef CHANGED_1 
-        move_done_sleeping_threads_to_ready();
+        if ((int32_t)(now - rq->next_boost) >= 0) {
+            scheduler_boost(rq);
+            rq->next_boost = now + CONFIG_SCHEDULER_BOOST_INTERVAL 
+                * scheduler_cycles_per_msec;
+        }
+        move_done_sleeping_threads_to_ready(rq);
+        wakeup_ticks = scheduler_ticks_to_next_wakeup(rq, 0xffffffff);
     #endif
 
-    t = scheduler_remove_first_ready();
+    t = scheduler_remove_first_ready(rq);
+
+    spinlock_release(&rq->slock);
+
+    if (t < 0)
+        t = scheduler_steal(this_cpu);
+
     thread_table[t].state = THREAD_RUNNING;
+    if (t != IDLE_THREAD_TID)
+        thread_table[t].cpu = this_cpu;
+
+    /* Timeslice of the thread to run, randomized to avoid lockstep */
+    #ifdef CHANGED_1
+        ticks = SCHEDULER_LEVEL_TIMESLICE(thread_table[t].level);
+        if (thread_table[t].slice_used < ticks)
+            ticks -= thread_table[t].slice_used;
+        ticks = _get_rand(ticks) + ticks / 2 + 1;
+    #else
+        ticks = _get_rand(CONFIG_SCHEDULER_TIMESLICE) + 
+            CONFIG_SCHEDULER_TIMESLICE / 2;
+    #endif
 
-    spinlock_release(&thread_table_slock);
+    #ifdef CHANGED_1
+        /* Do not sleep past the first wakeup deadline */
+        ticks = MIN(ticks, wakeup_ticks);
+        SCHEDTRACE_SCHEDULE(this_cpu, current, t, now, 
+                            now - rq->dispatched_at, blocking);
+        rq->dispatched_at = now;
+    #endif
+
+    #if defined(CHANGED_1) && CONFIG_SCHEDULER_TICKLESS
+        if (t == IDLE_THREAD_TID) {
+            /* Nothing to preempt, wake up only for sleepers. Remote
+               work arrives with an inter-CPU interrupt. */
+            ticks = wakeup_ticks;
+        } else if (rq->ready_count > 0) {
+            /* Others are waiting here, let an idle CPU steal them */
+            scheduler_kick_idle_cpu(this_cpu);
+        }
+    #endif
 
     scheduler_current_thread[this_cpu] = t;
 
-    /* Schedule timer interrupt to occur after thread timeslice is spent */
-    timer_set_ticks(_get_rand(CONFIG_SCHEDULER_TIMESLICE) + 
-                    CONFIG_SCHEDULER_TIMESLICE / 2);
+    /* Schedule timer interrupt to occur after thread timeslice is
+       spent or when the next sleeping thread should wake up */
+    timer_set_ticks(ticks);
 }
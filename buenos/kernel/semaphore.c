@@ -40,6 +40,9 @@
 #include "kernel/config.h"
 #include "kernel/assert.h"
 #include "lib/libc.h"
+#ifdef CHANGED_1
+    #include "kernel/objpool.h"
+#endif
 
 /** @name Semaphores
  *
@@ -51,8 +54,16 @@
 /** Table containing all semaphores in the system */
 static semaphore_t semaphore_table[CONFIG_MAX_SEMAPHORES];
 
+#ifdef CHANGED_1
+/** Free semaphores, starting with the semaphore_table */
+static objpool_t semaphore_pool;
+
+/** Completion semaphore of each thread, see semaphore_get_completion */
+static semaphore_t semaphore_completions[CONFIG_MAX_THREADS];
+#else
 /** Lock which must be held before accessing the semaphore_table */
 static spinlock_t semaphore_table_slock;
+#endif
 
 /**
  * Initializes semaphore subsystem. Sets all system semaphores
@@ -63,9 +74,19 @@ void semaphore_init(void)
 {
     int i;
 
+#ifdef CHANGED_1
+    objpool_init(&semaphore_pool, semaphore_table, sizeof(semaphore_t),
+                 CONFIG_MAX_SEMAPHORES);
+    for(i = 0; i < CONFIG_MAX_THREADS; i++) {
+        spinlock_reset(&semaphore_completions[i].slock);
+        semaphore_completions[i].value = 0;
+        semaphore_completions[i].creator = i;
+    }
+#else
     spinlock_reset(&semaphore_table_slock);
     for(i = 0; i < CONFIG_MAX_SEMAPHORES; i++)
         semaphore_table[i].creator = -1;
+#endif
 }
 
 /**
@@ -79,6 +100,26 @@ void semaphore_init(void)
  * @see semaphore_destroy
  */
 
+#ifdef CHANGED_1
+semaphore_t *semaphore_create(int value)
+{
+    semaphore_t *sem;
+
+    KERNEL_ASSERT(value >= 0);
+
+    /* The pool grows when the table is full, so this fails only when
+       the whole memory is exhausted. */
+    sem = objpool_get(&semaphore_pool);
+    if (sem == NULL)
+        return NULL;
+
+    sem->creator = thread_get_current_thread();
+    sem->value = value;
+    spinlock_reset(&sem->slock);
+
+    return sem;
+}
+#else
 semaphore_t *semaphore_create(int value)
 {
     interrupt_status_t intr_status;
@@ -114,6 +155,7 @@ semaphore_t *semaphore_create(int value)
 
     return &semaphore_table[sem_id];
 }
+#endif
 
 /**
  * Free given semaphore. Semaphore sem is freed for later
@@ -125,7 +167,29 @@ semaphore_t *semaphore_create(int value)
 void semaphore_destroy(semaphore_t *sem)
 {
     sem->creator = -1;
+#ifdef CHANGED_1
+    objpool_put(&semaphore_pool, sem);
+#endif
+}
+
+#ifdef CHANGED_1
+/**
+ * Returns the completion semaphore of the current thread. It has
+ * value 0 and the thread can wait on it with semaphore_P() for one
+ * event that some other thread or an interrupt handler signals with
+ * semaphore_V(). Every wait must be paired with exactly one signal,
+ * so the value is 0 again when the thread uses it next time.
+ *
+ * Unlike semaphore_create() this never fails, which makes it suitable
+ * for waiting on the completion of short synchronous requests.
+ *
+ * @return The completion semaphore of the current thread.
+ */
+semaphore_t *semaphore_get_completion(void)
+{
+    return &semaphore_completions[thread_get_current_thread()];
 }
+#endif
 
 /**
  * Decreases value of the semaphore sem by one. If semaphore has no free
@@ -51,5 +51,8 @@ semaphore_t *semaphore_create(int value);
 void semaphore_destroy(semaphore_t *sem);
 void semaphore_P(semaphore_t *sem);
 void semaphore_V(semaphore_t *sem);
+#ifdef CHANGED_1
+semaphore_t *semaphore_get_completion(void);
+#endif
 
 #endif /* BUENOS_KERNEL_SEMAPHORE_H */
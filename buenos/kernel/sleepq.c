@@ -56,6 +56,329 @@
  * @{
  */
 
+#ifdef CHANGED_1
+
+/* Size of the sleep queue hashtable (prime number) */
+#define SLEEPQ_HASHTABLE_SIZE 127
+
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+extern spinlock_t thread_table_slock;
+
+/* Wait queue of one resource. The queues are not allocated
+ * separately: every thread owns one queue, and the first thread going
+ * to sleep on a resource lends its queue to the resource. The other
+ * sleepers put their queues on the spare list of the resource queue.
+ * Each woken thread takes one spare back, and the last one takes the
+ * resource queue itself, so there is always a queue for everyone.
+ */
+typedef struct {
+    /* the resource waited for, 0 if the queue is not in use */
+    uint32_t resource;
+    /* sleeping threads in FIFO order, linked through their next field */
+    TID_t head;
+    TID_t tail;
+    /* next queue in the same hashtable slot, or the next spare queue */
+    int next;
+    /* first spare queue lent by the sleepers, negative if none */
+    int spares;
+} sleepq_queue_t;
+
+/* One slot of the hashtable. The lock protects the queues in the slot
+   and the threads on them. */
+typedef struct {
+    spinlock_t slock;
+    /* first queue in the slot, negative if none */
+    int first;
+} sleepq_bucket_t;
+
+/* the sleep queue hashtable itself */
+static sleepq_bucket_t sleepq_hashtable[SLEEPQ_HASHTABLE_SIZE];
+
+/* all wait queues, one per thread */
+static sleepq_queue_t sleepq_queues[CONFIG_MAX_THREADS];
+
+/* the queue owned by each thread, negative while it is lent out */
+static int sleepq_owned[CONFIG_MAX_THREADS];
+
+
+/* Hash function used to index the sleep queue table */
+#define SLEEPQ_HASH(res) ((uint32_t)(res) % SLEEPQ_HASHTABLE_SIZE)
+
+/** Initializes the sleep queue system. The hashtable slots are all
+ * emptied and every thread is given a queue of its own.
+ */
+void sleepq_init(void)
+{
+    int i;
+
+    for (i=0; i<SLEEPQ_HASHTABLE_SIZE; i++) {
+        spinlock_reset(&sleepq_hashtable[i].slock);
+        sleepq_hashtable[i].first = -1;
+    }
+
+    for (i=0; i<CONFIG_MAX_THREADS; i++) {
+        sleepq_queues[i].resource = 0;
+        sleepq_queues[i].head = -1;
+        sleepq_queues[i].tail = -1;
+        sleepq_queues[i].next = -1;
+        sleepq_queues[i].spares = -1;
+        sleepq_owned[i] = i;
+    }
+}
+
+/* Finds the queue of the resource from the given slot, whose lock
+ * must be held. The queue before it in the slot is stored in prev.
+ * Returns negative if nobody sleeps on the resource.
+ */
+static int sleepq_find(sleepq_bucket_t *bucket, uint32_t resource, int *prev)
+{
+    int q;
+
+    *prev = -1;
+    for (q = bucket->first; q >= 0; q = sleepq_queues[q].next) {
+        if (sleepq_queues[q].resource == resource)
+            return q;
+        *prev = q;
+    }
+    return -1;
+}
+
+/* Removes the queue q, whose predecessor in the slot is prev, from
+   the slot. The slot lock must be held. */
+static void sleepq_unlink(sleepq_bucket_t *bucket, int q, int prev)
+{
+    if (prev < 0)
+        bucket->first = sleepq_queues[q].next;
+    else
+        sleepq_queues[prev].next = sleepq_queues[q].next;
+    sleepq_queues[q].next = -1;
+    sleepq_queues[q].resource = 0;
+}
+
+/** Adds the currently running thread into the sleep queue. The thread
+ * is added to the end of the wait queue of the resource and it is
+ * marked as waiting for the specified resource. This function does
+ * not cause the thread to go to sleep, the thread must switch
+ * explicitly after calling this function. Before switching, the
+ * thread usually frees the resource it will start waiting for
+ * (release some spinlock).
+ * 
+ * Note that interrupts must be disabled before calling this function.
+ *
+ * @param resource The resource to wait for
+ */
+void sleepq_add(void *resource)
+{
+    sleepq_bucket_t *bucket;
+    sleepq_queue_t *queue;
+    TID_t my_tid;
+    int q, prev, mine;
+    interrupt_status_t intr_state;
+
+    /* Interrupts _must_ be disabled when calling this function: */
+    intr_state = _interrupt_get_state();
+    KERNEL_ASSERT((intr_state & INTERRUPT_MASK_ALL) == 0 
+                  || !(intr_state & INTERRUPT_MASK_MASTER));
+
+    bucket = &sleepq_hashtable[SLEEPQ_HASH(resource)];
+    my_tid = thread_get_current_thread();
+    /* the thread to be added should not have a next entry: */
+    thread_table[my_tid].next = -1; 
+    thread_table[my_tid].sleeps_on = (uint32_t)resource; 
+
+    /* Idle thread should never do _anything_ (other than its own wait loop) */
+    KERNEL_ASSERT(my_tid != IDLE_THREAD_TID);
+
+    spinlock_acquire(&bucket->slock);
+
+    mine = sleepq_owned[my_tid];
+    KERNEL_ASSERT(mine >= 0);
+    sleepq_owned[my_tid] = -1;
+
+    q = sleepq_find(bucket, (uint32_t)resource, &prev);
+    if (q < 0) {
+        /* first sleeper, the resource gets our queue */
+        queue = &sleepq_queues[mine];
+        queue->resource = (uint32_t)resource;
+        queue->head = my_tid;
+        queue->tail = my_tid;
+        queue->spares = -1;
+        queue->next = bucket->first;
+        bucket->first = mine;
+    } else {
+        /* append to the queue and lend ours as a spare */
+        queue = &sleepq_queues[q];
+        thread_table[queue->tail].next = my_tid;
+        queue->tail = my_tid;
+        sleepq_queues[mine].next = queue->spares;
+        queue->spares = mine;
+    }
+
+    spinlock_release(&bucket->slock);
+}
+
+/* Import prototype for unsafe function from scheduler.c */
+void scheduler_add_to_ready_list(TID_t t);
+
+/* Wakes up the given thread, which has already been removed from the
+ * sleep queue. The thread table lock must be held. The scheduler
+ * checks sleeps_on under the same lock, so a thread which has not yet
+ * switched away will simply not go to sleep.
+ */
+static void sleepq_make_ready(TID_t t)
+{
+    thread_table[t].sleeps_on = 0;
+
+    if (thread_table[t].state == THREAD_SLEEPING) {
+        thread_table[t].state = THREAD_READY;
+        scheduler_add_to_ready_list(t);
+    }
+}
+
+/* Removes the first thread waiting for the resource from the sleep
+ * queue and wakes it up. Interrupts must be disabled.
+ *
+ * Returns the woken thread, or negative if there were no waiters.
+ */
+static TID_t sleepq_wake_first(void *resource)
+{
+    sleepq_bucket_t *bucket;
+    sleepq_queue_t *queue;
+    TID_t first;
+    int q, prev;
+
+    bucket = &sleepq_hashtable[SLEEPQ_HASH(resource)];
+
+    spinlock_acquire(&bucket->slock);
+
+    q = sleepq_find(bucket, (uint32_t)resource, &prev);
+    if (q < 0) {
+        spinlock_release(&bucket->slock);
+        return -1;
+    }
+
+    queue = &sleepq_queues[q];
+    first = queue->head;
+    queue->head = thread_table[first].next;
+    thread_table[first].next = -1;
+
+    if (queue->head < 0) {
+        /* the last sleeper takes the queue of the resource */
+        sleepq_unlink(bucket, q, prev);
+        sleepq_owned[first] = q;
+    } else {
+        sleepq_owned[first] = queue->spares;
+        queue->spares = sleepq_queues[queue->spares].next;
+        sleepq_queues[sleepq_owned[first]].next = -1;
+    }
+
+    spinlock_release(&bucket->slock);
+
+    spinlock_acquire(&thread_table_slock);
+    sleepq_make_ready(first);
+    spinlock_release(&thread_table_slock);
+
+    return first;
+}
+
+/** Wake the first thread waiting for given resource from the sleep
+ * queue. If such a thread exists, it is removed from the sleep queue
+ * and placed on the scheduler's ready-to-run list.
+ *
+ * @param resource Wake the first thread waiting for this resource
+ */
+void sleepq_wake(void *resource)
+{
+    interrupt_status_t intr_state;
+
+    intr_state = _interrupt_disable();
+    sleepq_wake_first(resource);
+    _interrupt_set_state(intr_state);
+}
+
+/** Wake at most n threads waiting for given resource, in the order
+ * they went to sleep.
+ *
+ * @param resource Wake threads waiting for this resource
+ * @param n The maximum number of threads to wake
+ *
+ * @return The number of threads woken.
+ */
+int sleepq_wake_n(void *resource, int n)
+{
+    interrupt_status_t intr_state;
+    int woken;
+
+    intr_state = _interrupt_disable();
+    for (woken = 0; woken < n; woken++) {
+        if (sleepq_wake_first(resource) < 0)
+            break;
+    }
+    _interrupt_set_state(intr_state);
+
+    return woken;
+}
+
+
+/** Wake all threads waiting for given resource from the sleep
+ * queue. If such threads exists, they are removed from the sleep
+ * queue and placed on the scheduler's ready-to-run list.
+ *
+ * The whole wait queue is detached from the hashtable at once, so the
+ * slot is locked only for that and not while the threads are woken.
+ *
+ * @param resource Wake threads waiting for this resource
+ */
+void sleepq_wake_all(void *resource)
+{
+    sleepq_bucket_t *bucket;
+    sleepq_queue_t *queue;
+    interrupt_status_t intr_state;
+    TID_t wake, next;
+    int q, prev;
+
+    bucket = &sleepq_hashtable[SLEEPQ_HASH(resource)];
+
+    intr_state = _interrupt_disable();
+    spinlock_acquire(&bucket->slock);
+
+    q = sleepq_find(bucket, (uint32_t)resource, &prev);
+    if (q >= 0)
+        sleepq_unlink(bucket, q, prev);
+
+    spinlock_release(&bucket->slock);
+
+    if (q < 0) {
+        _interrupt_set_state(intr_state);
+        return;
+    }
+
+    /* The queue is now private to us. Give every thread a queue back
+       and wake it. */
+    queue = &sleepq_queues[q];
+    spinlock_acquire(&thread_table_slock);
+
+    for (wake = queue->head; wake >= 0; wake = next) {
+        next = thread_table[wake].next;
+        thread_table[wake].next = -1;
+
+        if (next < 0) {
+            sleepq_owned[wake] = q;
+        } else {
+            sleepq_owned[wake] = queue->spares;
+            queue->spares = sleepq_queues[queue->spares].next;
+            sleepq_queues[sleepq_owned[wake]].next = -1;
+        }
+
+        sleepq_make_ready(wake);
+    }
+
+    spinlock_release(&thread_table_slock);
+    _interrupt_set_state(intr_state);
+}
+
+#else
+
 /* Size of the sleep queue hashtable (prime number) */
 #define SLEEPQ_HASHTABLE_SIZE 127
 
@@ -262,4 +585,6 @@ void sleepq_wake_all(void *resource)
     _interrupt_set_state(intr_state);
 }
 
+#endif
+
 /** @} */
@@ -42,5 +42,8 @@ void sleepq_init(void);
 void sleepq_add(void *resource);
 void sleepq_wake(void *resource);
 void sleepq_wake_all(void *resource);
+#ifdef CHANGED_1
+int sleepq_wake_n(void *resource, int n);
+#endif
 
 #endif /* BUENOS_KERNEL_SLEEPQ_H */
@@ -45,7 +45,10 @@
 #include "kernel/idle.h"
 #ifdef CHANGED_1
     #include "drivers/metadev.h"
+    #include "drivers/yams.h"
     #include "lib/debug.h"
+    #include "kernel/schedtrace.h"
+    #include "vm/pagepool.h"
 #endif
 
 /** @name Thread library
@@ -61,8 +64,28 @@ spinlock_t thread_table_slock;
 /** The table containing all threads in the system, whether active or not. */
 thread_table_t thread_table[CONFIG_MAX_THREADS];
 
+#ifdef CHANGED_1
+/* Kernel stack of the idle thread. The stacks of other threads are
+   pages taken from the page pool when the thread is created. */
+static char thread_idle_stack[CONFIG_THREAD_STACKSIZE];
+
+/* Kernel address of the stack of each thread, 0 for none */
+static uint32_t thread_stacks[CONFIG_MAX_THREADS];
+
+/* Stacks of dead threads, reused before taking new pages from the
+   page pool. Linked through the first word of each stack. Protected
+   by thread_table_slock. */
+static uint32_t thread_free_stacks;
+
+/* Free thread table entries, linked through next. Freed entries go
+   to the tail so that a TID is not reused right away. Protected by
+   thread_table_slock. */
+static TID_t thread_free_head;
+static TID_t thread_free_tail;
+#else
 /* Thread stack areas for kernel threads */
 char thread_stack_areas[CONFIG_THREAD_STACKSIZE * CONFIG_MAX_THREADS];
+#endif
 
 /* Import running thread id table from scheduler */
 extern TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
@@ -84,27 +107,65 @@ void thread_table_init(void)
 
     spinlock_reset(&thread_table_slock);
 
+    #ifdef CHANGED_1
+        /* Kernel stacks are single pages from the page pool */
+        KERNEL_ASSERT(CONFIG_THREAD_STACKSIZE <= PAGE_SIZE);
+
+        thread_free_stacks = 0;
+        thread_free_head = -1;
+        thread_free_tail = -1;
+    #endif
+
     /* Init all entries to 'NULL' */
     for (i=0; i<CONFIG_MAX_THREADS; i++) {
+        #ifdef CHANGED_1
+        /* Context pointers are set when the stack is allocated */
+        thread_table[i].context      = NULL;
+        thread_stacks[i]             = 0;
+        #else
         /* Set context pointers to the top of the stack*/
         thread_table[i].context      = (context_t *) (thread_stack_areas
             +CONFIG_THREAD_STACKSIZE*i + CONFIG_THREAD_STACKSIZE - 
                                   sizeof(context_t));
+        #endif
         thread_table[i].user_context = NULL;
         thread_table[i].state        = THREAD_FREE;
         thread_table[i].sleeps_on    = 0;
         thread_table[i].pagetable    = NULL;
         thread_table[i].process_id   = -1;    
         thread_table[i].next         = -1;    
+        thread_table[i].cpu          = 0;
         #ifdef CHANGED_1
         thread_table[i].sleeps_until = 0;
         thread_table[i].priority = PRIORITY_NORMAL;
+        thread_table[i].level = THREAD_LEVEL_NORMAL;
+        thread_table[i].base_level = THREAD_LEVEL_NORMAL;
+        thread_table[i].slice_used = 0;
+        thread_table[i].affinity = THREAD_AFFINITY_ALL;
+
+        if (i != IDLE_THREAD_TID) {
+            /* append to the free list */
+            if (thread_free_tail < 0)
+                thread_free_head = i;
+            else
+                thread_table[thread_free_tail].next = i;
+            thread_free_tail = i;
+        }
         #endif
     }
 
+    #ifdef CHANGED_1
+    thread_stacks[IDLE_THREAD_TID] = (uint32_t) thread_idle_stack;
+    thread_table[IDLE_THREAD_TID].context = (context_t *) 
+        (thread_idle_stack + CONFIG_THREAD_STACKSIZE - sizeof(context_t));
+    thread_table[IDLE_THREAD_TID].context->cpu_regs[MIPS_REGISTER_SP] =
+        (uint32_t) thread_idle_stack + CONFIG_THREAD_STACKSIZE -4 -
+        sizeof(context_t);
+    #else
     thread_table[IDLE_THREAD_TID].context->cpu_regs[MIPS_REGISTER_SP] =
         (uint32_t) thread_stack_areas + CONFIG_THREAD_STACKSIZE -4 -
         sizeof(context_t);
+    #endif
     thread_table[IDLE_THREAD_TID].context->pc = 
         (uint32_t) _idle_thread_wait_loop;
     thread_table[IDLE_THREAD_TID].context->status = 
@@ -165,6 +226,8 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
         next_tid = (tid+1) % CONFIG_MAX_THREADS;
 
         thread_table[tid].state = THREAD_NONREADY;
+        /* start on the run queue of the creating CPU */
+        thread_table[tid].cpu = _interrupt_getcpu();
 
         spinlock_release(&thread_table_slock);
         _interrupt_set_state(intr_status);
@@ -223,14 +286,15 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
 
 #ifdef CHANGED_1
 /** Create a thread with priority.
- *  stuff is backwards compatible.
+ *  stuff is backwards compatible. PRIORITY_HIGH threads start on the
+ *  highest scheduler level, but are demoted like any other thread if
+ *  they keep using up their timeslices.
  */
 
 TID_t thread_create_priority(void (*func)(uint32_t), uint32_t arg, priority_t priority)
 {
-    static TID_t next_tid = 0;
     TID_t i, tid = -1;
-
+    uint32_t stack;
 
     interrupt_status_t intr_status;
 
@@ -238,19 +302,8 @@ TID_t thread_create_priority(void (*func)(uint32_t), uint32_t arg, priority_t pr
 
     spinlock_acquire(&thread_table_slock);
 
-    /* Find the first free thread table entry starting from 'next_tid' */
-    for (i=0; i<CONFIG_MAX_THREADS; i++) {
-        TID_t t = (i + next_tid) % CONFIG_MAX_THREADS;
-
-        if(t == IDLE_THREAD_TID)
-            continue;
-
-        if (thread_table[t].state
-                == THREAD_FREE) {
-            tid = t;
-            break;
-        }
-    }
+    /* Take the first free thread table entry */
+    tid = thread_free_head;
 
     /* Is the thread table full? */
     if (tid < 0) { 
@@ -259,16 +312,39 @@ TID_t thread_create_priority(void (*func)(uint32_t), uint32_t arg, priority_t pr
         return tid;
     }
 
-    next_tid = (tid+1) % CONFIG_MAX_THREADS;
+    thread_free_head = thread_table[tid].next;
+    if (thread_free_head < 0)
+        thread_free_tail = -1;
 
     thread_table[tid].state = THREAD_NONREADY;
+    /* start on the run queue of the creating CPU */
+    thread_table[tid].cpu = _interrupt_getcpu();
+
+    /* Reuse the stack of a dead thread if there is one */
+    stack = thread_free_stacks;
+    if (stack != 0)
+        thread_free_stacks = *(uint32_t *)stack;
 
     spinlock_release(&thread_table_slock);
     _interrupt_set_state(intr_status);
 
-    thread_table[tid].context      = (context_t *) (thread_stack_areas
-            +CONFIG_THREAD_STACKSIZE*tid + CONFIG_THREAD_STACKSIZE - 
-            sizeof(context_t));
+    if (stack == 0) {
+        stack = pagepool_get_phys_page();
+        if (stack == 0) {
+            /* Out of memory, give the entry back */
+            intr_status = _interrupt_disable();
+            spinlock_acquire(&thread_table_slock);
+            thread_table_free(tid);
+            spinlock_release(&thread_table_slock);
+            _interrupt_set_state(intr_status);
+            return -1;
+        }
+        stack = ADDR_PHYS_TO_KERNEL(stack);
+    }
+    thread_stacks[tid] = stack;
+
+    thread_table[tid].context      = (context_t *) (stack
+            + CONFIG_THREAD_STACKSIZE - sizeof(context_t));
 
     for (i=0; i< (int) sizeof(context_t)/4; i++) {
         *(((uint32_t *) thread_table[tid].context) + i) = 0;
@@ -281,6 +357,15 @@ TID_t thread_create_priority(void (*func)(uint32_t), uint32_t arg, priority_t pr
     thread_table[tid].next         = -1;
     thread_table[tid].sleeps_until = 0;
     thread_table[tid].priority = priority;
+    if (priority == PRIORITY_HIGH)
+        thread_table[tid].base_level = THREAD_LEVEL_HIGH;
+    else
+        thread_table[tid].base_level = THREAD_LEVEL_NORMAL;
+    thread_table[tid].level = thread_table[tid].base_level;
+    thread_table[tid].slice_used = 0;
+    /* threads inherit the CPU affinity of their creator */
+    thread_table[tid].affinity = thread_get_current_thread_entry()->affinity;
+    SCHEDTRACE_THREAD_CREATED(tid);
     #ifdef CHANGED_2
     thread_table[tid].on_kernel_copy = 0; 
     thread_table[tid].copy_error_status = 0; 
@@ -291,9 +376,7 @@ TID_t thread_create_priority(void (*func)(uint32_t), uint32_t arg, priority_t pr
 
     /* set stack pointer to the end of stack */
     thread_table[tid].context->cpu_regs[MIPS_REGISTER_SP] = 
-        (uint32_t)thread_stack_areas
-        + (CONFIG_THREAD_STACKSIZE * tid) 
-        + CONFIG_THREAD_STACKSIZE-4-
+        stack + CONFIG_THREAD_STACKSIZE-4-
         sizeof(context_t); /* to the end of stack */
 
     /* set program counter to the specified function */
@@ -317,6 +400,54 @@ TID_t thread_create_priority(void (*func)(uint32_t), uint32_t arg, priority_t pr
     return tid;
 }
 
+/** Frees the thread table entry of a dead thread. Its kernel stack
+ *  is kept for the next thread created and the TID is put at the end
+ *  of the free list. Called by the scheduler once the thread is no
+ *  longer running. Interrupts must be disabled and the thread table
+ *  spinlock held.
+ *
+ *  @param t The thread to free
+ */
+void thread_table_free(TID_t t)
+{
+    KERNEL_ASSERT(t != IDLE_THREAD_TID);
+
+    thread_table[t].state = THREAD_FREE;
+    thread_table[t].context = NULL;
+
+    if (thread_stacks[t] != 0) {
+        *(uint32_t *)thread_stacks[t] = thread_free_stacks;
+        thread_free_stacks = thread_stacks[t];
+        thread_stacks[t] = 0;
+    }
+
+    thread_table[t].next = -1;
+    if (thread_free_tail < 0)
+        thread_free_head = t;
+    else
+        thread_table[thread_free_tail].next = t;
+    thread_free_tail = t;
+}
+
+/** Destroys a thread created with thread_create() which was never
+ *  run, for when setting it up fails. Gives back its table entry and
+ *  kernel stack like a thread that died.
+ *
+ *  @param t The thread to destroy
+ */
+void thread_destroy_unstarted(TID_t t)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(thread_table[t].state == THREAD_NONREADY);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&thread_table_slock);
+    thread_table_free(t);
+    spinlock_release(&thread_table_slock);
+    _interrupt_set_state(intr_status);
+}
+
 #endif
 
 /** Run a thread. The given thread is added to the scheduler's
@@ -365,6 +496,72 @@ void thread_switch(void)
     }
 #endif
 
+#ifdef CHANGED_1
+    /** Sets the nice value of the calling thread. A nice value of 0
+     *  is the default for normal threads, larger values keep the
+     *  thread on lower scheduler levels, which get the CPU only when
+     *  the higher levels have nothing to run.
+     *
+     *  @param nice The new nice value, from 0 to THREAD_NICE_MAX.
+     *
+     *  @return The new nice value, or negative if it was out of range.
+     */
+    int thread_set_nice(int nice) {
+        interrupt_status_t intr_status;
+        thread_table_t *my_entry;
+
+        if (nice < 0 || nice > THREAD_NICE_MAX)
+            return -1;
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&thread_table_slock);
+
+        my_entry = thread_get_current_thread_entry();
+        my_entry->base_level = THREAD_LEVEL_NORMAL + nice;
+        if (my_entry->level < my_entry->base_level)
+            my_entry->level = my_entry->base_level;
+
+        spinlock_release(&thread_table_slock);
+        _interrupt_set_state(intr_status);
+
+        return nice;
+    }
+
+    /** Sets the CPU affinity mask of the calling thread. Bit i of
+     *  the mask allows the thread to run on CPU i. If the thread is
+     *  not allowed on the CPU it is running on, it is moved right
+     *  away.
+     *
+     *  @param mask The CPUs the thread may run on.
+     *
+     *  @return 0 on success, or negative if the mask contains no
+     *  existing CPU.
+     */
+    int thread_set_affinity(uint32_t mask) {
+        interrupt_status_t intr_status;
+        int num_cpus;
+
+        num_cpus = cpustatus_count();
+        if (num_cpus < 32)
+            mask &= (1 << num_cpus) - 1;
+        if (mask == 0)
+            return -1;
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&thread_table_slock);
+        thread_get_current_thread_entry()->affinity = mask;
+        spinlock_release(&thread_table_slock);
+
+        /* the scheduler queues us on an allowed CPU */
+        if (!(mask & (1 << _interrupt_getcpu())))
+            thread_switch();
+
+        _interrupt_set_state(intr_status);
+
+        return 0;
+    }
+#endif
+
 #ifdef CHANGED_2
     process_id_t thread_get_current_process(void) {
         return thread_get_current_thread_entry()->process_id;
@@ -450,11 +647,6 @@ void thread_finish(void)
     /* Check that the page mappings have been cleared. */
     KERNEL_ASSERT(thread_table[my_tid].pagetable == NULL);
 
-    #ifdef CHANGED_4
-    // remove the tlb entries of the dying thread
-    tlb_clean_by_asid(my_tid);
-    #endif
-
     spinlock_acquire(&thread_table_slock);
     thread_table[my_tid].state = THREAD_DYING;
     spinlock_release(&thread_table_slock);
@@ -38,6 +38,7 @@
 #define BUENOS_KERNEL_THREAD_H
 
 #include "lib/types.h"
+#include "kernel/config.h"
 #include "kernel/cswitch.h"
 #include "vm/pagetable.h"
 #include "proc/process.h"
@@ -60,6 +61,15 @@ typedef enum {
         PRIORITY_NORMAL,
         PRIORITY_HIGH
     } priority_t;
+
+    /* Scheduler levels where PRIORITY_HIGH and PRIORITY_NORMAL
+       threads start. Nice values move normal threads further down. */
+    #define THREAD_LEVEL_HIGH 0
+    #define THREAD_LEVEL_NORMAL 1
+    #define THREAD_NICE_MAX (CONFIG_SCHEDULER_LEVELS - 1 - THREAD_LEVEL_NORMAL)
+
+    /* CPU affinity mask allowing all CPUs, bit i stands for CPU i */
+    #define THREAD_AFFINITY_ALL 0xffffffff
 #endif
 
 
@@ -83,12 +93,22 @@ typedef struct {
     process_id_t process_id;
     /* pointer to the next thread in list (<0 = end of list) */
     TID_t next; 
+    /* CPU whose run queue this thread was last placed on or run on */
+    int cpu;
     
     #ifdef CHANGED_1
         /* earliest time when the thread should be run even with state THREAD_READY */ 
         uint32_t sleeps_until;
         /* thread priority */
         priority_t priority;
+        /* current scheduler level, 0 is the highest */
+        uint16_t level;
+        /* highest scheduler level this thread may be boosted to */
+        uint16_t base_level;
+        /* timer ticks run on the current level */
+        uint32_t slice_used;
+        /* mask of CPUs this thread may run on */
+        uint32_t affinity;
     #endif
 
     #ifdef CHANGED_2
@@ -100,11 +120,11 @@ typedef struct {
 
     /* pad to 64 bytes */
     #ifdef CHANGED_2 
-    uint32_t dummy_alignment_fill[5]; 
+    uint32_t dummy_alignment_fill[1]; 
     #elif CHANGED_1
-    uint32_t dummy_alignment_fill[7]; 
+    uint32_t dummy_alignment_fill[3]; 
     #else
-    uint32_t dummy_alignment_fill[9]; 
+    uint32_t dummy_alignment_fill[8]; 
     #endif 
 } thread_table_t;
 
@@ -124,6 +144,10 @@ void thread_switch(void);
 
 #ifdef CHANGED_1
     void thread_sleep(uint32_t sleep_ms);
+    int thread_set_nice(int nice);
+    int thread_set_affinity(uint32_t mask);
+    void thread_table_free(TID_t t);
+    void thread_destroy_unstarted(TID_t t);
 #endif
 
 #ifdef CHANGED_2
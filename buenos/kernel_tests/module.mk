@@ -4,7 +4,7 @@
 MODULE := kernel_tests
 
 
-FILES := lock_test.c buffer_test.c sleep_test.c phone_system.c priority_test.c nic_test.c
+FILES := lock_test.c buffer_test.c sleep_test.c phone_system.c priority_test.c nic_test.c thread_test.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
@@ -0,0 +1,73 @@
+#ifdef CHANGED_1
+
+#include "kernel/thread.h"
+#include "kernel/semaphore.h"
+#include "kernel/config.h"
+#include "kernel/assert.h"
+#include "lib/libc.h"
+
+/* Creates as many threads as possible, lets them all exit and does
+ * it again. Every round should create the same number of threads,
+ * which shows that dead threads give back their table entries and
+ * kernel stacks. */
+
+#define THREAD_TEST_ROUNDS 5
+
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+
+static semaphore_t *thread_test_started;
+static semaphore_t *thread_test_go;
+static semaphore_t *thread_test_done;
+static TID_t thread_test_tids[CONFIG_MAX_THREADS];
+
+void thread_test_thread(uint32_t param) {
+    param = param;
+    semaphore_V(thread_test_started);
+    semaphore_P(thread_test_go);
+    semaphore_V(thread_test_done);
+}
+
+void thread_test_main(void)
+{
+    int round, i, count;
+    int first_count = 0;
+
+    kprintf("starting thread test\n");
+    thread_test_started = semaphore_create(0);
+    thread_test_go = semaphore_create(0);
+    thread_test_done = semaphore_create(0);
+
+    for (round = 0; round < THREAD_TEST_ROUNDS; round++) {
+        for (count = 0; count < CONFIG_MAX_THREADS; count++) {
+            TID_t thread;
+            thread = thread_create(&thread_test_thread, count);
+            if (thread < 0)
+                break;
+            thread_test_tids[count] = thread;
+            thread_run(thread);
+        }
+
+        /* all threads alive at the same time */
+        for (i = 0; i < count; i++)
+            semaphore_P(thread_test_started);
+        for (i = 0; i < count; i++)
+            semaphore_V(thread_test_go);
+
+        kprintf("round %d: %d threads created\n", round, count);
+        if (round == 0)
+            first_count = count;
+        KERNEL_ASSERT(count == first_count);
+        /* wait until they have all ended and the scheduler has freed
+           their entries, which happens once each has switched out */
+        for (i = 0; i < count; i++)
+            semaphore_P(thread_test_done);
+        for (i = 0; i < count; i++) {
+            while (thread_table[thread_test_tids[i]].state != THREAD_FREE)
+                thread_switch();
+        }
+    }
+
+    kprintf("thread test done\n");
+}
+
+#endif
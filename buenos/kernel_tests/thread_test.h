@@ -0,0 +1,5 @@
+#ifdef CHANGED_1
+
+void thread_test_main(void);
+
+#endif
@@ -71,10 +71,19 @@ void user_exception_handle(int exception)
     my_entry = thread_get_current_thread_entry();
     my_entry->user_context = my_entry->context;
 
+    #ifdef CHANGED_4
+    // another thread has ended the process
+    syscall_exit_if_dying();
+    #endif
+
     #ifdef CHANGED_2
         if (exception == EXCEPTION_SYSCALL) {
             _interrupt_enable();
             syscall_handle(my_entry->user_context);
+            #ifdef CHANGED_4
+            // the process may have ended while the syscall slept
+            syscall_exit_if_dying();
+            #endif
             _interrupt_disable();
         } else {
             #ifdef CHANGED_4
@@ -0,0 +1,218 @@
+#ifdef CHANGED_2
+
+#include "proc/futex.h"
+#include "proc/process.h"
+#include "kernel/thread.h"
+#include "kernel/sleepq.h"
+#include "kernel/lock_cond.h"
+#include "kernel/interrupt.h"
+#include "kernel/panic.h"
+#include "kernel/assert.h"
+#include "drivers/yams.h"
+#include "vm/vm.h"
+
+#ifdef CHANGED_4
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+extern uint32_t virtual_pool_size;
+#endif
+
+/** @name Futexes
+ *
+ * Userland threads sleep on a word of user memory with futex_wait()
+ * and are woken with futex_wake(). Userland does the fast path with
+ * atomic operations on the word and calls the kernel only when it
+ * has to wait or when there are waiters to wake.
+ *
+ * Sleepers are kept in the sleep queue keyed by the swap virtual page
+ * behind the user address. Unlike the physical address it stays the
+ * same while the page is swapped out and in again, and it is the same
+ * in every address space the page is mapped into.
+ *
+ * @{
+ */
+
+/* Number of locks serializing waits and wakes (prime number) */
+#define FUTEX_LOCKS 31
+
+/* Keys are below 0x80000000, so they never collide with the kernel
+   addresses other sleep queue users sleep on, as long as there are
+   fewer than 2^19 virtual pages. */
+#define FUTEX_KEY(page, vaddr) \
+    ((((uint32_t)(page) + 1) << 12) | ((vaddr) & (PAGE_SIZE - 1)))
+
+#define FUTEX_HASH(key) ((key) % FUTEX_LOCKS)
+
+/* The value check and going to sleep happen under the lock of the
+   key, so a wake cannot slip in between. These are sleeping locks,
+   because reading the user word may page fault. */
+static lock_t *futex_locks[FUTEX_LOCKS];
+
+void futex_init(void)
+{
+    int i;
+
+#ifdef CHANGED_4
+    // the keys would wrap into the kernel addresses or into each other
+    KERNEL_ASSERT(virtual_pool_size < (1 << 19));
+#endif
+
+    for (i = 0; i < FUTEX_LOCKS; i++) {
+        futex_locks[i] = lock_create();
+        if (futex_locks[i] == NULL)
+            KERNEL_PANIC("Could not create futex locks");
+    }
+}
+
+/* Returns the sleep queue key of the user address, or 0 if it is
+   unaligned or not mapped. */
+static uint32_t futex_key(uint32_t *uaddr)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    uint32_t vaddr = (uint32_t)uaddr;
+    int page;
+#ifdef CHANGED_4
+    pagetable_entry_t *entry;
+    interrupt_status_t intr_status;
+    int cow;
+#endif
+
+    if (pagetable == NULL || (vaddr & 3) != 0 || vaddr >= USERLAND_STACK_TOP)
+        return 0;
+
+#ifdef CHANGED_4
+    entry = vm_pagetable_entry(pagetable, vaddr, 0);
+    if (entry == NULL)
+        return 0;
+    if (ADDR_IS_ON_EVEN_PAGE(vaddr)) {
+        page = entry->even_page;
+        cow = entry->even_cow;
+    } else {
+        page = entry->odd_page;
+        cow = entry->odd_cow;
+    }
+    if (page < 0)
+        return 0;
+
+    /* A page shared copy-on-write after a fork is replaced with a
+       private copy on the next write, which would leave the sleepers
+       on the old key. Make the copy now. */
+    if (cow) {
+        intr_status = _interrupt_disable();
+        page = vm_cow_fault(pagetable, vaddr);
+        _interrupt_set_state(intr_status);
+    }
+#else
+    page = vm_lookup(pagetable, vaddr);
+#endif
+    if (page < 0)
+        return 0;
+
+    return FUTEX_KEY(page, vaddr);
+}
+
+/**
+ * Puts the current thread to sleep on the user word uaddr if it
+ * still contains expected. The thread may wake up without a
+ * futex_wake(), so the caller must check its condition again.
+ *
+ * @return FUTEX_OK when woken, FUTEX_EAGAIN if the word did not
+ * contain expected, FUTEX_EFAULT if uaddr is not a valid address.
+ */
+int futex_wait(uint32_t *uaddr, uint32_t expected)
+{
+    interrupt_status_t intr_status;
+    uint32_t key, value;
+    lock_t *lock;
+
+    key = futex_key(uaddr);
+    if (key == 0)
+        return FUTEX_EFAULT;
+    lock = futex_locks[FUTEX_HASH(key)];
+
+    lock_acquire(lock);
+
+#ifdef CHANGED_4
+    // futex_wake_process() checks for sleepers under this lock
+    if (process_table[thread_get_current_process()].dying) {
+        lock_release(lock);
+        return FUTEX_EAGAIN;
+    }
+#endif
+
+    if (userland_to_kernel_memcpy(uaddr, &value, sizeof(value))
+        != sizeof(value)) {
+        lock_release(lock);
+        return FUTEX_EFAULT;
+    }
+
+    if (value != expected) {
+        lock_release(lock);
+        return FUTEX_EAGAIN;
+    }
+
+    intr_status = _interrupt_disable();
+    sleepq_add((void *)key);
+    lock_release(lock);
+    thread_switch();
+    _interrupt_set_state(intr_status);
+
+    return FUTEX_OK;
+}
+
+/**
+ * Wakes at most count threads sleeping on the user word uaddr.
+ *
+ * @return The number of threads woken, or FUTEX_EFAULT if uaddr is
+ * not a valid address.
+ */
+int futex_wake(uint32_t *uaddr, int count)
+{
+    uint32_t key;
+    lock_t *lock;
+    int woken;
+
+    key = futex_key(uaddr);
+    if (key == 0)
+        return FUTEX_EFAULT;
+    lock = futex_locks[FUTEX_HASH(key)];
+
+    lock_acquire(lock);
+    woken = sleepq_wake_n((void *)key, count);
+    lock_release(lock);
+
+    return woken;
+}
+
+#ifdef CHANGED_4
+/**
+ * Wakes the threads of the process pid sleeping in futex_wait(), so
+ * that they notice the process is exiting. Called after the process
+ * has been marked dying. Other sleepers on the same words just see a
+ * spurious wakeup.
+ */
+void futex_wake_process(process_id_t pid)
+{
+    uint32_t key;
+    int i;
+
+    // with every lock held, a thread of the process is either asleep
+    // already or sees the dying flag once it gets its lock
+    for (i = 0; i < FUTEX_LOCKS; i++)
+        lock_acquire(futex_locks[i]);
+
+    for (i = 0; i < CONFIG_MAX_THREADS; i++) {
+        key = thread_table[i].sleeps_on;
+        if (thread_table[i].state == THREAD_SLEEPING
+            && thread_table[i].process_id == pid
+            && key != 0 && key < 0x80000000)
+            sleepq_wake_all((void *)key);
+    }
+
+    for (i = FUTEX_LOCKS - 1; i >= 0; i--)
+        lock_release(futex_locks[i]);
+}
+#endif
+
+/** @} */
+
+#endif
@@ -0,0 +1,23 @@
+#ifdef CHANGED_2
+
+#ifndef BUENOS_PROC_FUTEX_H
+#define BUENOS_PROC_FUTEX_H
+
+#include "lib/types.h"
+#include "proc/process.h"
+
+/* Return values of futex_wait */
+#define FUTEX_OK      0
+#define FUTEX_EAGAIN -1
+#define FUTEX_EFAULT -2
+
+void futex_init(void);
+int futex_wait(uint32_t *uaddr, uint32_t expected);
+int futex_wake(uint32_t *uaddr, int count);
+#ifdef CHANGED_4
+void futex_wake_process(process_id_t pid);
+#endif
+
+#endif
+
+#endif
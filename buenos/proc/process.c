@@ -47,6 +47,10 @@
 #ifdef CHANGED_2
     #include "lib/debug.h"
 #endif
+#ifdef CHANGED_4
+    #include "proc/textcache.h"
+    #include "proc/shm.h"
+#endif
 
 #ifdef CHANGED_2
 #include "lib/debug.h"
@@ -70,7 +74,18 @@ void process_init_process_table(void) {
 
     for (i = 0; i < CONFIG_MAX_PROCESS_COUNT; i++) {
         process_table[i].state = PROCESS_FREE;
+        #ifdef CHANGED_4
+        process_table[i].text = -1;
+        process_table[i].pagetable = NULL;
+        process_table[i].thread_count = 0;
+        process_table[i].shm = 0;
+        process_table[i].dying = 0;
+        #endif
     }
+    #ifdef CHANGED_4
+    textcache_init();
+    shm_init();
+    #endif
     
     for (i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
         process_filehandle_table[i].in_use = 0;
@@ -187,6 +202,80 @@ int kernel_to_userland_memcpy(void* src, void* dst, uint32_t lenmem)
     return kernel_memcpy(src, dst, lenmem, 0);
 }
 
+#ifdef CHANGED_4
+/* Sets up the thread bookkeeping of a new process, whose first thread
+   is 'tid' in the given slot. Called with process_table_lock held. */
+static void process_start_threads(process_id_t process_id,
+                                  pagetable_t *pagetable, int slot, TID_t tid)
+{
+    process_t *process = &process_table[process_id];
+    int i;
+
+    process->pagetable = pagetable;
+    process->thread_count = 1;
+    process->dying = 0;
+    for (i = 0; i < CONFIG_MAX_PROCESS_THREADS; i++)
+        process->threads[i].state = PROCESS_THREAD_FREE;
+    process->threads[slot].state = PROCESS_THREAD_RUNNING;
+    process->threads[slot].tid = tid;
+    process->threads[slot].retval = 0;
+}
+
+/* Returns the slot of thread 'tid' in the process, negative if it is
+   not a running thread of the process. */
+static int process_thread_slot(process_id_t process_id, TID_t tid)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_MAX_PROCESS_THREADS; i++) {
+        if (process_table[process_id].threads[i].state == PROCESS_THREAD_RUNNING
+            && process_table[process_id].threads[i].tid == tid)
+            return i;
+    }
+    return -1;
+}
+
+/* Maps the stack of the thread in the given slot. Pages left mapped
+   by a fork are reused. Returns negative if out of memory. */
+static int process_map_stack(pagetable_t *pagetable, int slot)
+{
+    uint32_t top = (USERLAND_STACK_TOP - slot * USERLAND_STACK_SLOT)
+        & PAGE_SIZE_MASK;
+    int i;
+
+    for (i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++) {
+        uint32_t vaddr = top - i * PAGE_SIZE;
+        int virtual_page;
+
+        if (vm_lookup(pagetable, vaddr) >= 0)
+            continue;
+        virtual_page = vm_get_virtual_page();
+        if (virtual_page < 0)
+            return -1;
+        if (vm_map(pagetable, virtual_page, vaddr, 0) < 0) {
+            vm_free_virtual_page(virtual_page);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Unmaps the stack of the thread in the given slot. */
+static void process_unmap_stack(pagetable_t *pagetable, int slot)
+{
+    uint32_t top = (USERLAND_STACK_TOP - slot * USERLAND_STACK_SLOT)
+        & PAGE_SIZE_MASK;
+    int i;
+
+    for (i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++)
+        vm_unmap(pagetable, top - i * PAGE_SIZE);
+
+    // a page still shared with a forked child is not freed, so its
+    // TLB entry would survive the unmap
+    tlb_flush_pagetable(pagetable);
+}
+#endif
+
 void process_init(uint32_t entry_point) {
     context_t user_context;
     thread_table_t *my_entry;
@@ -243,10 +332,11 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     pagetable_t *pagetable;
     pagetable_t *original_pagetable;
     #ifdef CHANGED_4
+    uint32_t stack_top;
     #else
     uint32_t phys_page;
-    #endif
     uint32_t stack_bottom, stack_top;
+    #endif
     elf_info_t elf;
     openfile_t file;
     int invalid;
@@ -288,13 +378,20 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
        This is not possible. */
     KERNEL_ASSERT(new_entry->pagetable == NULL);
 
+    #ifdef CHANGED_4
+    pagetable = vm_create_pagetable();
+    #else
     pagetable = vm_create_pagetable(thread_get_current_thread());
+    #endif
     KERNEL_ASSERT(pagetable != NULL);
 
     intr_status = _interrupt_disable();
     new_entry->pagetable = pagetable;
     // set my pagetable too to support context switches during process start
     my_entry->pagetable = pagetable;
+    #ifdef CHANGED_4
+    tlb_activate(pagetable);
+    #endif
     _interrupt_set_state(intr_status);
 
     file = vfs_open((char *)executable);
@@ -313,12 +410,20 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     if (invalid) {
         intr_status = _interrupt_disable();
         my_entry->pagetable = original_pagetable;
+        #ifdef CHANGED_4
+        tlb_activate(original_pagetable);
+        #endif
         _interrupt_set_state(intr_status);
 
+        #ifdef CHANGED_1
+        thread_destroy_unstarted(thread_id);
+        #else
         new_entry->state = THREAD_FREE;
+        #endif
 
         #ifdef CHANGED_4
-        tlb_clean_by_asid(thread_get_current_thread());
+        /* Entries made under the ASID of the failed pagetable can't
+           match before the ASID is reused, which flushes the TLB */
         #else
         tlb_fill(my_entry->pagetable);
         #endif
@@ -335,8 +440,9 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
         #ifdef CHANGED_4
         int virtual_page = vm_get_virtual_page();
         KERNEL_ASSERT(virtual_page != -1);
-        vm_map(new_entry->pagetable, virtual_page, 
-               (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE, 0);
+        int map_status = vm_map(new_entry->pagetable, virtual_page, 
+                                (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE, 0);
+        KERNEL_ASSERT(map_status == 0);
         #else
         #error
         #endif
@@ -345,13 +451,21 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     /* Allocate and map pages for the segments. We assume that
        segments begin at page boundary. (The linker script in tests
        directory creates this kind of segments) */
+    #ifdef CHANGED_4
+    /* Share the read-only segment if the executable is already running */
+    process_table[process_id].text = textcache_map(executable, file, &elf,
+                                                   new_entry->pagetable);
+    #endif
     for(i = 0; i < (int)elf.ro_pages; i++) {
         #if CHANGED_4
+        if (process_table[process_id].text >= 0)
+            break;
         int virtual_page = vm_get_virtual_page();
         KERNEL_ASSERT(virtual_page != -1);
         DEBUG("processdebug", "mapping %x -> %x\n", elf.ro_vaddr + i*PAGE_SIZE, virtual_page);
-        vm_map(new_entry->pagetable, virtual_page, 
-               elf.ro_vaddr + i*PAGE_SIZE, 0);
+        int map_status = vm_map(new_entry->pagetable, virtual_page, 
+                                elf.ro_vaddr + i*PAGE_SIZE, 0);
+        KERNEL_ASSERT(map_status == 0);
         #else
         #error
         #endif
@@ -360,31 +474,19 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     for(i = 0; i < (int)elf.rw_pages; i++) {
         // elf segments might have overlapped just enough to be on the same virtual page
         // so make sure we're not mapping them again
-        int j;   
-        int mapped = 0;
-        for (j = 0; j < (int)new_entry->pagetable->valid_count; j++) {
-            #ifdef CHANGED_4
-            pagetable_entry_t *pagetable_entry = &new_entry->pagetable->entries[j];
-            if (pagetable_entry->VPN == ((elf.rw_vaddr + i*PAGE_SIZE) >> 13)) {
-                if (ADDR_IS_ON_EVEN_PAGE(elf.rw_vaddr + i*PAGE_SIZE)) {
-                    mapped = pagetable_entry->even_page != -1;
-                    break;
-                } else {
-                    mapped = pagetable_entry->odd_page != -1;
-                    break;
-                }
-            }
-            #else
-            #error
-            #endif
-        }
+        #ifdef CHANGED_4
+        int mapped = vm_lookup(new_entry->pagetable, elf.rw_vaddr + i*PAGE_SIZE) >= 0;
+        #else
+        #error
+        #endif
         if (!mapped) {
             #ifdef CHANGED_4
             int virtual_page = vm_get_virtual_page();
             KERNEL_ASSERT(virtual_page != 0);
             DEBUG("processdebug", "mapping %x -> %x\n", elf.rw_vaddr + i*PAGE_SIZE, virtual_page);
-            vm_map(new_entry->pagetable, virtual_page, 
-                   elf.rw_vaddr + i*PAGE_SIZE, 0);
+            int map_status = vm_map(new_entry->pagetable, virtual_page, 
+                                    elf.rw_vaddr + i*PAGE_SIZE, 0);
+            KERNEL_ASSERT(map_status == 0);
             #else
             #error
             #endif
@@ -402,7 +504,7 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
 
     intr_status = _interrupt_disable();
     #ifdef CHANGED_4
-    tlb_clean_by_asid(thread_get_current_thread());
+    /* The TLB is filled on demand */
     #else
     /* Put the mapped pages into TLB. Here we again assume that the
        pages fit into the TLB. After writing proper TLB exception
@@ -413,6 +515,10 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     
     /* Now we may use the virtual addresses of the segments. */
 
+    #ifdef CHANGED_4
+    /* New virtual pages are zero filled on demand, no need to zero
+       them here. */
+    #else
     /* Zero the pages. */
     memoryset((void *)elf.ro_vaddr, 0, elf.ro_pages*PAGE_SIZE);
     memoryset((void *)elf.rw_vaddr, 0, elf.rw_pages*PAGE_SIZE);
@@ -422,10 +528,15 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     memoryset((void *)stack_bottom, 0, CONFIG_USERLAND_STACK_SIZE*PAGE_SIZE);
 
     DEBUG("processdebug", "initialized new process memory to zero\n");
+    #endif
 
     /* Copy segments */
 
+    #ifdef CHANGED_4
+    if (elf.ro_size > 0 && process_table[process_id].text < 0) {
+    #else
     if (elf.ro_size > 0) {
+    #endif
         DEBUG("processdebug", "copying read-only segment\n");
         /* Make sure that the segment is in proper place. */
         KERNEL_ASSERT(elf.ro_vaddr >= PAGE_SIZE);
@@ -472,6 +583,13 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
         #endif
     }
 
+    #ifdef CHANGED_4
+    /* Let later processes running this executable share the segment */
+    if (process_table[process_id].text < 0)
+        process_table[process_id].text = textcache_insert(executable, file, &elf,
+                                                          new_entry->pagetable);
+    #endif
+
     // manually overwrite the arg to point to entry point
     
     new_entry->context->cpu_regs[MIPS_REGISTER_A0] = elf.entry_point;
@@ -515,10 +633,13 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     new_entry->context->cpu_regs[MIPS_REGISTER_A2] = arg_count;
     DEBUG("processdebug", "run new thread\n");
 
-    // set asid for pagetable on new thread
-    pagetable->ASID = thread_id;
     #ifdef CHANGED_4
+    /* Loading left writable entries for the text pages, which are
+       write protected now. The new thread starts with a new ASID. */
+    tlb_flush_pagetable(pagetable);
     #else
+    // set asid for pagetable on new thread
+    pagetable->ASID = thread_id;
     for (i = 0; i < (int)pagetable->valid_count; i++) {
         pagetable->entries[i].ASID = thread_id;
     }
@@ -527,6 +648,11 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     stringcopy(process_table[process_id].name, executable, 32);
     process_table[process_id].state = PROCESS_RUNNING;
     process_table[process_id].parent = thread_get_current_process();
+    #ifdef CHANGED_4
+    process_table[process_id].retval = 0;
+    process_table[process_id].shm = 0;
+    process_start_threads(process_id, pagetable, 0, thread_id);
+    #endif
 
     thread_run(thread_id);
     
@@ -535,7 +661,7 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
     intr_status = _interrupt_disable();
     my_entry->pagetable = original_pagetable;
     #ifdef CHANGED_4
-    tlb_clean_by_asid(thread_get_current_thread());
+    tlb_activate(original_pagetable);
     #else 
     if (my_entry->pagetable) {
         tlb_fill(my_entry->pagetable);
@@ -549,6 +675,271 @@ int process_start_args(const char *executable, void *arg_data, int arg_datalen,
 
     return process_id;
 }
+
+#ifdef CHANGED_4
+/* Starts a forked process or a new thread in userland at 'func'. The
+   argument, stack pointer and return address were left in A1..A3 by
+   process_fork or process_thread_create. */
+static void process_thread_init(uint32_t func)
+{
+    context_t user_context;
+    thread_table_t *my_entry;
+
+    my_entry = thread_get_current_thread_entry();
+
+    memoryset(&user_context, 0, sizeof(user_context));
+    user_context.cpu_regs[MIPS_REGISTER_A0] = my_entry->context->cpu_regs[MIPS_REGISTER_A1];
+    user_context.cpu_regs[MIPS_REGISTER_SP] = my_entry->context->cpu_regs[MIPS_REGISTER_A2];
+    user_context.cpu_regs[MIPS_REGISTER_RA] = my_entry->context->cpu_regs[MIPS_REGISTER_A3];
+    user_context.pc = func;
+
+    thread_goto_userland(&user_context);
+
+    KERNEL_PANIC("Thread returned from userland...");
+}
+
+/**
+ * Creates a copy of the calling process. The child gets the memory of
+ * the parent copy-on-write, so both see the memory as it was at the
+ * time of the fork and neither sees the writes of the other. Open
+ * files are not inherited.
+ *
+ * The child starts at 'func' with 'arg' as its argument and the
+ * current user stack pointer of the parent, and returns to 'ret'.
+ *
+ * @return The process id of the child, or negative on error.
+ */
+int process_fork(uint32_t func, uint32_t arg, uint32_t sp, uint32_t ret)
+{
+    thread_table_t *new_entry;
+    thread_table_t *my_entry;
+    TID_t thread_id;
+    process_id_t process_id;
+    process_id_t my_process;
+    pagetable_t *pagetable;
+    int my_slot;
+    int i;
+
+    process_id = -1;
+    my_entry = thread_get_current_thread_entry();
+    my_process = thread_get_current_process();
+    if (my_entry->pagetable == NULL)
+        return -1;
+
+    lock_acquire(process_table_lock);
+
+    /* The child runs on a copy of our stack, so it takes our slot */
+    my_slot = process_thread_slot(my_process, thread_get_current_thread());
+    KERNEL_ASSERT(my_slot >= 0);
+
+    for (i = 0; i < CONFIG_MAX_PROCESS_COUNT; i++) {
+        if (process_table[i].state == PROCESS_FREE) {
+            process_id = i;
+            break;
+        }
+    }
+    if (process_id < 0) {
+        lock_release(process_table_lock);
+        return -1;
+    }
+
+    thread_id = thread_create(process_thread_init, func);
+    if (thread_id < 0) {
+        lock_release(process_table_lock);
+        return -2;
+    }
+
+    new_entry = &thread_table[thread_id];
+    new_entry->process_id = process_id;
+    KERNEL_ASSERT(new_entry->pagetable == NULL);
+
+    pagetable = vm_create_pagetable();
+    if (pagetable == NULL) {
+        thread_destroy_unstarted(thread_id);
+        lock_release(process_table_lock);
+        return -3;
+    }
+
+    if (vm_fork_pagetable(my_entry->pagetable, pagetable) < 0) {
+        vm_unmap_all(pagetable);
+        vm_destroy_pagetable(pagetable);
+        thread_destroy_unstarted(thread_id);
+        lock_release(process_table_lock);
+        return -3;
+    }
+
+    /* Our writable pages are now copy-on-write, drop the TLB entries
+       that still allow writing them. */
+    tlb_flush_pagetable(my_entry->pagetable);
+
+    process_table[process_id].text = process_table[my_process].text;
+    textcache_ref(process_table[process_id].text);
+    shm_fork(my_process, process_id);
+
+    new_entry->pagetable = pagetable;
+    new_entry->context->cpu_regs[MIPS_REGISTER_A1] = arg;
+    new_entry->context->cpu_regs[MIPS_REGISTER_A2] = sp;
+    new_entry->context->cpu_regs[MIPS_REGISTER_A3] = ret;
+
+    stringcopy(process_table[process_id].name, process_table[my_process].name, 32);
+    process_table[process_id].state = PROCESS_RUNNING;
+    process_table[process_id].parent = my_process;
+    process_table[process_id].retval = 0;
+    process_start_threads(process_id, pagetable, my_slot, thread_id);
+
+    thread_run(thread_id);
+
+    lock_release(process_table_lock);
+
+    return process_id;
+}
+
+/**
+ * Creates a new thread in the calling process. The thread starts at
+ * 'func' with 'arg' as its argument on a stack of its own, and
+ * returns to 'ret'.
+ *
+ * @return The id of the thread within the process, or negative on
+ * error.
+ */
+int process_thread_create(uint32_t func, uint32_t arg, uint32_t ret)
+{
+    thread_table_t *new_entry;
+    TID_t thread_id;
+    process_id_t my_process;
+    process_t *process;
+    int slot;
+    int i;
+
+    slot = -1;
+    my_process = thread_get_current_process();
+    process = &process_table[my_process];
+    if (thread_get_current_thread_entry()->pagetable == NULL)
+        return -1;
+
+    lock_acquire(process_table_lock);
+
+    if (process->dying) {
+        lock_release(process_table_lock);
+        return -1;
+    }
+
+    for (i = 0; i < CONFIG_MAX_PROCESS_THREADS; i++) {
+        if (process->threads[i].state == PROCESS_THREAD_FREE) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        lock_release(process_table_lock);
+        return -1;
+    }
+
+    thread_id = thread_create(process_thread_init, func);
+    if (thread_id < 0) {
+        lock_release(process_table_lock);
+        return -2;
+    }
+    new_entry = &thread_table[thread_id];
+
+    if (process_map_stack(process->pagetable, slot) < 0) {
+        process_unmap_stack(process->pagetable, slot);
+        thread_destroy_unstarted(thread_id);
+        lock_release(process_table_lock);
+        return -3;
+    }
+
+    new_entry->process_id = my_process;
+    new_entry->pagetable = process->pagetable;
+    new_entry->context->cpu_regs[MIPS_REGISTER_A1] = arg;
+    // reserve stack space for argument registers A0, A1
+    new_entry->context->cpu_regs[MIPS_REGISTER_A2] =
+        USERLAND_STACK_TOP - slot * USERLAND_STACK_SLOT - 2*sizeof(void*);
+    new_entry->context->cpu_regs[MIPS_REGISTER_A3] = ret;
+
+    process->threads[slot].state = PROCESS_THREAD_RUNNING;
+    process->threads[slot].tid = thread_id;
+    process->threads[slot].retval = 0;
+    process->thread_count++;
+
+    thread_run(thread_id);
+
+    lock_release(process_table_lock);
+
+    return slot;
+}
+
+/**
+ * Waits until the given thread of the calling process has exited and
+ * frees its slot.
+ *
+ * @return The value the thread gave to thread exit, or negative if
+ * there is no such thread to join.
+ */
+int process_thread_join(int thread)
+{
+    process_t *process;
+    int result;
+
+    if (thread < 0 || thread >= CONFIG_MAX_PROCESS_THREADS)
+        return -1;
+    process = &process_table[thread_get_current_process()];
+
+    lock_acquire(process_table_lock);
+    if (process->threads[thread].state == PROCESS_THREAD_RUNNING
+        && process->threads[thread].tid == thread_get_current_thread()) {
+        // joining ourselves would never return
+        result = -2;
+    } else {
+        while (process->threads[thread].state == PROCESS_THREAD_RUNNING)
+            condition_wait(process_zombie_cv, process_table_lock);
+        if (process->threads[thread].state == PROCESS_THREAD_ZOMBIE) {
+            result = process->threads[thread].retval;
+            process->threads[thread].state = PROCESS_THREAD_FREE;
+        } else {
+            result = -2;
+        }
+    }
+    lock_release(process_table_lock);
+    return result;
+}
+
+/**
+ * Removes the calling thread from its process. The stack of the
+ * thread is unmapped unless it is the last one.
+ *
+ * @return 1 if this was the last thread, which must then free the
+ * resources of the process, 0 otherwise.
+ */
+int process_thread_finish(int retval)
+{
+    process_id_t my_process;
+    process_t *process;
+    TID_t my_tid;
+    int slot, last;
+
+    my_process = thread_get_current_process();
+    process = &process_table[my_process];
+    my_tid = thread_get_current_thread();
+
+    lock_acquire(process_table_lock);
+
+    slot = process_thread_slot(my_process, my_tid);
+    KERNEL_ASSERT(slot >= 0);
+    process->threads[slot].state = PROCESS_THREAD_ZOMBIE;
+    process->threads[slot].retval = retval;
+    last = (--process->thread_count == 0);
+
+    if (!last)
+        process_unmap_stack(process->pagetable, slot);
+
+    lock_release(process_table_lock);
+
+    condition_broadcast(process_zombie_cv);
+
+    return last;
+}
+#endif
 #else
 /**
  * Starts one userland process. The thread calling this function will
@@ -41,6 +41,9 @@
     #include "kernel/lock_cond.h"
     #include "lib/types.h"
     #include "kernel/config.h"
+    #ifdef CHANGED_4
+    #include "vm/pagetable.h"
+    #endif
 
     // TODO: figure out a way to skip this duplication
     typedef int openfile_t;
@@ -56,11 +59,44 @@ typedef enum {
     PROCESS_ZOMBIE
 } process_state_t;
 
+#ifdef CHANGED_4
+typedef enum {
+    PROCESS_THREAD_FREE,
+    PROCESS_THREAD_RUNNING,
+    PROCESS_THREAD_ZOMBIE
+} process_thread_state_t;
+
+// a thread of a userland process. the index in the process is the id
+// of the thread seen by userland and also selects its stack
+typedef struct {
+    process_thread_state_t state;
+    // kernel thread running this, valid while running
+    int tid;
+    // value given to thread exit, returned by join
+    int retval;
+} process_thread_t;
+#endif
+
 typedef struct {
     char name[32];
     process_state_t state; 
     process_id_t parent;
     uint32_t retval;
+#ifdef CHANGED_4
+    // text cache entry of the read-only segment, -1 if not shared
+    int text;
+    // address space shared by the threads
+    pagetable_t *pagetable;
+    // number of running threads, the process ends with the last one
+    int thread_count;
+    process_thread_t threads[CONFIG_MAX_PROCESS_THREADS];
+    // bit i is set if the process is attached to shared memory
+    // segment i
+    uint32_t shm;
+    // set when the process exits or is killed, the remaining threads
+    // exit at their next kernel entry
+    int dying;
+#endif
 } process_t;
 
 process_t process_table[CONFIG_MAX_PROCESS_COUNT];
@@ -84,6 +120,12 @@ void process_init_process_table(void);
 #ifdef CHANGED_2
 int process_start_args(const char *executable, void *arg_data, int arg_datalen, int arg_count);
 int process_start(const char *executable);
+#ifdef CHANGED_4
+int process_fork(uint32_t func, uint32_t arg, uint32_t sp, uint32_t ret);
+int process_thread_create(uint32_t func, uint32_t arg, uint32_t ret);
+int process_thread_join(int thread);
+int process_thread_finish(int retval);
+#endif
 #else
 void process_start(const char *executable);
 #endif
@@ -99,4 +141,11 @@ int kernel_to_userland_memcpy(void* src, void* dst, uint32_t lenmem);
 
 #define USERLAND_STACK_TOP 0x7fffeffc
 
+#ifdef CHANGED_4
+/* Thread n of a process has its stack below USERLAND_STACK_TOP -
+   n * USERLAND_STACK_SLOT. The unmapped rest of each slot catches
+   stack overflows. */
+#define USERLAND_STACK_SLOT 0x10000
+#endif
+
 #endif
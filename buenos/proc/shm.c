@@ -0,0 +1,300 @@
+#ifdef CHANGED_4
+
+#include "proc/shm.h"
+#include "kernel/config.h"
+#include "kernel/lock_cond.h"
+#include "kernel/assert.h"
+#include "kernel/thread.h"
+#include "drivers/yams.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+#include "lib/debug.h"
+
+/** @name Shared memory segments
+ *
+ * A segment is a set of virtual pages mapped writable into every
+ * process attached to it, so the processes see each other's writes
+ * without copying. The segment holds one reference to each page and
+ * every mapping another one, so the pages are freed when the segment
+ * and all mappings are gone. The segment itself is freed when the
+ * last process detaches or exits.
+ *
+ * Segments are found by a key chosen by userland. The segments a
+ * process is attached to are kept as a bit mask in its process table
+ * entry, protected by shm_lock like the segments.
+ *
+ * @{
+ */
+
+/* Most pages a segment can have, the list takes one page */
+#define SHM_MAX_PAGES (SHM_SEGMENT_SPAN / PAGE_SIZE)
+
+typedef struct {
+    /* Number of processes attached, 0 if the segment is free */
+    int users;
+    int key;
+    int page_count;
+    /* Virtual pages of the segment, in a page of their own */
+    int *pages;
+} shm_segment_t;
+
+static shm_segment_t shm_segments[CONFIG_SHM_SEGMENTS];
+static lock_t *shm_lock;
+
+void shm_init(void)
+{
+    int i;
+
+    KERNEL_ASSERT(SHM_MAX_PAGES <= PAGE_SIZE / sizeof(int));
+    KERNEL_ASSERT(CONFIG_SHM_SEGMENTS <= 32);
+
+    shm_lock = lock_create();
+    for (i = 0; i < CONFIG_SHM_SEGMENTS; i++)
+        shm_segments[i].users = 0;
+}
+
+static uint32_t shm_vaddr(int segment)
+{
+    return SHM_REGION_BASE + segment * SHM_SEGMENT_SPAN;
+}
+
+/* Unmaps the first 'count' pages of the segment from the pagetable. */
+static void shm_unmap(int segment, pagetable_t *pagetable, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        vm_unmap(pagetable, shm_vaddr(segment) + i * PAGE_SIZE);
+
+    // the pages live on in the other processes, so freeing them did
+    // not drop their TLB entries
+    tlb_flush_pagetable(pagetable);
+}
+
+/* Maps the segment into the pagetable. Returns negative if the
+   pagetable could not grow, nothing is left mapped then. */
+static int shm_map(int segment, pagetable_t *pagetable)
+{
+    shm_segment_t *seg = &shm_segments[segment];
+    int i;
+
+    for (i = 0; i < seg->page_count; i++) {
+        vm_ref_virtual_page(seg->pages[i]);
+        if (vm_map(pagetable, seg->pages[i],
+                   shm_vaddr(segment) + i * PAGE_SIZE, 0) < 0) {
+            vm_free_virtual_page(seg->pages[i]);
+            shm_unmap(segment, pagetable, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Drops a user of the segment, the last one frees it. */
+static void shm_put(int segment)
+{
+    shm_segment_t *seg = &shm_segments[segment];
+    int i;
+
+    KERNEL_ASSERT(seg->users > 0);
+    if (--seg->users > 0)
+        return;
+
+    DEBUG("shmdebug", "freeing shared memory segment %d, key %d\n",
+          segment, seg->key);
+    for (i = 0; i < seg->page_count; i++)
+        vm_free_virtual_page(seg->pages[i]);
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) seg->pages));
+}
+
+/**
+ * Creates a shared memory segment of 'size' bytes, zero filled, and
+ * attaches the calling process to it.
+ *
+ * @return The address of the segment, -1 if the size is invalid, -2
+ * if a segment with the key exists already, or -3 if there is no free
+ * segment or memory left.
+ */
+int shm_create(int key, int size)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    process_t *process = &process_table[thread_get_current_process()];
+    shm_segment_t *seg;
+    uint32_t addr;
+    int segment, page_count;
+    int i;
+
+    if (pagetable == NULL || size <= 0 || size > SHM_SEGMENT_SPAN)
+        return -1;
+    page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    lock_acquire(shm_lock);
+
+    segment = -1;
+    for (i = 0; i < CONFIG_SHM_SEGMENTS; i++) {
+        if (shm_segments[i].users > 0 && shm_segments[i].key == key) {
+            lock_release(shm_lock);
+            return -2;
+        }
+        if (shm_segments[i].users == 0 && segment < 0)
+            segment = i;
+    }
+    if (segment < 0) {
+        lock_release(shm_lock);
+        return -3;
+    }
+    seg = &shm_segments[segment];
+
+    addr = pagepool_get_phys_page();
+    if (addr == 0) {
+        lock_release(shm_lock);
+        return -3;
+    }
+    seg->pages = (int *) ADDR_PHYS_TO_KERNEL(addr);
+    seg->page_count = 0;
+    seg->key = key;
+    seg->users = 1;
+
+    for (i = 0; i < page_count; i++) {
+        int virtual_page = vm_get_virtual_page();
+        if (virtual_page < 0) {
+            shm_put(segment);
+            lock_release(shm_lock);
+            return -3;
+        }
+        vm_share_virtual_page(virtual_page);
+        seg->pages[i] = virtual_page;
+        seg->page_count++;
+    }
+
+    if (shm_map(segment, pagetable) < 0) {
+        shm_put(segment);
+        lock_release(shm_lock);
+        return -3;
+    }
+    process->shm |= 1 << segment;
+
+    DEBUG("shmdebug", "created shared memory segment %d, key %d, %d pages\n",
+          segment, key, page_count);
+    lock_release(shm_lock);
+    return shm_vaddr(segment);
+}
+
+/**
+ * Attaches the calling process to the segment with the given key.
+ *
+ * @return The address of the segment, -1 if there is no such
+ * segment, -2 if the process is attached to it already, or -3 if
+ * there was no memory left.
+ */
+int shm_attach(int key)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    process_t *process = &process_table[thread_get_current_process()];
+    int segment;
+
+    if (pagetable == NULL)
+        return -1;
+
+    lock_acquire(shm_lock);
+
+    for (segment = 0; segment < CONFIG_SHM_SEGMENTS; segment++) {
+        if (shm_segments[segment].users > 0
+            && shm_segments[segment].key == key)
+            break;
+    }
+    if (segment == CONFIG_SHM_SEGMENTS) {
+        lock_release(shm_lock);
+        return -1;
+    }
+    if (process->shm & (1 << segment)) {
+        lock_release(shm_lock);
+        return -2;
+    }
+
+    shm_segments[segment].users++;
+    if (shm_map(segment, pagetable) < 0) {
+        shm_put(segment);
+        lock_release(shm_lock);
+        return -3;
+    }
+    process->shm |= 1 << segment;
+
+    lock_release(shm_lock);
+    return shm_vaddr(segment);
+}
+
+/**
+ * Detaches the calling process from the segment at 'addr'.
+ *
+ * @return 0 on success, negative if no segment is attached at 'addr'.
+ */
+int shm_detach(uint32_t addr)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    process_t *process = &process_table[thread_get_current_process()];
+    int segment;
+
+    if (pagetable == NULL || addr < SHM_REGION_BASE)
+        return -1;
+    segment = (addr - SHM_REGION_BASE) / SHM_SEGMENT_SPAN;
+    if (segment >= CONFIG_SHM_SEGMENTS || addr != shm_vaddr(segment))
+        return -1;
+
+    lock_acquire(shm_lock);
+
+    if (!(process->shm & (1 << segment))) {
+        lock_release(shm_lock);
+        return -1;
+    }
+
+    shm_unmap(segment, pagetable, shm_segments[segment].page_count);
+    process->shm &= ~(1 << segment);
+    shm_put(segment);
+
+    lock_release(shm_lock);
+    return 0;
+}
+
+/**
+ * Attaches a forked child to the segments of its parent. The pages
+ * were mapped into the child with the rest of the address space.
+ */
+void shm_fork(process_id_t parent, process_id_t child)
+{
+    int i;
+
+    lock_acquire(shm_lock);
+
+    process_table[child].shm = process_table[parent].shm;
+    for (i = 0; i < CONFIG_SHM_SEGMENTS; i++) {
+        if (process_table[child].shm & (1 << i))
+            shm_segments[i].users++;
+    }
+
+    lock_release(shm_lock);
+}
+
+/**
+ * Detaches an exiting process from all its segments. The pages are
+ * left mapped, the caller unmaps the whole address space.
+ */
+void shm_release_all(process_id_t process)
+{
+    int i;
+
+    lock_acquire(shm_lock);
+
+    for (i = 0; i < CONFIG_SHM_SEGMENTS; i++) {
+        if (process_table[process].shm & (1 << i))
+            shm_put(i);
+    }
+    process_table[process].shm = 0;
+
+    lock_release(shm_lock);
+}
+
+/** @} */
+
+#endif
@@ -0,0 +1,24 @@
+#ifdef CHANGED_4
+
+#ifndef BUENOS_PROC_SHM_H
+#define BUENOS_PROC_SHM_H
+
+#include "lib/types.h"
+#include "proc/process.h"
+
+/* Segment i is mapped at SHM_REGION_BASE + i * SHM_SEGMENT_SPAN in
+   every process attached to it, so pointers into a segment are valid
+   in all of them. The heap may not grow into the region. */
+#define SHM_REGION_BASE 0x40000000
+#define SHM_SEGMENT_SPAN 0x00400000
+
+void shm_init(void);
+int shm_create(int key, int size);
+int shm_attach(int key);
+int shm_detach(uint32_t addr);
+void shm_fork(process_id_t parent, process_id_t child);
+void shm_release_all(process_id_t process);
+
+#endif
+
+#endif
@@ -46,9 +46,18 @@
     #include "drivers/device.h"
     #include "vm/vm.h"
     #include "vm/pagepool.h"
+    #include "kernel/schedtrace.h"
+    #include "proc/futex.h"
+    #ifdef CHANGED_4
+    #include "proc/textcache.h"
+    #include "proc/shm.h"
+    #include "kernel/interrupt.h"
+    #endif
 
     
     #define KERNEL_BUFFER_SIZE 256
+    /* Maximum number of trace events returned by one syscall */
+    #define SCHEDTRACE_KERNEL_BUFFER_EVENTS 32
 #ifdef CHANGED_3
     #define IO_KERNEL_BUFFER_SIZE 1024
 #else
@@ -64,13 +73,70 @@ gcd_t *syscall_get_console_gcd(void) {
  * Syscall handler functions
  */
 
+#ifdef CHANGED_4
+/* Ends the whole process of the calling thread. The first thread to
+   get here sets the return value of the process, the other threads
+   exit when they next enter the kernel. */
+void syscall_exit_process(int retval) {
+    process_id_t current_process = thread_get_current_process();
+    process_t *process = &process_table[current_process];
+    int first;
+
+    lock_acquire(process_table_lock);
+    first = !process->dying;
+    if (first) {
+        process->dying = 1;
+        process->retval = retval;
+    }
+    lock_release(process_table_lock);
+
+    if (first) {
+        // the threads running in userland on other CPUs lose their TLB
+        // entries and trap at their next instruction fetch, the ones
+        // sleeping on a futex wake up and return through the kernel
+        tlb_flush_pagetable(process->pagetable);
+        futex_wake_process(current_process);
+    }
+
+    syscall_exit_thread(process->retval);
+}
+
+/* Ends the calling thread if its process is exiting. May be called
+   with interrupts disabled. */
+void syscall_exit_if_dying(void) {
+    process_t *process = &process_table[thread_get_current_process()];
+
+    if (process->dying) {
+        _interrupt_enable();
+        syscall_exit_thread(process->retval);
+    }
+}
+
+/* Ends the calling thread. The last thread of a process frees the
+   resources of the process and makes it a zombie. */
+void syscall_exit_thread(int retval) {
+#else
 void syscall_exit_process(int retval) {
+#endif
     int i;
     process_id_t current_process;
     pagetable_t *pagetable;
+    #ifdef CHANGED_4
+    int text;
+    #endif
 
     current_process = thread_get_current_process();
 
+    #ifdef CHANGED_4
+    if (!process_thread_finish(retval)) {
+        // the other threads still use the address space and files
+        DEBUG("processdebug", "thread %d of process %d exit\n",
+              thread_get_current_thread(), current_process);
+        thread_get_current_thread_entry()->pagetable = NULL;
+        thread_finish();
+    }
+    #endif
+
     DEBUG("processdebug", "process %d exit\n", current_process);
 
     lock_acquire(process_filehandle_lock);
@@ -85,8 +151,15 @@ void syscall_exit_process(int retval) {
 
     lock_acquire(process_table_lock);
     
+    #ifndef CHANGED_4
     process_table[current_process].retval = retval;
+    #endif
     process_table[current_process].state = PROCESS_ZOMBIE;
+    #ifdef CHANGED_4
+    text = process_table[current_process].text;
+    process_table[current_process].text = -1;
+    process_table[current_process].pagetable = NULL;
+    #endif
 
     // clean the child processes of this process
     for (i = 0; i < CONFIG_MAX_PROCESS_COUNT; i++) {    
@@ -101,21 +174,17 @@ void syscall_exit_process(int retval) {
 
     pagetable = thread_get_current_thread_entry()->pagetable;
     if (pagetable) {
-        for (i = 0; i < (int)pagetable->valid_count; i++) {
-            #ifdef CHANGED_4
-            pagetable_entry_t *entry = &pagetable->entries[i];
-            if (entry->even_page >= 0) {
-                vm_free_virtual_page(entry->even_page); 
-            }
-            if (entry->odd_page >= 0) {
-                vm_free_virtual_page(entry->odd_page); 
-            }
-            #else
-            #error
-            #endif
-        }
+        #ifdef CHANGED_4
+        // the shared text pages must not be found in the cache after
+        // we have dropped our references to them
+        textcache_release(text);
+        shm_release_all(current_process);
+        vm_unmap_all(pagetable);
+        #else
+        #error
+        #endif
+        vm_destroy_pagetable(pagetable);
     }
-    vm_destroy_pagetable(pagetable);
     thread_get_current_thread_entry()->pagetable = NULL;
     
     thread_finish();
@@ -382,39 +451,86 @@ int process_join(int process) {
     return result;
 }
 
+int schedstat_thread(int tid, void *stats) {
+#if CONFIG_SCHEDULER_TRACE
+    schedstat_t kernel_stats;
+    int n;
+
+    if (schedtrace_get_stats(tid, &kernel_stats) < 0)
+        return -1;
+
+    n = kernel_to_userland_memcpy(&kernel_stats, stats, sizeof(schedstat_t));
+    if (n != sizeof(schedstat_t)) {
+        syscall_exit_process(SYSCALL_INVALID_USERLAND_POINTER);
+    }
+    return 0;
+#else
+    tid = tid;
+    stats = stats;
+    return -1;
+#endif
+}
+
+int schedtrace_cpu_events(int cpu, void *events, int count) {
+#if CONFIG_SCHEDULER_TRACE
+    schedtrace_event_t kernel_events[SCHEDTRACE_KERNEL_BUFFER_EVENTS];
+    int n, size;
+
+    count = MIN(count, SCHEDTRACE_KERNEL_BUFFER_EVENTS);
+    count = schedtrace_get_events(cpu, kernel_events, count);
+    if (count <= 0)
+        return count;
+
+    size = count * sizeof(schedtrace_event_t);
+    n = kernel_to_userland_memcpy(kernel_events, events, size);
+    if (n != size) {
+        syscall_exit_process(SYSCALL_INVALID_USERLAND_POINTER);
+    }
+    return count;
+#else
+    cpu = cpu;
+    events = events;
+    count = count;
+    return -1;
+#endif
+}
+
 #endif
 
 #ifdef CHANGED_4
-void *memlimit(void *heap_end) 
+/* Moves the heap end of the address space. Called with the cow_lock
+   of the pagetable held. */
+static void *memlimit_locked(pagetable_t *pagetable, void *heap_end)
 {
-    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
-    if (!pagetable) 
-        return NULL;
-
     uint32_t new_limit = (uint32_t)heap_end;
     uint8_t error = 0;
     
     // just return the current memlimit
     if (heap_end == NULL)
         return (void*)pagetable->memlimit;
+
+    // the heap must stay below the shared memory segments
+    if (new_limit > SHM_REGION_BASE)
+        return NULL;
         
     if (new_limit > pagetable->memlimit) {
         DEBUG("memlimit", "Moving memlimit up...\n");
         uint32_t original_memlimit = pagetable->memlimit;
         while((pagetable->memlimit & PAGE_SIZE_MASK) < (new_limit & PAGE_SIZE_MASK)) {
-            if (pagetable->valid_count == PAGETABLE_ENTRIES) { // pagetable full
+            int new_page = vm_get_virtual_page();
+            if (new_page < 0) {
                 new_limit = original_memlimit;
                 error = 1;
                 goto lower;
             }
-            int new_page = vm_get_virtual_page();
-            if (new_page < 0) {
+            if (vm_map(pagetable, new_page, (pagetable->memlimit + PAGE_SIZE) & PAGE_SIZE_MASK, 0) < 0) {
+                // pagetable could not grow
+                vm_free_virtual_page(new_page);
                 new_limit = original_memlimit;
                 error = 1;
                 goto lower;
             }
             pagetable->memlimit += PAGE_SIZE;
-            vm_map(pagetable, new_page, pagetable->memlimit & PAGE_SIZE_MASK, 0);
             DEBUG("memlimit", " - mapped 0x%x -> virtual page %d\n", pagetable->memlimit & PAGE_SIZE_MASK, new_page);
         }
         // put it where the userland wanted it even if we actually allocate full pages
@@ -429,6 +545,9 @@ lower:
             vm_unmap(pagetable, pagetable->memlimit & PAGE_SIZE_MASK);
             pagetable->memlimit -= PAGE_SIZE;
         }
+        // a page still shared copy-on-write is not dropped from the
+        // TLBs when it is unmapped
+        tlb_flush_pagetable(pagetable);
         // put it where the userland wanted it even if we actually operate on pages
         pagetable->memlimit = new_limit;
         if (error)
@@ -440,6 +559,22 @@ lower:
     }
     return NULL;
 }
+
+void *memlimit(void *heap_end) 
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    void *result;
+
+    if (!pagetable) 
+        return NULL;
+
+    // the threads of a process share the pagetable
+    lock_acquire(pagetable->cow_lock);
+    result = memlimit_locked(pagetable, heap_end);
+    lock_release(pagetable->cow_lock);
+
+    return result;
+}
 #endif
 
 /**
@@ -508,11 +643,66 @@ void syscall_handle(context_t *user_context)
         case SYSCALL_DELETE:
             result = remove_file((char*)(user_context->cpu_regs[MIPS_REGISTER_A1]));
             break;
+        case SYSCALL_NICE:
+            result = thread_set_nice((int)user_context->cpu_regs[MIPS_REGISTER_A1]);
+            break;
+        case SYSCALL_AFFINITY:
+            result = thread_set_affinity((uint32_t)user_context->cpu_regs[MIPS_REGISTER_A1]);
+            break;
+        case SYSCALL_FUTEX_WAIT:
+            result = futex_wait((uint32_t*)(user_context->cpu_regs[MIPS_REGISTER_A1]),
+                        (uint32_t)user_context->cpu_regs[MIPS_REGISTER_A2]);
+            if (result == FUTEX_EFAULT)
+                syscall_exit_process(SYSCALL_INVALID_USERLAND_POINTER);
+            break;
+        case SYSCALL_FUTEX_WAKE:
+            result = futex_wake((uint32_t*)(user_context->cpu_regs[MIPS_REGISTER_A1]),
+                        (int)user_context->cpu_regs[MIPS_REGISTER_A2]);
+            if (result == FUTEX_EFAULT)
+                syscall_exit_process(SYSCALL_INVALID_USERLAND_POINTER);
+            break;
+        case SYSCALL_SCHEDSTAT:
+            result = schedstat_thread((int)user_context->cpu_regs[MIPS_REGISTER_A1],
+                        (void*)(user_context->cpu_regs[MIPS_REGISTER_A2]));
+            break;
+        case SYSCALL_SCHEDTRACE:
+            result = schedtrace_cpu_events((int)user_context->cpu_regs[MIPS_REGISTER_A1],
+                        (void*)(user_context->cpu_regs[MIPS_REGISTER_A2]),
+                        (int)(user_context->cpu_regs[MIPS_REGISTER_A3]));
+            break;
     #endif
     #ifdef CHANGED_4
         case SYSCALL_MEMLIMIT:
             result = (int)memlimit((void*)(user_context->cpu_regs[MIPS_REGISTER_A1]));
             break;
+        case SYSCALL_FORK:
+            result = process_fork(user_context->cpu_regs[MIPS_REGISTER_A1],
+                                  user_context->cpu_regs[MIPS_REGISTER_A2],
+                                  user_context->cpu_regs[MIPS_REGISTER_SP],
+                                  user_context->cpu_regs[MIPS_REGISTER_A3]);
+            break;
+        case SYSCALL_THREAD_CREATE:
+            result = process_thread_create(user_context->cpu_regs[MIPS_REGISTER_A1],
+                                           user_context->cpu_regs[MIPS_REGISTER_A2],
+                                           user_context->cpu_regs[MIPS_REGISTER_A3]);
+            break;
+        case SYSCALL_THREAD_JOIN:
+            result = process_thread_join((int)user_context->cpu_regs[MIPS_REGISTER_A1]);
+            break;
+        case SYSCALL_THREAD_EXIT:
+            syscall_exit_thread((int)user_context->cpu_regs[MIPS_REGISTER_A1]);
+            result = -1;
+            break;
+        case SYSCALL_SHM_CREATE:
+            result = shm_create((int)user_context->cpu_regs[MIPS_REGISTER_A1],
+                                (int)user_context->cpu_regs[MIPS_REGISTER_A2]);
+            break;
+        case SYSCALL_SHM_ATTACH:
+            result = shm_attach((int)user_context->cpu_regs[MIPS_REGISTER_A1]);
+            break;
+        case SYSCALL_SHM_DETACH:
+            result = shm_detach(user_context->cpu_regs[MIPS_REGISTER_A1]);
+            break;
     #endif
     default: 
         KERNEL_PANIC("Unhandled system call\n");
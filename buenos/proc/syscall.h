@@ -46,6 +46,18 @@
 #define SYSCALL_JOIN 0x103
 #define SYSCALL_FORK 0x104
 #define SYSCALL_MEMLIMIT 0x105
+#define SYSCALL_NICE 0x106
+#define SYSCALL_SCHEDSTAT 0x107
+#define SYSCALL_SCHEDTRACE 0x108
+#define SYSCALL_AFFINITY 0x109
+#define SYSCALL_FUTEX_WAIT 0x10A
+#define SYSCALL_FUTEX_WAKE 0x10B
+#define SYSCALL_THREAD_CREATE 0x10C
+#define SYSCALL_THREAD_JOIN 0x10D
+#define SYSCALL_THREAD_EXIT 0x10E
+#define SYSCALL_SHM_CREATE 0x10F
+#define SYSCALL_SHM_ATTACH 0x110
+#define SYSCALL_SHM_DETACH 0x111
 #define SYSCALL_OPEN 0x201
 #define SYSCALL_CLOSE 0x202
 #define SYSCALL_SEEK 0x203
@@ -64,6 +76,10 @@
 
 #ifdef CHANGED_2
 void syscall_exit_process(int retval);
+#ifdef CHANGED_4
+void syscall_exit_thread(int retval);
+void syscall_exit_if_dying(void);
+#endif
 
 #define SYSCALL_INVALID_USERLAND_POINTER 128
 #endif
@@ -0,0 +1,286 @@
+#ifdef CHANGED_4
+
+#include "proc/textcache.h"
+#include "kernel/config.h"
+#include "kernel/lock_cond.h"
+#include "kernel/assert.h"
+#include "drivers/yams.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+#include "lib/debug.h"
+
+/** @name Text page cache
+ *
+ * Processes running the same executable share the virtual pages of
+ * its read-only segment. The pages are mapped write-protected and
+ * reference counted, so they are freed when the last process using
+ * them unmaps them. A cache entry lives as long as some process runs
+ * the executable.
+ *
+ * Entries are keyed by the path and by the identity of the file, and
+ * the ELF header must match too. An entry keeps the file open, so that
+ * its identity stays the same on filesystems whose file ids are open
+ * file slots. The VFS calls textcache_invalidate() when a file is
+ * written or removed, because a file created again under the same
+ * name may get the same identity. An invalidated entry is not shared
+ * any more, but its processes keep their pages.
+ *
+ * @{
+ */
+
+/* Most read-only pages an entry can hold, the list takes one page */
+#define TEXTCACHE_MAX_PAGES (PAGE_SIZE / sizeof(int))
+
+typedef struct {
+    /* Number of processes using this entry, 0 if the entry is free */
+    int users;
+    /* The file has changed since the segment was loaded */
+    int stale;
+    char path[VFS_PATH_LENGTH];
+    /* The executable, open as long as the entry is used */
+    openfile_t file;
+    fs_t *filesystem;
+    int fileid;
+    uint32_t entry_point;
+    uint32_t ro_location;
+    uint32_t ro_size;
+    uint32_t ro_vaddr;
+    uint32_t ro_pages;
+    /* Virtual pages of the read-only segment, in a page of their own */
+    int *pages;
+} textcache_entry_t;
+
+static textcache_entry_t textcache[CONFIG_TEXTCACHE_ENTRIES];
+static lock_t *textcache_lock;
+
+void textcache_init(void)
+{
+    int i;
+
+    textcache_lock = lock_create();
+    for (i = 0; i < CONFIG_TEXTCACHE_ENTRIES; i++)
+        textcache[i].users = 0;
+}
+
+/* Only segments that share no page with the read-write segment can be
+   shared, those pages are written by the process. */
+static int textcache_shareable(elf_info_t *elf)
+{
+    uint32_t ro_end = elf->ro_vaddr + elf->ro_pages * PAGE_SIZE;
+    uint32_t rw_end = elf->rw_vaddr + elf->rw_pages * PAGE_SIZE;
+
+    if (elf->ro_pages == 0 || elf->ro_pages > TEXTCACHE_MAX_PAGES)
+        return 0;
+    return elf->rw_pages == 0 || elf->rw_vaddr >= ro_end
+        || rw_end <= elf->ro_vaddr;
+}
+
+static int textcache_matches(textcache_entry_t *entry, const char *executable,
+                             fs_t *filesystem, int fileid, elf_info_t *elf)
+{
+    return entry->users > 0
+        && !entry->stale
+        && entry->filesystem == filesystem
+        && entry->fileid == fileid
+        && entry->entry_point == elf->entry_point
+        && entry->ro_location == elf->ro_location
+        && entry->ro_size == elf->ro_size
+        && entry->ro_vaddr == elf->ro_vaddr
+        && entry->ro_pages == elf->ro_pages
+        && stringcmp(entry->path, executable) == 0;
+}
+
+/**
+ * Maps the cached read-only segment of the executable write-protected
+ * into the given pagetable, if some process is already running it.
+ *
+ * @return The cache entry, to be given to textcache_release() when
+ * the process exits, or -1 if the segment has to be loaded from the
+ * file.
+ */
+int textcache_map(const char *executable, openfile_t file, elf_info_t *elf,
+                  pagetable_t *pagetable)
+{
+    fs_t *filesystem;
+    int fileid;
+    int i;
+    uint32_t j;
+
+    if (!textcache_shareable(elf))
+        return -1;
+    if (vfs_getidentity(file, &filesystem, &fileid) != VFS_OK)
+        return -1;
+
+    lock_acquire(textcache_lock);
+
+    for (i = 0; i < CONFIG_TEXTCACHE_ENTRIES; i++) {
+        textcache_entry_t *entry = &textcache[i];
+        if (!textcache_matches(entry, executable, filesystem, fileid, elf))
+            continue;
+
+        for (j = 0; j < entry->ro_pages; j++) {
+            int status;
+            vm_ref_virtual_page(entry->pages[j]);
+            status = vm_map(pagetable, entry->pages[j],
+                            entry->ro_vaddr + j * PAGE_SIZE, 1);
+            KERNEL_ASSERT(status == 0);
+        }
+        entry->users++;
+        DEBUG("processdebug", "sharing %d text pages of %s\n",
+              entry->ro_pages, executable);
+
+        lock_release(textcache_lock);
+        return i;
+    }
+
+    lock_release(textcache_lock);
+    return -1;
+}
+
+/**
+ * Puts the read-only segment just loaded into the given pagetable to
+ * the cache, so that other processes running the same executable can
+ * share it.
+ *
+ * @return The cache entry, to be given to textcache_release() when
+ * the process exits, or -1 if the segment was not cached.
+ */
+int textcache_insert(const char *executable, openfile_t file, elf_info_t *elf,
+                     pagetable_t *pagetable)
+{
+    textcache_entry_t *entry = NULL;
+    openfile_t cached;
+    fs_t *filesystem;
+    int fileid;
+    uint32_t addr, j;
+    int i;
+
+    if (!textcache_shareable(elf))
+        return -1;
+    if (vfs_getidentity(file, &filesystem, &fileid) != VFS_OK)
+        return -1;
+
+    addr = pagepool_get_phys_page();
+    if (addr == 0)
+        return -1;
+    cached = vfs_open((char *)executable);
+    if (cached < 0) {
+        pagepool_free_phys_page(addr);
+        return -1;
+    }
+
+    lock_acquire(textcache_lock);
+
+    for (i = 0; i < CONFIG_TEXTCACHE_ENTRIES; i++) {
+        if (textcache[i].users == 0) {
+            entry = &textcache[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        lock_release(textcache_lock);
+        vfs_close(cached);
+        pagepool_free_phys_page(addr);
+        return -1;
+    }
+
+    entry->users = 1;
+    entry->stale = 0;
+    entry->file = cached;
+    stringcopy(entry->path, executable, VFS_PATH_LENGTH);
+    entry->filesystem = filesystem;
+    entry->fileid = fileid;
+    entry->entry_point = elf->entry_point;
+    entry->ro_location = elf->ro_location;
+    entry->ro_size = elf->ro_size;
+    entry->ro_vaddr = elf->ro_vaddr;
+    entry->ro_pages = elf->ro_pages;
+    entry->pages = (int *) ADDR_PHYS_TO_KERNEL(addr);
+    for (j = 0; j < entry->ro_pages; j++) {
+        entry->pages[j] = vm_lookup(pagetable, entry->ro_vaddr + j * PAGE_SIZE);
+        KERNEL_ASSERT(entry->pages[j] >= 0);
+    }
+
+    lock_release(textcache_lock);
+    return i;
+}
+
+/**
+ * Adds a user to a cache entry, for a forked process that shares the
+ * pages of its parent.
+ *
+ * @param entry Cache entry of the parent, nothing is done if it is
+ * negative.
+ */
+void textcache_ref(int entry)
+{
+    if (entry < 0)
+        return;
+    KERNEL_ASSERT(entry < CONFIG_TEXTCACHE_ENTRIES);
+
+    lock_acquire(textcache_lock);
+    KERNEL_ASSERT(textcache[entry].users > 0);
+    textcache[entry].users++;
+    lock_release(textcache_lock);
+}
+
+/**
+ * Drops a process from the users of a cache entry. The entry is freed
+ * with its last user. The pages themselves are freed when the process
+ * unmaps them, so this must be called before that.
+ *
+ * @param entry Cache entry from textcache_map() or textcache_insert(),
+ * nothing is done if it is negative.
+ */
+void textcache_release(int entry)
+{
+    openfile_t file = -1;
+
+    if (entry < 0)
+        return;
+    KERNEL_ASSERT(entry < CONFIG_TEXTCACHE_ENTRIES);
+
+    lock_acquire(textcache_lock);
+
+    KERNEL_ASSERT(textcache[entry].users > 0);
+    if (--textcache[entry].users == 0) {
+        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) textcache[entry].pages));
+        file = textcache[entry].file;
+    }
+
+    lock_release(textcache_lock);
+
+    /* the VFS calls textcache_invalidate() with its own locks held */
+    if (file >= 0)
+        vfs_close(file);
+}
+
+/**
+ * Stops sharing the cached segments of the given file with processes
+ * started from now on. Called by the VFS when the file is written to
+ * or removed.
+ *
+ * @param filesystem The filesystem of the file
+ *
+ * @param fileid The filesystem specific id of the file
+ */
+void textcache_invalidate(fs_t *filesystem, int fileid)
+{
+    int i;
+
+    lock_acquire(textcache_lock);
+
+    for (i = 0; i < CONFIG_TEXTCACHE_ENTRIES; i++) {
+        if (textcache[i].users > 0
+            && textcache[i].filesystem == filesystem
+            && textcache[i].fileid == fileid)
+            textcache[i].stale = 1;
+    }
+
+    lock_release(textcache_lock);
+}
+
+/** @} */
+
+#endif
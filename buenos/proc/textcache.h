@@ -0,0 +1,22 @@
+#ifdef CHANGED_4
+
+#ifndef BUENOS_PROC_TEXTCACHE_H
+#define BUENOS_PROC_TEXTCACHE_H
+
+#include "lib/types.h"
+#include "fs/vfs.h"
+#include "proc/elf.h"
+#include "vm/pagetable.h"
+
+void textcache_init(void);
+int textcache_map(const char *executable, openfile_t file, elf_info_t *elf,
+                  pagetable_t *pagetable);
+int textcache_insert(const char *executable, openfile_t file, elf_info_t *elf,
+                     pagetable_t *pagetable);
+void textcache_ref(int entry);
+void textcache_release(int entry);
+void textcache_invalidate(fs_t *filesystem, int fileid);
+
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#include "tests/lib.h"
+
+/* Forks a few children that each write their own value into the same
+ * global, stack and heap variables. Copy-on-write must keep every
+ * process seeing only its own writes.
+ */
+
+#define FORKTEST_CHILDREN 3
+
+static int global = 1;
+static int *heap;
+
+static void child(int n)
+{
+    int local = 1;
+
+    global = n;
+    *heap = n;
+    local = n;
+    if (global != n || *heap != n || local != n) {
+        prints("forktest: FAILED: child does not see its own writes\n");
+        syscall_exit(1);
+    }
+}
+
+int main(void)
+{
+    int pids[FORKTEST_CHILDREN];
+    int failed = 0;
+    int i;
+
+    heap = malloc(sizeof(int));
+    *heap = 1;
+
+    for (i = 0; i < FORKTEST_CHILDREN; i++) {
+        pids[i] = syscall_fork(child, i + 2);
+        if (pids[i] < 0) {
+            prints("forktest: FAILED: fork\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < FORKTEST_CHILDREN; i++) {
+        if (syscall_join(pids[i]) != 0)
+            failed = 1;
+    }
+    if (failed) {
+        prints("forktest: FAILED: a child failed\n");
+        return 1;
+    }
+
+    if (global != 1 || *heap != 1) {
+        prints("forktest: FAILED: parent sees the writes of a child\n");
+        return 1;
+    }
+    prints("forktest: ok\n");
+    return 0;
+}
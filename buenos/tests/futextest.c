@@ -0,0 +1,69 @@
+#include "tests/lib.h"
+
+/* Checks the futex syscalls and the mutex and condition variable of
+ * the userland library in a single thread: nothing may block, and
+ * waits on a changed word must return at once. A forked child then
+ * repeats the syscalls on the word while it is still shared
+ * copy-on-write with the parent.
+ */
+
+static mutex_t mutex;
+static cond_t cond;
+static volatile uint32_t word;
+
+static int check(int ok, const char *what)
+{
+    prints(ok ? "ok: " : "FAILED: ");
+    prints(what);
+    prints("\n");
+    return ok ? 0 : 1;
+}
+
+static void futex_child(int expected)
+{
+    int failed = 0;
+
+    failed += check(syscall_futex_wait(&word, expected) < 0,
+                    "wait on a copy-on-write word returns at once");
+    failed += check(syscall_futex_wake(&word, 1) == 0,
+                    "wake on the copied word wakes nobody");
+    word = 2;
+    syscall_exit(failed);
+}
+
+int main(void)
+{
+    int pid;
+    int failed = 0;
+
+    word = 1;
+    failed += check(syscall_futex_wait(&word, 0) < 0,
+                    "wait on a changed word returns at once");
+    failed += check(syscall_futex_wake(&word, 1) == 0,
+                    "wake without waiters wakes nobody");
+
+    mutex_init(&mutex);
+    mutex_lock(&mutex);
+    failed += check(mutex.state == 1, "uncontended lock");
+    failed += check(mutex_trylock(&mutex) < 0, "trylock of a locked mutex");
+    mutex_unlock(&mutex);
+    failed += check(mutex.state == 0, "unlock");
+    failed += check(mutex_trylock(&mutex) == 0, "trylock of a free mutex");
+    mutex_unlock(&mutex);
+
+    cond_init(&cond);
+    mutex_lock(&mutex);
+    cond_signal(&cond);
+    cond_broadcast(&cond);
+    mutex_unlock(&mutex);
+    failed += check(cond.waiters == 0, "signal without waiters");
+
+    pid = syscall_fork(futex_child, 0);
+    failed += check(pid >= 0, "fork");
+    if (pid >= 0) {
+        failed += check(syscall_join(pid) == 0, "futexes in a forked child");
+        failed += check(word == 1, "child wrote to its own copy");
+    }
+
+    return failed;
+}
@@ -94,14 +94,23 @@ int syscall_join(int pid)
 }
 
 
-/* Create a new thread running in the same address space as the
- * caller. The thread is started at function 'func', and the thread
- * will end when 'func' returns. 'arg' is passed as an argument to
- * 'func'. Returns 0 on success or a negative value on error.
+/* A forked process continues here when its function returns. */
+static void fork_return(void)
+{
+    syscall_exit(0);
+}
+
+/* Create a new process with a copy of the address space of the
+ * caller. The process is started at function 'func' on a copy of the
+ * caller's stack, and it exits when 'func' returns. 'arg' is passed
+ * as an argument to 'func'. Memory is copied on the first write, open
+ * files are not inherited. Returns the process id of the new process,
+ * which can be joined, or a negative value on error.
  */
 int syscall_fork(void (*func)(int), int arg)
 {
-    return (int)_syscall(SYSCALL_FORK, (uint32_t)func, (uint32_t)arg, 0);
+    return (int)_syscall(SYSCALL_FORK, (uint32_t)func, (uint32_t)arg,
+                         (uint32_t)fork_return);
 }
 
 
@@ -115,6 +124,148 @@ void *syscall_memlimit(void *heap_end)
 }
 
 
+/* Set the nice value of the calling thread to 'nice'. 0 is the
+ * default, larger values give the thread less CPU time when other
+ * threads want to run. Returns the new nice value, or a negative
+ * value if 'nice' was out of range.
+ */
+int syscall_nice(int nice)
+{
+    return (int)_syscall(SYSCALL_NICE, (uint32_t)nice, 0, 0);
+}
+
+
+/* Restrict the calling thread to the CPUs in 'mask', bit i standing
+ * for CPU i. The thread is moved at once if it is running on a CPU
+ * not in the mask. Returns 0 on success, or a negative value if the
+ * mask contains no existing CPU.
+ */
+int syscall_affinity(uint32_t mask)
+{
+    return (int)_syscall(SYSCALL_AFFINITY, mask, 0, 0);
+}
+
+
+/* Get the scheduler statistics of thread 'tid' into 'stats'. Thread
+ * 0 is the idle thread, its run time is the idle time of all CPUs.
+ * Returns 0 on success, or a negative value if there is no such
+ * thread or scheduler tracing is not compiled into the kernel.
+ */
+int syscall_schedstat(int tid, schedstat_t *stats)
+{
+    return (int)_syscall(SYSCALL_SCHEDSTAT, (uint32_t)tid,
+                         (uint32_t)stats, 0);
+}
+
+
+/* Copy at most 'count' of the latest scheduler events of CPU 'cpu'
+ * to 'events', oldest first. The kernel returns at most 32 events
+ * per call. Returns the number of events copied, or a negative value
+ * on error.
+ */
+int syscall_schedtrace(int cpu, schedtrace_event_t *events, int count)
+{
+    return (int)_syscall(SYSCALL_SCHEDTRACE, (uint32_t)cpu,
+                         (uint32_t)events, (uint32_t)count);
+}
+
+
+/* Sleep on the word at 'addr' if it still contains 'expected'. The
+ * caller must check its condition again after returning, because
+ * the wait may also end without a wake. Returns 0 when woken, or a
+ * negative value if the word did not contain 'expected'.
+ */
+int syscall_futex_wait(volatile uint32_t *addr, uint32_t expected)
+{
+    return (int)_syscall(SYSCALL_FUTEX_WAIT, (uint32_t)addr, expected, 0);
+}
+
+
+/* Wake at most 'count' threads sleeping on the word at 'addr'.
+ * Returns the number of threads woken.
+ */
+int syscall_futex_wake(volatile uint32_t *addr, int count)
+{
+    return (int)_syscall(SYSCALL_FUTEX_WAKE, (uint32_t)addr,
+                         (uint32_t)count, 0);
+}
+
+
+/* A thread continues here when its function returns. */
+static void thread_return(void)
+{
+    syscall_thread_exit(0);
+}
+
+/* Create a new thread in the calling process. The thread shares the
+ * memory and files of the process and runs on a stack of its own.
+ * It is started at function 'func' with 'arg' as the argument, and
+ * it exits when 'func' returns. Returns the id of the thread within
+ * the process, or a negative value on error.
+ */
+int syscall_thread_create(void (*func)(int), int arg)
+{
+    return (int)_syscall(SYSCALL_THREAD_CREATE, (uint32_t)func,
+                         (uint32_t)arg, (uint32_t)thread_return);
+}
+
+
+/* Wait until the thread 'thread' of this process has exited. Returns
+ * the value the thread passed to syscall_thread_exit, or a negative
+ * value if there was no such thread.
+ */
+int syscall_thread_join(int thread)
+{
+    return (int)_syscall(SYSCALL_THREAD_JOIN, (uint32_t)thread, 0, 0);
+}
+
+
+/* End the calling thread with 'retval' given to its joiner. The
+ * process ends when its last thread exits this way, or at once when
+ * any thread calls syscall_exit, which also ends the other threads.
+ * Returning from main calls syscall_exit, so main should join its
+ * threads before returning.
+ */
+void syscall_thread_exit(int retval)
+{
+    _syscall(SYSCALL_THREAD_EXIT, (uint32_t)retval, 0, 0);
+}
+
+
+/* Create a shared memory segment of 'size' bytes identified by 'key'
+ * and attach to it. The segment is zero filled and is mapped at the
+ * same address in every process attached to it. Forked processes
+ * stay attached. Returns the address of the segment, or NULL on
+ * error, also if a segment with the key exists already.
+ */
+void *syscall_shm_create(int key, int size)
+{
+    int addr = (int)_syscall(SYSCALL_SHM_CREATE, (uint32_t)key,
+                             (uint32_t)size, 0);
+    return addr < 0 ? 0 : (void *)addr;
+}
+
+
+/* Attach to the shared memory segment identified by 'key'. Returns
+ * the address of the segment, or NULL on error.
+ */
+void *syscall_shm_attach(int key)
+{
+    int addr = (int)_syscall(SYSCALL_SHM_ATTACH, (uint32_t)key, 0, 0);
+    return addr < 0 ? 0 : (void *)addr;
+}
+
+
+/* Detach from the shared memory segment at 'addr'. The segment is
+ * freed when the last process detaches or exits. Returns 0 on
+ * success or a negative value on error.
+ */
+int syscall_shm_detach(void *addr)
+{
+    return (int)_syscall(SYSCALL_SHM_DETACH, (uint32_t)addr, 0, 0);
+}
+
+
 /* Open the file identified by 'filename' for reading and
  * writing. Returns the file handle of the opened file (positive
  * value), or a negative value on error.
@@ -361,3 +512,96 @@ void free(void *ptr) {
     }
     
 }
+
+
+/* Mutexes and condition variables. Both work on plain memory with
+ * atomic operations and call the kernel only when a thread has to
+ * wait or there is a waiter to wake.
+ *
+ * The mutex state is 0 when unlocked, 1 when locked and 2 when
+ * locked and some thread may be waiting for it.
+ */
+
+static uint32_t atomic_swap(volatile uint32_t *addr, uint32_t value)
+{
+    uint32_t old;
+
+    do {
+        old = *addr;
+    } while (_atomic_cas(addr, old, value) != old);
+    return old;
+}
+
+void mutex_init(mutex_t *mutex)
+{
+    mutex->state = 0;
+}
+
+int mutex_trylock(mutex_t *mutex)
+{
+    return _atomic_cas(&mutex->state, 0, 1) == 0 ? 0 : -1;
+}
+
+void mutex_lock(mutex_t *mutex)
+{
+    uint32_t state;
+
+    state = _atomic_cas(&mutex->state, 0, 1);
+    if (state == 0)
+        return;
+
+    /* Contended. Mark that there are waiters, so the unlocker will
+       wake us, and sleep until we get the mutex. */
+    if (state != 2)
+        state = atomic_swap(&mutex->state, 2);
+    while (state != 0) {
+        syscall_futex_wait(&mutex->state, 2);
+        state = atomic_swap(&mutex->state, 2);
+    }
+}
+
+void mutex_unlock(mutex_t *mutex)
+{
+    if (atomic_swap(&mutex->state, 0) == 2)
+        syscall_futex_wake(&mutex->state, 1);
+}
+
+void cond_init(cond_t *cond)
+{
+    cond->seq = 0;
+    cond->waiters = 0;
+}
+
+/* The mutex must be held. */
+void cond_wait(cond_t *cond, mutex_t *mutex)
+{
+    uint32_t seq = cond->seq;
+
+    cond->waiters++;
+    mutex_unlock(mutex);
+
+    /* A signal after the unlock changes seq and the wait returns at
+       once, so it cannot be lost. */
+    syscall_futex_wait(&cond->seq, seq);
+
+    /* Others may still sleep on the mutex, keep it marked contended */
+    while (atomic_swap(&mutex->state, 2) != 0)
+        syscall_futex_wait(&mutex->state, 2);
+    cond->waiters--;
+}
+
+/* The signaling and broadcasting thread should hold the mutex,
+   otherwise a thread just going to wait may be missed. */
+void cond_signal(cond_t *cond)
+{
+    cond->seq++;
+    if (cond->waiters > 0)
+        syscall_futex_wake(&cond->seq, 1);
+}
+
+void cond_broadcast(cond_t *cond)
+{
+    cond->seq++;
+    if (cond->waiters > 0)
+        syscall_futex_wake(&cond->seq, cond->waiters);
+}
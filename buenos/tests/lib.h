@@ -44,9 +44,46 @@
 #define stdout 1
 #define stderr 2
 
+/* Scheduler statistics of one thread, see kernel/schedtrace.h.
+ * Times are in CPU cycles. */
+typedef struct {
+    uint32_t run_ticks;
+    uint32_t wait_ticks;
+    uint32_t voluntary_switches;
+    uint32_t involuntary_switches;
+} schedstat_t;
+
+/* Scheduler trace event types and the event itself */
+#define SCHEDTRACE_EVENT_SWITCH_IN  1
+#define SCHEDTRACE_EVENT_SWITCH_OUT 2
+#define SCHEDTRACE_EVENT_WAKEUP     3
+#define SCHEDTRACE_EVENT_SLEEP      4
+
+typedef struct {
+    uint32_t time;
+    int16_t thread;
+    uint8_t type;
+    uint8_t cpu;
+} schedtrace_event_t;
+
+/* A mutex and a condition variable, see lib.c. Initialize them with
+ * mutex_init and cond_init before use. */
+typedef struct {
+    volatile uint32_t state;
+} mutex_t;
+
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t waiters;
+} cond_t;
+
 /* Makes the syscall 'syscall_num' with the arguments 'a1', 'a2' and 'a3'. */
 uint32_t _syscall(uint32_t syscall_num, uint32_t a1, uint32_t a2, uint32_t a3);
 
+/* Atomically replaces *addr with 'new' if it contains 'old'. Returns
+ * the previous value of *addr. */
+uint32_t _atomic_cas(volatile uint32_t *addr, uint32_t old, uint32_t new);
+
 /* The library functions which are just wrappers to the _syscall function. */
 
 void syscall_halt(void);
@@ -66,6 +103,27 @@ int syscall_delete(const char *filename);
 
 int syscall_fork(void (*func)(int), int arg);
 void *syscall_memlimit(void *heap_end);
+int syscall_nice(int nice);
+int syscall_affinity(uint32_t mask);
+int syscall_schedstat(int tid, schedstat_t *stats);
+int syscall_schedtrace(int cpu, schedtrace_event_t *events, int count);
+int syscall_futex_wait(volatile uint32_t *addr, uint32_t expected);
+int syscall_futex_wake(volatile uint32_t *addr, int count);
+int syscall_thread_create(void (*func)(int), int arg);
+int syscall_thread_join(int thread);
+void syscall_thread_exit(int retval);
+void *syscall_shm_create(int key, int size);
+void *syscall_shm_attach(int key);
+int syscall_shm_detach(void *addr);
+
+void mutex_init(mutex_t *mutex);
+int mutex_trylock(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+void cond_init(cond_t *cond);
+void cond_wait(cond_t *cond, mutex_t *mutex);
+void cond_signal(cond_t *cond);
+void cond_broadcast(cond_t *cond);
 
 void prints(const char *str);
 int strlen(const char *str);
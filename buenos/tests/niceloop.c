@@ -0,0 +1,24 @@
+#include "tests/lib.h"
+
+/* Loops forever like loop.c, but first sets its nice value to the
+ * one given as the first argument (default 1). Start a few of these
+ * in the background and the shell should still respond quickly. */
+int main(int argc, char **argv)
+{
+    int nice = 1;
+    int i = 0;
+
+    if (argc > 1)
+        nice = atoi(argv[1]);
+
+    if (syscall_nice(nice) < 0) {
+        prints("niceloop: invalid nice value\n");
+        return 1;
+    }
+
+    while (1) {
+      i++;
+    }
+
+    return 0;
+}
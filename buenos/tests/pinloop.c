@@ -0,0 +1,25 @@
+#include "tests/lib.h"
+
+/* Loops forever like loop.c, but first restricts itself to the CPUs
+ * in the affinity mask given as the first argument (default 1, only
+ * CPU 0). Start a few of these with different masks and check with
+ * top which CPUs stay idle. */
+int main(int argc, char **argv)
+{
+    int mask = 1;
+    int i = 0;
+
+    if (argc > 1)
+        mask = atoi(argv[1]);
+
+    if (syscall_affinity((uint32_t)mask) < 0) {
+        prints("pinloop: no such CPUs\n");
+        return 1;
+    }
+
+    while (1) {
+      i++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "tests/lib.h"
+
+/* Checks that a shared memory segment is really shared: a forked
+ * child sees the writes of its parent and the other way round, also
+ * after detaching and attaching again by key.
+ */
+
+#define SHMTEST_KEY 42
+#define SHMTEST_SIZE 8192
+
+static volatile int *shared;
+
+static void child(int n)
+{
+    volatile int *again;
+
+    if (shared[0] != 1)
+        prints("shmtest: FAILED: child does not see the parent's write\n");
+    shared[1] = n;
+
+    if (syscall_shm_detach((void *)shared) < 0) {
+        prints("shmtest: FAILED: detach\n");
+        return;
+    }
+    again = syscall_shm_attach(SHMTEST_KEY);
+    if (again == 0) {
+        prints("shmtest: FAILED: attach\n");
+        return;
+    }
+    again[SHMTEST_SIZE / sizeof(int) - 1] = n;
+}
+
+int main(void)
+{
+    int pid;
+
+    shared = syscall_shm_create(SHMTEST_KEY, SHMTEST_SIZE);
+    if (shared == 0) {
+        prints("shmtest: FAILED: create\n");
+        return 1;
+    }
+    if (syscall_shm_create(SHMTEST_KEY, SHMTEST_SIZE) != 0) {
+        prints("shmtest: FAILED: created the same key twice\n");
+        return 1;
+    }
+
+    shared[0] = 1;
+    pid = syscall_fork(child, 7);
+    if (pid < 0) {
+        prints("shmtest: FAILED: fork\n");
+        return 1;
+    }
+    syscall_join(pid);
+
+    if (shared[1] != 7 || shared[SHMTEST_SIZE / sizeof(int) - 1] != 7) {
+        prints("shmtest: FAILED: parent does not see the child's writes\n");
+        return 1;
+    }
+
+    syscall_shm_detach((void *)shared);
+    prints("shmtest: ok\n");
+    return 0;
+}
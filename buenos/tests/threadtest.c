@@ -0,0 +1,59 @@
+#include "tests/lib.h"
+
+/* Runs a few threads in one process that add to a shared counter
+ * under a mutex, and checks that the total is right and that every
+ * thread gets its own stack and return value.
+ */
+
+#define THREADTEST_THREADS 4
+#define THREADTEST_ROUNDS 1000
+
+static mutex_t mutex;
+static volatile int counter;
+static volatile int *stack_seen[THREADTEST_THREADS];
+
+static void worker(int n)
+{
+    int local = n;
+    int i;
+
+    stack_seen[n] = &local;
+    for (i = 0; i < THREADTEST_ROUNDS; i++) {
+        mutex_lock(&mutex);
+        counter++;
+        mutex_unlock(&mutex);
+    }
+    syscall_thread_exit(local + 100);
+}
+
+int main(void)
+{
+    int threads[THREADTEST_THREADS];
+    int failed = 0;
+    int i, j;
+
+    mutex_init(&mutex);
+
+    for (i = 0; i < THREADTEST_THREADS; i++) {
+        threads[i] = syscall_thread_create(worker, i);
+        if (threads[i] < 0) {
+            prints("threadtest: FAILED: thread create\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < THREADTEST_THREADS; i++) {
+        if (syscall_thread_join(threads[i]) != i + 100)
+            failed = 1;
+    }
+
+    for (i = 0; i < THREADTEST_THREADS; i++)
+        for (j = 0; j < i; j++)
+            if (stack_seen[i] == stack_seen[j])
+                failed = 1;
+
+    if (counter != THREADTEST_THREADS * THREADTEST_ROUNDS)
+        failed = 1;
+
+    prints(failed ? "threadtest: FAILED\n" : "threadtest: ok\n");
+    return failed;
+}
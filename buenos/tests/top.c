@@ -0,0 +1,123 @@
+#include "tests/lib.h"
+
+/* Shows where the CPU time goes, like top. Prints the scheduler
+ * statistics of every thread a few times, the run time as percent of
+ * the time elapsed between two rounds, and finally the latest
+ * scheduler events of CPU 0.
+ *
+ * Usage: top [rounds] [events]
+ */
+
+#define TOP_MAX_THREADS 256
+#define TOP_DELAY 200000
+
+static schedstat_t previous[TOP_MAX_THREADS];
+static schedstat_t current[TOP_MAX_THREADS];
+static char valid[TOP_MAX_THREADS];
+
+static void print_column(uint32_t num, int width)
+{
+    char buf[12];
+    int len;
+
+    itoa((int)num, buf);
+    for (len = strlen(buf); len < width; len++)
+        prints(" ");
+    prints(buf);
+}
+
+static void delay(void)
+{
+    volatile int i;
+    for (i = 0; i < TOP_DELAY; i++);
+}
+
+/* Run time of a thread since the previous round */
+static uint32_t run_delta(int tid)
+{
+    if (valid[tid] != 2)
+        return 0;
+    return current[tid].run_ticks - previous[tid].run_ticks;
+}
+
+static void print_round(void)
+{
+    uint32_t total = 0;
+    int tid;
+
+    /* valid is 2 for threads seen also on the previous round */
+    for (tid = 0; tid < TOP_MAX_THREADS; tid++) {
+        if (syscall_schedstat(tid, &current[tid]) < 0) {
+            valid[tid] = 0;
+            continue;
+        }
+        valid[tid] = valid[tid] ? 2 : 1;
+        total += run_delta(tid);
+    }
+
+    prints("  TID  CPU%     RUN    WAIT   VOL INVOL\n");
+    for (tid = 0; tid < TOP_MAX_THREADS; tid++) {
+        if (!valid[tid])
+            continue;
+
+        print_column(tid, 5);
+        print_column(total ? run_delta(tid) / (total / 100 + 1) : 0, 6);
+        print_column(current[tid].run_ticks / 1000, 8);
+        print_column(current[tid].wait_ticks / 1000, 8);
+        print_column(current[tid].voluntary_switches, 6);
+        print_column(current[tid].involuntary_switches, 6);
+        prints("\n");
+
+        previous[tid] = current[tid];
+    }
+    prints("(tid 0 is idle, times in kilocycles)\n\n");
+}
+
+static void print_events(int count)
+{
+    static const char *names[] = { "?", "in", "out", "wakeup", "sleep" };
+    schedtrace_event_t events[32];
+    int i, n;
+
+    n = syscall_schedtrace(0, events, MIN(count, 32));
+    if (n < 0) {
+        prints("top: scheduler tracing is not available\n");
+        return;
+    }
+
+    prints("      TIME  TID EVENT\n");
+    for (i = 0; i < n; i++) {
+        print_column(events[i].time, 10);
+        print_column(events[i].thread, 5);
+        prints(" ");
+        prints(events[i].type <= SCHEDTRACE_EVENT_SLEEP ?
+               names[events[i].type] : names[0]);
+        prints("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 5;
+    int events = 16;
+    int i;
+
+    if (argc > 1)
+        rounds = atoi(argv[1]);
+    if (argc > 2)
+        events = atoi(argv[2]);
+
+    if (syscall_schedstat(0, &current[0]) < 0) {
+        prints("top: scheduler tracing is not available\n");
+        return 1;
+    }
+
+    for (i = 0; i < rounds; i++) {
+        delay();
+        print_round();
+    }
+
+    print_events(events);
+
+    return 0;
+}
@@ -39,35 +39,63 @@
 
 #include "lib/libc.h"
 #include "vm/tlb.h"
+#ifdef CHANGED_4
+#include "kernel/config.h"
+#include "kernel/lock_cond.h"
+#endif
 
 #ifdef CHANGED_4
 
-// contains virtual address to virtual pool mappings for two pages
+// contains virtual address to virtual pool mappings for two pages.
+// the virtual page pair number (VPN2) is given by the position of the
+// entry in the pagetable
 typedef struct pagetable_entry_struct_t {
-    // the virtual page pair number, length 19 bits
-    uint32_t VPN;  
-
     // virtual page number for the even VPN + 0 page. negative if empty
-    int16_t even_page;
+    signed int even_page:30;
     // is write-protected for even page
-    uint8_t even_write_protect;
+    unsigned int even_write_protect:1;
+    // is the even page shared copy-on-write after a fork
+    unsigned int even_cow:1;
 
     // virtual page number for the even VPN + 1 page. negative if empty
-    int16_t odd_page;
+    signed int odd_page:30;
     // is write-protected for odd page
-    uint8_t odd_write_protect;
+    unsigned int odd_write_protect:1;
+    // is the odd page shared copy-on-write after a fork
+    unsigned int odd_cow:1;
 } pagetable_entry_t;
 
-#define PAGETABLE_ENTRIES 340
+// the pagetable is a two level radix tree indexed by VPN2. the upper
+// bits of VPN2 select a leaf from the directory and the lower bits an
+// entry in the leaf. leaves take one page each and are allocated when
+// something is first mapped in their range.
+#define PAGETABLE_LEAF_ENTRIES 512
+// the directory covers the user segment (addresses below 2GB)
+#define PAGETABLE_DIR_ENTRIES 512
+
+#define PAGETABLE_DIR_INDEX(vpn2)  ((vpn2) / PAGETABLE_LEAF_ENTRIES)
+#define PAGETABLE_LEAF_INDEX(vpn2) ((vpn2) % PAGETABLE_LEAF_ENTRIES)
+
 typedef struct pagetable_struct_t {
-    /* Address space identifier. We use Thread Ids in Buenos. */
-    uint32_t ASID;
-    /* Number of valid consecutive mappings in this pagetable. */
+    /* Address space identifier on each CPU, with the generation of
+       the CPU's ASID allocator in the upper bits. 0 if none. See
+       tlb_activate(). */
+    uint32_t asid[CONFIG_MAX_CPUS];
+    /* Number of virtual pages mapped in this pagetable. */
     uint32_t valid_count;
-    /* Actual virtual memory mapping entries*/
-    pagetable_entry_t entries[PAGETABLE_ENTRIES];
     /* memlimit associated with the process */
     uint32_t memlimit;
+    /* Sequential fault detection for read-ahead: the page where the
+       next fault is expected, the end of the pages already read ahead
+       and the current number of pages to read ahead. */
+    uint32_t readahead_next;
+    uint32_t readahead_end;
+    uint32_t readahead_window;
+    /* Serializes copy-on-write faults, forks and heap size changes
+       of this address space, which all change the mapped pages. */
+    lock_t *cow_lock;
+    /* Leaves of the radix tree, NULL where nothing is mapped */
+    pagetable_entry_t *leaves[PAGETABLE_DIR_ENTRIES];
 } pagetable_t;
 
 #else
@@ -44,38 +44,75 @@
 #include "kernel/thread.h"
 #include "vm/vm.h"
 #include "kernel/interrupt.h"
+#include "kernel/config.h"
+#include "kernel/spinlock.h"
+#include "drivers/yams.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
 
 extern virtual_page_t *virtual_pool;
 extern phys_page_t *phys_pool;
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+extern TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
+
+// ASID allocation. Each CPU hands out the 8-bit ASIDs in order and
+// keeps a generation count in the upper bits of asid_cache. An address
+// space keeps its ASID on a CPU while the generation of that CPU stays
+// the same, so the ASID of a dead address space is not reused before
+// the next generation and its stale TLB entries never match. When the
+// ASIDs run out, the TLB of the CPU is flushed and a new generation
+// starts. ASID 0 is reserved for kernel threads.
+#define TLB_ASID_MASK 0xff
+
+static uint32_t asid_cache[CONFIG_MAX_CPUS];
+
+// invalidate every entry of the TLB of this CPU
+static void tlb_flush_all(void)
+{
+    tlb_entry_t tlb_entries[TLB_SIZE];
+
+    DEBUG("tlbdebug", "TLB: ASID generation rollover, flushing\n");
+    memoryset(tlb_entries, 0, sizeof(tlb_entries));
+    _tlb_write(tlb_entries, 0, TLB_SIZE);
+}
 
-// remove TLB entries with the given ASID
-void tlb_clean_by_asid(uint32_t asid)
+/**
+ * Loads the ASID of the given address space on this CPU into CP0,
+ * first giving the address space a new ASID if it has none from the
+ * current generation. Interrupts must be disabled.
+ *
+ * @param pagetable The address space, NULL for a kernel thread.
+ *
+ * @return The ASID to use in TLB entries of the address space.
+ */
+uint32_t tlb_activate(pagetable_t *pagetable)
 {
-    interrupt_status_t intr_status;
-    intr_status = _interrupt_disable();
+    int cpu = _interrupt_getcpu();
+    uint32_t asid;
 
-    DEBUG("tlbdebug", "TLB: cleaning tlb by asid %d\n", asid);
-    tlb_entry_t tlb_entries[TLB_SIZE];
-    
-    _tlb_read(tlb_entries, 0, TLB_SIZE);
+    if (pagetable == NULL) {
+        _tlb_set_asid(0);
+        return 0;
+    }
 
-    uint32_t i;
-    for (i = 0; i < TLB_SIZE; i++) {
-        if (tlb_entries[i].ASID == asid) {
-            memoryset(&tlb_entries[i], 0, sizeof(tlb_entry_t));
-            _tlb_write(&tlb_entries[i], i, 1);
+    asid = pagetable->asid[cpu];
+    if (asid == 0 || (asid & ~TLB_ASID_MASK) != (asid_cache[cpu] & ~TLB_ASID_MASK)) {
+        asid = ++asid_cache[cpu];
+        if ((asid & TLB_ASID_MASK) == 0) {
+            tlb_flush_all();
+            asid = ++asid_cache[cpu];
         }
+        pagetable->asid[cpu] = asid;
     }
 
-    _interrupt_set_state(intr_status);
+    _tlb_set_asid(asid & TLB_ASID_MASK);
+    return asid & TLB_ASID_MASK;
 }
 
-// remove the TLB entry with the given physical address
-void tlb_clean_by_phys_addr(uint32_t phys_addr)
+// remove the entries with the given physical address from the TLB of
+// this CPU. interrupts must be disabled
+static void tlb_clean_local(uint32_t phys_addr)
 {
-    interrupt_status_t intr_status;
-    intr_status = _interrupt_disable();
-
     DEBUG("tlbdebug", "TLB: cleaning tlb by phys addr 0x%x\n", phys_addr);
     tlb_entry_t tlb_entries[TLB_SIZE];
     
@@ -102,10 +139,164 @@ void tlb_clean_by_phys_addr(uint32_t phys_addr)
         }
     }
 
-    // just a sanity check; tlb should never contain 
-    // two mappings to the same physical page
-    KERNEL_ASSERT(removed_count <= 1);
+    // a shared page may be mapped by several address spaces
+    DEBUG("tlbdebug", "TLB: removed %d mappings\n", removed_count);
+}
+
+// TLB shootdown. A CPU changing mappings which other CPUs may have in
+// their TLBs posts a request in its own slot, sets its bit in the
+// pending mask of each target CPU and interrupts the targets. It then
+// spins with interrupts disabled until all the targets have carried
+// out the request and cleared the bit. Requests posted to the waiting
+// CPU are served while it spins, so two CPUs shooting down at the same
+// time do not wait for each other forever.
+typedef struct {
+    // address space to re-activate on the CPUs running it, or NULL
+    pagetable_t *pagetable;
+    // physical page to drop from the TLB if pagetable is NULL
+    uint32_t phys_addr;
+} tlb_shootdown_t;
+
+static tlb_shootdown_t tlb_shootdown_requests[CONFIG_MAX_CPUS];
+static volatile uint32_t tlb_shootdown_pending[CONFIG_MAX_CPUS];
+static spinlock_t tlb_shootdown_slock[CONFIG_MAX_CPUS];
+static device_t *tlb_cpu_devices[CONFIG_MAX_CPUS];
+static int tlb_num_cpus;
+
+/**
+ * Finds the CPU status devices used to interrupt the other CPUs for
+ * TLB shootdowns. Called once at boot, after the device drivers have
+ * been initialized.
+ */
+void tlb_init(void)
+{
+    int i;
+
+    tlb_num_cpus = cpustatus_count();
+    for (i = 0; i < tlb_num_cpus; i++) {
+        spinlock_reset(&tlb_shootdown_slock[i]);
+        tlb_shootdown_pending[i] = 0;
+        tlb_cpu_devices[i] = device_get(YAMS_TYPECODE_CPUSTATUS + i, 0);
+    }
+}
+
+/**
+ * Carries out the TLB shootdown requests posted to this CPU. Called
+ * from the CPU status interrupt handler and by CPUs waiting for their
+ * own shootdown. Interrupts must be disabled.
+ */
+void tlb_shootdown_handle(void)
+{
+    int cpu = _interrupt_getcpu();
+    uint32_t pending;
+    int i;
+
+    spinlock_acquire(&tlb_shootdown_slock[cpu]);
+    pending = tlb_shootdown_pending[cpu];
+    spinlock_release(&tlb_shootdown_slock[cpu]);
+    if (pending == 0)
+        return;
+
+    for (i = 0; i < tlb_num_cpus; i++) {
+        tlb_shootdown_t *request = &tlb_shootdown_requests[i];
+
+        if (!(pending & (1 << i)))
+            continue;
+        // an address space which had its ASIDs dropped gets a fresh
+        // one on this CPU
+        if (request->pagetable == NULL)
+            tlb_clean_local(request->phys_addr);
+        else if (thread_get_current_thread_entry()->pagetable == request->pagetable)
+            tlb_activate(request->pagetable);
+    }
+
+    spinlock_acquire(&tlb_shootdown_slock[cpu]);
+    tlb_shootdown_pending[cpu] &= ~pending;
+    spinlock_release(&tlb_shootdown_slock[cpu]);
+}
+
+// posts the request in the slot of this CPU to the CPUs in the targets
+// mask and waits until they have all carried it out. interrupts must
+// be disabled
+static void tlb_shootdown(uint32_t targets)
+{
+    int cpu = _interrupt_getcpu();
+    uint32_t waiting;
+    int i;
+
+    for (i = 0; i < tlb_num_cpus; i++) {
+        if (!(targets & (1 << i)))
+            continue;
+        spinlock_acquire(&tlb_shootdown_slock[i]);
+        tlb_shootdown_pending[i] |= 1 << cpu;
+        spinlock_release(&tlb_shootdown_slock[i]);
+        cpustatus_generate_irq(tlb_cpu_devices[i]);
+    }
+
+    do {
+        tlb_shootdown_handle();
+        waiting = 0;
+        for (i = 0; i < tlb_num_cpus; i++) {
+            if ((targets & (1 << i)) && (tlb_shootdown_pending[i] & (1 << cpu)))
+                waiting = 1;
+        }
+    } while (waiting);
+}
 
+// drops every TLB entry of the address space by making it take a new
+// ASID on each CPU the next time it runs there. the other CPUs running
+// it right now are interrupted to take the new ASID before this returns
+void tlb_flush_pagetable(pagetable_t *pagetable)
+{
+    interrupt_status_t intr_status;
+    int cpu;
+    uint32_t targets = 0;
+    int i;
+
+    intr_status = _interrupt_disable();
+    cpu = _interrupt_getcpu();
+    for (i = 0; i < CONFIG_MAX_CPUS; i++)
+        pagetable->asid[i] = 0;
+    if (thread_get_current_thread_entry()->pagetable == pagetable)
+        tlb_activate(pagetable);
+
+    // a CPU switching to the address space after the ASIDs were
+    // dropped takes a new one by itself
+    for (i = 0; i < tlb_num_cpus; i++) {
+        if (i != cpu && tlb_cpu_devices[i] != NULL
+            && thread_table[scheduler_current_thread[i]].pagetable == pagetable)
+            targets |= 1 << i;
+    }
+    if (targets != 0) {
+        tlb_shootdown_requests[cpu].pagetable = pagetable;
+        tlb_shootdown_requests[cpu].phys_addr = 0;
+        tlb_shootdown(targets);
+    }
+    _interrupt_set_state(intr_status);
+}
+
+// remove the TLB entries with the given physical address on every CPU,
+// so that none of them can use the page after this returns
+void tlb_clean_by_phys_addr(uint32_t phys_addr)
+{
+    interrupt_status_t intr_status;
+    int cpu;
+    uint32_t targets = 0;
+    int i;
+
+    intr_status = _interrupt_disable();
+    cpu = _interrupt_getcpu();
+    tlb_clean_local(phys_addr);
+
+    for (i = 0; i < tlb_num_cpus; i++) {
+        if (i != cpu && tlb_cpu_devices[i] != NULL)
+            targets |= 1 << i;
+    }
+    if (targets != 0) {
+        tlb_shootdown_requests[cpu].pagetable = NULL;
+        tlb_shootdown_requests[cpu].phys_addr = phys_addr;
+        tlb_shootdown(targets);
+    }
     _interrupt_set_state(intr_status);
 }
 
@@ -118,31 +309,43 @@ static void print_tlb_debug(tlb_exception_state_t *tes, char* name)
            name, tes->badvaddr, tes->badvpn2, tes->asid);
 }
 
-// this writes the pagetable entry into the tlb. 
+// this writes the pagetable entry of the page pair containing vaddr
+// into the tlb. 
 // it assumes that atleast one of the pages resides in physical memory
+// the other page of the pair is mapped too if it is in memory (fault
+// around), which counts as a reference to it
 // if _tlb_probe finds a corresponding entry, it gets updated
 // if not, it does write_random
 // returns 1 if a previous entry was updated, 0 if new one was created
-int upsert_into_tlb(pagetable_entry_t *entry, uint32_t ASID) {
+int upsert_into_tlb(pagetable_entry_t *entry, uint32_t vaddr, uint32_t ASID) {
     tlb_entry_t tlb_entry;
     memoryset(&tlb_entry, 0, sizeof(tlb_entry_t));
     tlb_entry.ASID = ASID;
-    tlb_entry.VPN2 = entry->VPN;
+    tlb_entry.VPN2 = vaddr >> 13;
     
     int tlb_loc = _tlb_probe(&tlb_entry);
 
     // construct the new tlb entry by checking if the virtual pages lie in memory
     if (entry->even_page >= 0 && virtual_pool[entry->even_page].phys_page >= 0) {
-        tlb_entry.V0 = 1;
         phys_page_t *phys_page = &phys_pool[virtual_pool[entry->even_page].phys_page];
-        tlb_entry.PFN0 = phys_page->phys_address >> 12;
-        tlb_entry.D0 = phys_page->dirty;
+        // a page under IO must not be accessed
+        if (phys_page->state == PAGE_IN_USE) {
+            phys_page->referenced = 1;
+            tlb_entry.V0 = 1;
+            tlb_entry.PFN0 = phys_page->phys_address >> 12;
+            // copy-on-write pages fault on the first write
+            tlb_entry.D0 = phys_page->dirty && !entry->even_cow;
+        }
     }
     if (entry->odd_page >= 0 && virtual_pool[entry->odd_page].phys_page >= 0) {
-        tlb_entry.V1 = 1;
         phys_page_t *phys_page = &phys_pool[virtual_pool[entry->odd_page].phys_page];
-        tlb_entry.PFN1 = phys_page->phys_address >> 12;
-        tlb_entry.D1 = phys_page->dirty;
+        // a page under IO must not be accessed
+        if (phys_page->state == PAGE_IN_USE) {
+            phys_page->referenced = 1;
+            tlb_entry.V1 = 1;
+            tlb_entry.PFN1 = phys_page->phys_address >> 12;
+            tlb_entry.D1 = phys_page->dirty && !entry->odd_cow;
+        }
     }
 
     if (tlb_loc < 0) {
@@ -169,34 +372,83 @@ int tlb_modified_exception(void)
 
     pagetable_t *pagetable = my_entry->pagetable;
 
-    uint32_t i;
-    // go through the pagetable, find the virtual page and
-    // mark it as dirty in the phys page table
-    for (i = 0; i < pagetable->valid_count; i++) {
-        pagetable_entry_t *entry = &pagetable->entries[i]; 
-        DEBUG("tlbdebug", "entry vpn 0x%x, even %d, odd %d\n", entry->VPN, entry->even_page, entry->odd_page);
-        if (entry->VPN == tes.badvpn2) {
-            int virtual_page = -1;
-            if (entry->even_page >= 0 && ADDR_IS_ON_EVEN_PAGE(tes.badvaddr)) {
-                if (entry->even_write_protect)
-                    return -1;
-                virtual_page = entry->even_page; 
-            } else if (entry->odd_page >= 0 && ADDR_IS_ON_ODD_PAGE(tes.badvaddr)) {
-                if (entry->odd_write_protect)
-                    return -1;
-                virtual_page = entry->odd_page; 
-            }
-            if (virtual_page != -1) {
-                // mark the corresponding phys page as dirty
-                vm_virtual_page_modified(virtual_page);
-                // write the page as dirty to TLB
-                KERNEL_ASSERT(upsert_into_tlb(entry, pagetable->ASID) == 1);
-                return 1;
-            }
-        }
+    // the address space may have been given a new ASID since the entry
+    // was written
+    uint32_t asid = tlb_activate(pagetable);
+
+    // find the virtual page and mark it as dirty in the phys page table
+    pagetable_entry_t *entry = vm_pagetable_entry(pagetable, tes.badvaddr, 0);
+    if (entry == NULL)
+        return -1;
+    DEBUG("tlbdebug", "entry vpn 0x%x, even %d, odd %d\n", tes.badvpn2, entry->even_page, entry->odd_page);
+
+    int virtual_page = -1;
+    int cow = 0;
+    if (entry->even_page >= 0 && ADDR_IS_ON_EVEN_PAGE(tes.badvaddr)) {
+        if (entry->even_write_protect)
+            return -1;
+        virtual_page = entry->even_page; 
+        cow = entry->even_cow;
+    } else if (entry->odd_page >= 0 && ADDR_IS_ON_ODD_PAGE(tes.badvaddr)) {
+        if (entry->odd_write_protect)
+            return -1;
+        virtual_page = entry->odd_page; 
+        cow = entry->odd_cow;
     }
+    if (virtual_page == -1)
+        return -1;
 
-    return -1;
+    // the first write to a page shared after fork makes it private.
+    // the copy may have to wait for IO, and the page is not
+    // necessarily in the TLB any more afterwards
+    if (cow) {
+        virtual_page = vm_cow_fault(pagetable, tes.badvaddr);
+        if (virtual_page < 0)
+            return -1;
+        vm_ensure_page_in_memory(virtual_page, 1);
+        // a copy gives the address space a new ASID
+        asid = tlb_activate(pagetable);
+        upsert_into_tlb(entry, tes.badvaddr, asid);
+        return 1;
+    }
+
+    // mark the corresponding phys page as dirty
+    vm_virtual_page_modified(virtual_page);
+    // write the page as dirty to TLB
+    int updated = upsert_into_tlb(entry, tes.badvaddr, asid);
+    KERNEL_ASSERT(updated == 1 || tes.asid != asid);
+    return 1;
+}
+
+// detects sequential faults of a process and reads ahead the pages
+// following the faulting one. the window doubles on every sequential
+// fault up to CONFIG_READAHEAD_MAX_PAGES and drops back to zero on a
+// random one. pages already read ahead are not queued again.
+static void tlb_readahead(pagetable_t *pagetable, uint32_t vaddr)
+{
+    uint32_t page = vaddr & PAGE_SIZE_MASK;
+    uint32_t end, next;
+
+    if (page != pagetable->readahead_next) {
+        pagetable->readahead_window = 0;
+        pagetable->readahead_end = 0;
+    } else if (pagetable->readahead_window == 0) {
+        pagetable->readahead_window = 1;
+    } else {
+        pagetable->readahead_window = MIN(2 * pagetable->readahead_window,
+                                          CONFIG_READAHEAD_MAX_PAGES);
+    }
+    pagetable->readahead_next = page + PAGE_SIZE;
+
+    end = page + (pagetable->readahead_window + 1) * PAGE_SIZE;
+    next = MAX(page + PAGE_SIZE, pagetable->readahead_end);
+    for (; next < end; next += PAGE_SIZE) {
+        int virtual_page = vm_lookup(pagetable, next);
+        if (virtual_page < 0)
+            break;
+        vm_readahead(virtual_page);
+    }
+    pagetable->readahead_end = MAX(pagetable->readahead_end, next);
 }
 
 // handles both kinds of tlb misses
@@ -214,28 +466,35 @@ int tlb_miss(int is_store, char* debug_name)
 
     pagetable_t *pagetable = my_entry->pagetable;
 
-    DEBUG("tlbdebug", "pagetable has %d entries\n", pagetable->valid_count);
+    uint32_t asid = tlb_activate(pagetable);
 
-    uint32_t i;
-    for (i = 0; i < pagetable->valid_count; i++) {
-        pagetable_entry_t *entry = &pagetable->entries[i]; 
-        DEBUG("tlbdebug", "entry vpn 0x%x, even %d, odd %d\n", entry->VPN, entry->even_page, entry->odd_page);
-        if (entry->VPN == tes.badvpn2) {
-            if (entry->even_page >= 0 && ADDR_IS_ON_EVEN_PAGE(tes.badvaddr)) {
-                if (is_store && entry->even_write_protect)
-                    return -1;
-                vm_ensure_page_in_memory(entry->even_page, is_store); 
-                upsert_into_tlb(entry, pagetable->ASID);
-                return 1;
-            } else if (entry->odd_page >= 0 && ADDR_IS_ON_ODD_PAGE(tes.badvaddr)) {
-                if (is_store && entry->odd_write_protect)
-                    return -1;
-                vm_ensure_page_in_memory(entry->odd_page, is_store); 
-                upsert_into_tlb(entry, pagetable->ASID);
-                return 1;
-            }
-            break;
-        }
+    DEBUG("tlbdebug", "pagetable has %d pages\n", pagetable->valid_count);
+
+    pagetable_entry_t *entry = vm_pagetable_entry(pagetable, tes.badvaddr, 0);
+    if (entry == NULL)
+        return -1;
+    DEBUG("tlbdebug", "entry vpn 0x%x, even %d, odd %d\n", tes.badvpn2, entry->even_page, entry->odd_page);
+
+    if (entry->even_page >= 0 && ADDR_IS_ON_EVEN_PAGE(tes.badvaddr)) {
+        if (is_store && entry->even_write_protect)
+            return -1;
+        vm_ensure_page_in_memory(entry->even_page, is_store && !entry->even_cow); 
+        // the thread may have slept and moved to another CPU, or the
+        // address space may have lost its ASID meanwhile
+        asid = tlb_activate(pagetable);
+        upsert_into_tlb(entry, tes.badvaddr, asid);
+        tlb_readahead(pagetable, tes.badvaddr);
+        return 1;
+    } else if (entry->odd_page >= 0 && ADDR_IS_ON_ODD_PAGE(tes.badvaddr)) {
+        if (is_store && entry->odd_write_protect)
+            return -1;
+        vm_ensure_page_in_memory(entry->odd_page, is_store && !entry->odd_cow); 
+        // the thread may have slept and moved to another CPU, or the
+        // address space may have lost its ASID meanwhile
+        asid = tlb_activate(pagetable);
+        upsert_into_tlb(entry, tes.badvaddr, asid);
+        tlb_readahead(pagetable, tes.badvaddr);
+        return 1;
     }
 
     return -1;
@@ -119,7 +119,11 @@ int _tlb_write(tlb_entry_t *entries, uint32_t index, uint32_t num);
 void _tlb_write_random(tlb_entry_t *entry);
 
 #ifdef CHANGED_4
-void tlb_clean_by_asid(uint32_t asid);
+struct pagetable_struct_t;
+void tlb_init(void);
+void tlb_shootdown_handle(void);
+uint32_t tlb_activate(struct pagetable_struct_t *pagetable);
+void tlb_flush_pagetable(struct pagetable_struct_t *pagetable);
 void tlb_clean_by_phys_addr(uint32_t phys_addr);
 
 #define TLB_SIZE 16
@@ -45,6 +45,9 @@
 #include "lib/debug.h"
 #include "kernel/interrupt.h"
 #include "kernel/lock_cond.h"
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
+#include "kernel/config.h"
 #include "drivers/metadev.h"
 #endif
 
@@ -64,12 +67,38 @@
 #endif
 
 #ifdef CHANGED_4
+static void vm_pageout_daemon(uint32_t arg);
+
 gbd_t *swap_gbd;
 uint32_t virtual_pool_size;
 virtual_page_t *virtual_pool;
 uint32_t phys_pool_size;
 phys_page_t *phys_pool;
 lock_t *phys_pool_lock;
+
+// free physical pages are kept in a list linked through next_free so
+// that page-in does not have to scan phys_pool. like the rest of the
+// phys_pool state, the list is protected by phys_pool_lock
+static int phys_free_first;
+static uint32_t phys_free_count;
+// position of the clock hand in phys_pool, only used while holding
+// phys_pool_lock
+static uint32_t phys_clock_hand;
+
+// signaled whenever a page completes IO, waited on by threads that
+// fault on a page under IO
+static cond_t *phys_pool_cv;
+// wakes up the pageout daemon
+static cond_t *pageout_cv;
+
+// virtual pages waiting to be read ahead by the pageout daemon
+static int readahead_queue[CONFIG_READAHEAD_QUEUE_SIZE];
+static int readahead_head;
+static int readahead_count;
+
+// free virtual pages are likewise linked through next_free
+static spinlock_t virtual_free_slock;
+static int virtual_free_first;
 #endif
 
 
@@ -88,13 +117,18 @@ void vm_init(void)
     KERNEL_ASSERT(sizeof(tlb_entry_t) == 12);
 
     #ifdef CHANGED_4
-    // make sure our pagetable structure fits into page
+    // make sure our pagetable directory and leaves fit into a page
     KERNEL_ASSERT(sizeof(pagetable_t) <= PAGE_SIZE);
-    // also make sure that it's as full as possible
-    KERNEL_ASSERT(PAGE_SIZE - sizeof(pagetable_t) < sizeof(pagetable_entry_t));
+    KERNEL_ASSERT(PAGETABLE_LEAF_ENTRIES * sizeof(pagetable_entry_t) == PAGE_SIZE);
+    // and that the directory covers the whole user segment
+    KERNEL_ASSERT((uint32_t)PAGETABLE_DIR_ENTRIES * PAGETABLE_LEAF_ENTRIES * 2 * PAGE_SIZE == 0x80000000);
     KERNEL_ASSERT(_tlb_get_maxindex() + 1 == TLB_SIZE);
 
+    tlb_init();
+
     phys_pool_lock = lock_create();    
+    phys_pool_cv = condition_create();
+    pageout_cv = condition_create();
 
     // find out the swap gbd by looking for disk with block size PAGE_SIZE
     int i = 0;
@@ -104,9 +138,11 @@ void vm_init(void)
             KERNEL_PANIC("No swap disk found!");
         swap_gbd = disk->generic_device;
         if (swap_gbd->block_size(swap_gbd) == PAGE_SIZE) {
-            // use max 10k virtual pages as our logic is mainly O(n)
-            // also the virtual page identifiers finally have to fit in a short
-            virtual_pool_size = MIN(swap_gbd->total_blocks(swap_gbd), 10000);
+            // one virtual page per swap block, but let the virtual page
+            // entries take at most a quarter of the memory left
+            virtual_pool_size = MIN(swap_gbd->total_blocks(swap_gbd),
+                                    (kmalloc_get_numpages() - kmalloc_get_reserved_pages())
+                                    * (PAGE_SIZE / 4) / sizeof(virtual_page_t));
             kprintf("Pagepool: using the disk at 0x%x for swap, %d virtual pages\n", 
                     disk->io_address, virtual_pool_size);
             break;
@@ -119,6 +155,17 @@ void vm_init(void)
     virtual_pool = (virtual_page_t*)kmalloc(virtual_pool_size * sizeof(virtual_page_t));
     if (!virtual_pool) 
         KERNEL_PANIC("Not enough memory left for virtual page pool data!");
+    for (i = 0; (uint32_t)i < virtual_pool_size; i++) {
+        virtual_pool[i].in_use = 0;
+        virtual_pool[i].phys_page = -1;
+        virtual_pool[i].zero_fill = 0;
+        virtual_pool[i].shared = 0;
+        virtual_pool[i].refcount = 0;
+        virtual_pool[i].next_free = i + 1;
+    }
+    virtual_pool[virtual_pool_size - 1].next_free = -1;
+    virtual_free_first = 0;
+    spinlock_reset(&virtual_free_slock);
     // statically reserve phys pool entries from the free memory left
     phys_pool_size = (kmalloc_get_numpages() - kmalloc_get_reserved_pages())/2; 
     KERNEL_ASSERT(phys_pool_size > 0);
@@ -137,10 +184,20 @@ void vm_init(void)
     for (i = 0; (uint32_t)i < phys_pool_size; i++) {
         phys_pool[i].phys_address = pagepool_get_phys_page();
         phys_pool[i].state = PAGE_FREE;
+        phys_pool[i].next_free = i + 1;
         if (!phys_pool[i].phys_address)
             KERNEL_PANIC("Not enough memory left for physical pages!");
     }
+    phys_pool[phys_pool_size - 1].next_free = -1;
+    phys_free_first = 0;
+    phys_free_count = phys_pool_size;
+    phys_clock_hand = 0;
     DEBUG("swapdebug", "SWAP: Allocated a total of %d physical pages for paging\n", phys_pool_size);
+
+    TID_t pageout = thread_create(&vm_pageout_daemon, 0);
+    if (pageout < 0)
+        KERNEL_PANIC("Could not create the pageout daemon");
+    thread_run(pageout);
     #endif
 }
 
@@ -164,83 +221,402 @@ int swap_read_block(uint32_t block, uint32_t addr) {
     return swap_gbd->read_block(swap_gbd, &req);
 }
 
-// swap the given physical page to disk
-// this should be called with interrupts disabled
-void swap_page(phys_page_t *phys_page) {
-    KERNEL_ASSERT(phys_page->state == PAGE_IN_USE);
+// puts the given physical page to the free list
+// this should be called holding phys_pool_lock
+static void phys_page_free(int phys_page)
+{
+    phys_pool[phys_page].state = PAGE_FREE;
+    phys_pool[phys_page].next_free = phys_free_first;
+    phys_free_first = phys_page;
+    phys_free_count++;
+}
 
-    // at this point the old mapping for the physical page might be in TLB, so remove it.
-    // if we get a TLB miss to this page, vm_ensure_page_in_memory will block on 
-    // phys_pool_lock so the same physical page won't be used
-    tlb_clean_by_phys_addr(phys_page->phys_address);
+// puts the given virtual page, which has no references left, to the
+// free list. its swap block may be reused from then on, so there must
+// be no IO on it in flight.
+// this should be called holding phys_pool_lock
+static void virtual_page_release(int virtual_page)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&virtual_free_slock);
+    KERNEL_ASSERT(virtual_pool[virtual_page].refcount == 0);
+    virtual_pool[virtual_page].phys_page = -1;
+    virtual_pool[virtual_page].in_use = 0;
+    virtual_pool[virtual_page].next_free = virtual_free_first;
+    virtual_free_first = virtual_page;
+    spinlock_release(&virtual_free_slock);
+    _interrupt_set_state(intr_status);
+}
+
+// takes a page from the free list, returns -1 if there are none
+// wakes up the pageout daemon if the free pages are running low
+// this should be called holding phys_pool_lock
+static int phys_page_alloc(void)
+{
+    int phys_page;
+
+    phys_page = phys_free_first;
+    if (phys_page >= 0) {
+        phys_free_first = phys_pool[phys_page].next_free;
+        phys_pool[phys_page].state = PAGE_UNDER_IO;
+        phys_free_count--;
+    }
+
+    if (phys_free_count < CONFIG_PAGEOUT_LOW_WATERMARK)
+        condition_signal(pageout_cv);
+
+    return phys_page;
+}
+
+// advances the clock hand until it finds a page in use which has not
+// been referenced since the hand last passed it. referenced pages get
+// a second chance: their bit is cleared, and set again by the next TLB
+// miss on them. the pages are not shot down from the TLBs here, that
+// would interrupt every CPU once per page passed; a page used only
+// through a TLB entry it still has may thus be taken as a victim, and
+// is shot down then. each page is passed at most twice, so the cost
+// is amortized O(1) over the page-ins. this should be called holding
+// phys_pool_lock
+static int phys_page_select_victim(void)
+{
+    uint32_t n;
+
+    for (n = 0; n < 2 * phys_pool_size; n++) {
+        phys_page_t *phys_page = &phys_pool[phys_clock_hand];
+        int i = phys_clock_hand;
+
+        phys_clock_hand = (phys_clock_hand + 1) % phys_pool_size;
+        if (phys_page->state != PAGE_IN_USE)
+            continue;
+        if (!phys_page->referenced)
+            return i;
+
+        phys_page->referenced = 0;
+    }
+
+    return -1;
+}
 
-    // stop the phys page from being used
-    virtual_pool[phys_page->virtual_page].phys_page = -1;
-     
+// starts paging out the given page. the page stays linked to its
+// virtual page while it is under IO, so that a fault on it waits for
+// the write instead of reading the old contents from swap.
+// this should be called holding phys_pool_lock
+static void phys_page_pageout_start(int i)
+{
+    phys_page_t *phys_page = &phys_pool[i];
+
+    KERNEL_ASSERT(phys_page->state == PAGE_IN_USE);
     phys_page->state = PAGE_UNDER_IO;
+    tlb_clean_by_phys_addr(phys_page->phys_address);
+}
+
+// the page is out of memory now; unlinks it from its virtual page
+// and frees it. a virtual page freed during the write is released
+// only now, so that its swap block is not reused under the write.
+// this should be called holding phys_pool_lock
+static void phys_page_pageout_done(int i)
+{
+    phys_page_t *phys_page = &phys_pool[i];
+    virtual_page_t *page = &virtual_pool[phys_page->virtual_page];
+
+    KERNEL_ASSERT(page->phys_page == i);
+    if (page->refcount == 0)
+        virtual_page_release(phys_page->virtual_page);
+    else
+        page->phys_page = -1;
+    phys_page->dirty = 0;
+    phys_page_free(i);
+    condition_broadcast(phys_pool_cv);
+}
+
+// swap the given physical page to disk and free it
+// phys_pool_lock is released for the duration of the write
+static void swap_page(int i) {
+    phys_page_t *phys_page = &phys_pool[i];
+
+    phys_page_pageout_start(i);
+
     if (phys_page->dirty) {
         DEBUG("swapdebug", "Writing virtual page %d to disk\n", phys_page->virtual_page);
+        virtual_pool[phys_page->virtual_page].zero_fill = 0;
+        lock_release(phys_pool_lock);
         KERNEL_ASSERT(swap_write_block(phys_page->virtual_page, phys_page->phys_address) != 0);
+        lock_acquire(phys_pool_lock);
     }
 
-    phys_page->state = PAGE_FREE;
+    phys_page_pageout_done(i);
+}
+
+// frees pages chosen by the clock until the high watermark is reached.
+// clean pages are freed right away, dirty ones are written back in
+// batches of asynchronous requests. returns 0 if nothing could be
+// paged out. this should be called holding phys_pool_lock
+static int vm_pageout(gbd_request_t *requests, semaphore_t *done)
+{
+    int pages[CONFIG_PAGEOUT_BATCH];
+    int i, n, freed;
+
+    while (phys_free_count < CONFIG_PAGEOUT_HIGH_WATERMARK) {
+        n = 0;
+        freed = 0;
+        while (n < CONFIG_PAGEOUT_BATCH
+               && phys_free_count + n < CONFIG_PAGEOUT_HIGH_WATERMARK) {
+            i = phys_page_select_victim();
+            if (i < 0)
+                break;
+
+            phys_page_pageout_start(i);
+            if (!phys_pool[i].dirty) {
+                phys_page_pageout_done(i);
+                freed++;
+                continue;
+            }
+
+            DEBUG("swapdebug", "Pageout of virtual page %d\n", phys_pool[i].virtual_page);
+            virtual_pool[phys_pool[i].virtual_page].zero_fill = 0;
+            requests[n].block = phys_pool[i].virtual_page;
+            requests[n].buf = phys_pool[i].phys_address;
+            requests[n].sem = done;
+            KERNEL_ASSERT(swap_gbd->write_block(swap_gbd, &requests[n]) != 0);
+            pages[n++] = i;
+        }
+
+        // nothing left that could be paged out right now
+        if (n == 0 && freed == 0)
+            return 0;
+
+        lock_release(phys_pool_lock);
+        for (i = 0; i < n; i++)
+            semaphore_P(done);
+        lock_acquire(phys_pool_lock);
+
+        for (i = 0; i < n; i++) {
+            KERNEL_ASSERT(requests[i].return_value == 0);
+            phys_page_pageout_done(pages[i]);
+        }
+    }
+
+    return 1;
+}
+
+// reads in a batch of the virtual pages queued by vm_readahead().
+// only pages above the low watermark are used, read-ahead never
+// evicts anything. the pages are not marked referenced, so the clock
+// takes them back first if they turn out to be useless.
+// this should be called holding phys_pool_lock
+static void vm_readahead_batch(gbd_request_t *requests, semaphore_t *done)
+{
+    int pages[CONFIG_PAGEOUT_BATCH];
+    int i, n = 0;
+
+    while (n < CONFIG_PAGEOUT_BATCH && readahead_count > 0
+           && phys_free_count > CONFIG_PAGEOUT_LOW_WATERMARK) {
+        int virtual_page = readahead_queue[readahead_head];
+        readahead_head = (readahead_head + 1) % CONFIG_READAHEAD_QUEUE_SIZE;
+        readahead_count--;
+
+        virtual_page_t *page = &virtual_pool[virtual_page];
+        if (!page->in_use || page->phys_page >= 0 || page->zero_fill)
+            continue;
+
+        i = phys_page_alloc();
+        KERNEL_ASSERT(i >= 0);
+        page->phys_page = i;
+        phys_pool[i].virtual_page = virtual_page;
+        phys_pool[i].dirty = 0;
+        phys_pool[i].referenced = 0;
+
+        DEBUG("swapdebug", "Read-ahead of virtual page %d\n", virtual_page);
+        requests[n].block = virtual_page;
+        requests[n].buf = phys_pool[i].phys_address;
+        requests[n].sem = done;
+        KERNEL_ASSERT(swap_gbd->read_block(swap_gbd, &requests[n]) != 0);
+        pages[n++] = i;
+    }
+
+    if (n == 0) {
+        // out of free pages, the rest is not worth reading
+        readahead_count = 0;
+        return;
+    }
+
+    lock_release(phys_pool_lock);
+    for (i = 0; i < n; i++)
+        semaphore_P(done);
+    lock_acquire(phys_pool_lock);
+
+    for (i = 0; i < n; i++) {
+        phys_page_t *phys_page = &phys_pool[pages[i]];
+        KERNEL_ASSERT(requests[i].return_value == 0);
+        if (virtual_pool[phys_page->virtual_page].refcount > 0) {
+            phys_page->state = PAGE_IN_USE;
+        } else {
+            // the virtual page was freed while we were reading it
+            virtual_page_release(phys_page->virtual_page);
+            phys_page_free(pages[i]);
+        }
+    }
+    condition_broadcast(phys_pool_cv);
+}
+
+// the pageout daemon. when the free pages drop below the low
+// watermark it pages out until the high watermark is reached, so
+// that the faulting threads seldom have to wait for a write
+// themselves. it also does the reads queued by vm_readahead().
+static void vm_pageout_daemon(uint32_t arg)
+{
+    gbd_request_t requests[CONFIG_PAGEOUT_BATCH];
+    semaphore_t *done;
+    int stalled = 0;
+
+    arg = arg;
+    done = semaphore_create(0);
+    if (done == NULL)
+        KERNEL_PANIC("Could not create the pageout semaphore");
+
+    lock_acquire(phys_pool_lock);
+    while (1) {
+        while ((stalled || phys_free_count >= CONFIG_PAGEOUT_LOW_WATERMARK)
+               && readahead_count == 0) {
+            condition_wait(pageout_cv, phys_pool_lock);
+            stalled = 0;
+        }
+
+        if (phys_free_count < CONFIG_PAGEOUT_LOW_WATERMARK)
+            stalled = !vm_pageout(requests, done);
+        if (readahead_count > 0)
+            vm_readahead_batch(requests, done);
+    }
+}
+
+/**
+ * Queues the given virtual page to be read in by the pageout daemon,
+ * if it is not in memory already. Used by the TLB miss handler when
+ * it sees sequential faults.
+ *
+ * @param virtual_page The virtual page to read ahead
+ */
+void vm_readahead(int virtual_page)
+{
+    KERNEL_ASSERT(virtual_page >= 0 && virtual_page < (int)virtual_pool_size);
+
+    lock_acquire(phys_pool_lock);
+
+    if (virtual_pool[virtual_page].phys_page < 0
+        && !virtual_pool[virtual_page].zero_fill
+        && readahead_count < CONFIG_READAHEAD_QUEUE_SIZE) {
+        readahead_queue[(readahead_head + readahead_count)
+                        % CONFIG_READAHEAD_QUEUE_SIZE] = virtual_page;
+        readahead_count++;
+        condition_signal(pageout_cv);
+    }
+
+    lock_release(phys_pool_lock);
 }
 
 // finds a free virtual page and returns its id
 // returns negative if no virtual pages left
 int vm_get_virtual_page() 
 {
-    // disable to interrupts instead of locking to access virtual pool
     interrupt_status_t intr_status;
     intr_status = _interrupt_disable();
+    spinlock_acquire(&virtual_free_slock);
 
-    uint32_t i;
-    for (i = 0; i < virtual_pool_size; i++) {
-        if (!virtual_pool[i].in_use) {
-            virtual_pool[i].in_use = 1;
-            _interrupt_set_state(intr_status);
-        
-            virtual_pool[i].phys_page = -1;
-            // clear out the space on disk (we don't keep track of whether virtual pages have
-            // actually been in memory before or not)
-            uint32_t buffer = pagepool_get_phys_page();
-            if (!buffer) {
-                virtual_pool[i].in_use = 0;
-                return -1;
-            }
-            swap_write_block(i, buffer);
-            pagepool_free_phys_page(buffer);
-
-            DEBUG("swapdebug", "Reserved virtual page %d\n", i);
-            return i;
-        }
+    int i = virtual_free_first;
+    if (i >= 0) {
+        virtual_free_first = virtual_pool[i].next_free;
+        virtual_pool[i].in_use = 1;
+        virtual_pool[i].refcount = 1;
     }
 
+    spinlock_release(&virtual_free_slock);
+    _interrupt_set_state(intr_status);
+
+    if (i < 0)
+        return -1;
+
+    virtual_pool[i].phys_page = -1;
+    virtual_pool[i].zero_fill = 1;
+    virtual_pool[i].shared = 0;
+
+    DEBUG("swapdebug", "Reserved virtual page %d\n", i);
+    return i;
+}
+
+// marks a new virtual page as part of a shared memory segment, so that
+// a fork keeps sharing it. must be called before the page is mapped
+void vm_share_virtual_page(int virtual_page)
+{
+    KERNEL_ASSERT(virtual_page >= 0 && virtual_page < (int)virtual_pool_size);
+    KERNEL_ASSERT(virtual_pool[virtual_page].in_use);
+    KERNEL_ASSERT(virtual_pool[virtual_page].phys_page < 0);
+
+    virtual_pool[virtual_page].shared = 1;
+}
+
+// adds a reference to the given virtual page, which is shared by
+// mapping it into another pagetable
+void vm_ref_virtual_page(int virtual_page)
+{
+    KERNEL_ASSERT(virtual_page >= 0 && virtual_page < (int)virtual_pool_size);
+
+    interrupt_status_t intr_status;
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&virtual_free_slock);
+
+    KERNEL_ASSERT(virtual_pool[virtual_page].in_use);
+    KERNEL_ASSERT(virtual_pool[virtual_page].refcount < 0xffff);
+    virtual_pool[virtual_page].refcount++;
+
+    spinlock_release(&virtual_free_slock);
     _interrupt_set_state(intr_status);
-    return -1;
 }
 
-// free the given virtual page
+// drops a reference to the given virtual page and frees the page when
+// it was the last one
 void vm_free_virtual_page(int virtual_page)
 {
     KERNEL_ASSERT(virtual_page >= 0 && virtual_page < (int)virtual_pool_size);
 
-    // disable interrupts instead of locking to access virtual_pool
+    lock_acquire(phys_pool_lock);
+
     interrupt_status_t intr_status;
     intr_status = _interrupt_disable();
 
     KERNEL_ASSERT(virtual_pool[virtual_page].in_use);
 
-    if (virtual_pool[virtual_page].phys_page >= 0) {
-        // don't need the phys_pool lock here, as only swap_page might modify
-        // the phys_page, but it does it before switching threads in disk io
-        int phys_page = virtual_pool[virtual_page].phys_page;
+    spinlock_acquire(&virtual_free_slock);
+    KERNEL_ASSERT(virtual_pool[virtual_page].refcount > 0);
+    if (--virtual_pool[virtual_page].refcount > 0) {
+        spinlock_release(&virtual_free_slock);
+        _interrupt_set_state(intr_status);
+        lock_release(phys_pool_lock);
+        return;
+    }
+    spinlock_release(&virtual_free_slock);
+
+    int phys_page = virtual_pool[virtual_page].phys_page;
+    if (phys_page >= 0) {
         KERNEL_ASSERT(phys_pool[phys_page].virtual_page == (uint32_t)virtual_page);
-        phys_pool[phys_page].state = PAGE_FREE;
+        // a page under IO is freed by whoever is doing the IO, and the
+        // virtual page with it: its swap block must not be reused
+        // while a write to it may still be pending
+        if (phys_pool[phys_page].state != PAGE_IN_USE) {
+            _interrupt_set_state(intr_status);
+            lock_release(phys_pool_lock);
+            return;
+        }
+        tlb_clean_by_phys_addr(phys_pool[phys_page].phys_address);
+        phys_page_free(phys_page);
     }
-    virtual_pool[virtual_page].in_use = 0;
+
+    virtual_page_release(virtual_page);
 
     _interrupt_set_state(intr_status);
+
+    lock_release(phys_pool_lock);
 }
 
 // sets the corresponding phys page of this virtual page as dirty
@@ -257,10 +633,9 @@ void vm_virtual_page_modified(int virtual_page)
     KERNEL_ASSERT(page->phys_page >= 0);
     phys_page_t *phys_page = &phys_pool[page->phys_page];
     KERNEL_ASSERT(phys_page->state == PAGE_IN_USE);
-    KERNEL_ASSERT(phys_page->dirty == 0);
 
     phys_page->dirty = 1;
-    phys_page->ticks = rtc_get_msec();
+    phys_page->referenced = 1;
 }
 
 // makes sure that the given virtual page is in memory
@@ -279,50 +654,66 @@ void vm_ensure_page_in_memory(int virtual_page, int dirty)
     virtual_page_t *page = &virtual_pool[virtual_page];
     KERNEL_ASSERT(page->in_use);
     phys_page_t *phys_page = NULL;
-    if (page->phys_page >= 0) {
-        // page is already in memory, OK
-        phys_page = &phys_pool[page->phys_page];
-    } else {
-        // find a free phys page
-        uint32_t i;
-        uint32_t oldest_i = phys_pool_size;
-        uint32_t oldest_ticks = 0;
-        for (i = 0; i < phys_pool_size; i++) {
-            if (phys_pool[i].state == PAGE_FREE) {
-                DEBUG("swapdebug", "   - found free phys page %d\n", i);
-                page->phys_page = i;
-                phys_page = &phys_pool[i];
-                break;
-            } else if (phys_pool[i].state == PAGE_IN_USE && (oldest_i == phys_pool_size || phys_pool[i].ticks < oldest_ticks)) {
-                // keep track of the oldest phys page in use
-                oldest_i = i;
-                oldest_ticks = phys_pool[i].ticks; 
-            }
+
+    // phys_pool_lock is released during IO, so check the state again
+    // after every wait
+    while (page->phys_page < 0 || phys_pool[page->phys_page].state != PAGE_IN_USE) {
+        if (page->phys_page >= 0) {
+            // someone else is paging this page in or out
+            condition_wait(phys_pool_cv, phys_pool_lock);
+            continue;
         }
-        if (!phys_page) {
-            // need to swap some page out. select the one with the oldest ticks
-            if (oldest_i == phys_pool_size)
-                KERNEL_PANIC("Need to swap out a page but none possible found!");
-            DEBUG("swapdebug", "   - swapping out phys page %d\n", oldest_i);
-            phys_page = &phys_pool[oldest_i];
-            swap_page(phys_page);
-            KERNEL_ASSERT(phys_page->state == PAGE_FREE);
-            page->phys_page = oldest_i;
+
+        // take a free phys page, or swap out the one the clock selects
+        int i = phys_page_alloc();
+        if (i < 0) {
+            i = phys_page_select_victim();
+            if (i < 0) {
+                // every page is under IO, wait for one to complete
+                condition_wait(phys_pool_cv, phys_pool_lock);
+                continue;
+            }
+            DEBUG("swapdebug", "   - swapping out phys page %d\n", i);
+            swap_page(i);
+            continue;
         }
+        DEBUG("swapdebug", "   - found free phys page %d\n", i);
 
-        DEBUG("swapdebug", "   - swapping in virtual page %d -> phys page %d\n", virtual_page, page->phys_page);
+        phys_page = &phys_pool[i];
+        page->phys_page = i;
         phys_page->virtual_page = virtual_page;
-        phys_page->state = PAGE_UNDER_IO;
+        phys_page->dirty = 0;
+
+        if (page->zero_fill) {
+            // nothing in swap yet, no need to read
+            DEBUG("swapdebug", "   - zero filling virtual page %d -> phys page %d\n", virtual_page, i);
+            memoryset((void *)ADDR_PHYS_TO_KERNEL(phys_page->phys_address), 0, PAGE_SIZE);
+            phys_page->state = PAGE_IN_USE;
+            continue;
+        }
 
+        DEBUG("swapdebug", "   - swapping in virtual page %d -> phys page %d\n", virtual_page, i);
+        lock_release(phys_pool_lock);
         KERNEL_ASSERT(swap_read_block(virtual_page, phys_page->phys_address) != 0);
-
+        lock_acquire(phys_pool_lock);
+
+        if (page->refcount == 0) {
+            // the virtual page was freed while we were reading it
+            virtual_page_release(virtual_page);
+            phys_page_free(i);
+            condition_broadcast(phys_pool_cv);
+            lock_release(phys_pool_lock);
+            return;
+        }
         phys_page->state = PAGE_IN_USE;
+        condition_broadcast(phys_pool_cv);
     }
+    phys_page = &phys_pool[page->phys_page];
 
     KERNEL_ASSERT(phys_page->state == PAGE_IN_USE);
     KERNEL_ASSERT((int)phys_page->virtual_page == virtual_page);
 
-    phys_page->ticks = rtc_get_msec();
+    phys_page->referenced = 1;
     // don't remove the possible dirty flag even if we came from a load miss
     if (dirty)
         phys_page->dirty = dirty;
@@ -330,6 +721,42 @@ void vm_ensure_page_in_memory(int virtual_page, int dirty)
     lock_release(phys_pool_lock);
 }
 
+// makes a private copy of the given virtual page and returns it
+// returns negative if no virtual pages left
+int vm_copy_virtual_page(int virtual_page)
+{
+    int copy = vm_get_virtual_page();
+    int src, dst;
+
+    if (copy < 0)
+        return -1;
+
+    // either page can be swapped out again while the other one is being
+    // brought in, so check both under the lock before copying
+    while (1) {
+        vm_ensure_page_in_memory(virtual_page, 0);
+        vm_ensure_page_in_memory(copy, 1);
+
+        lock_acquire(phys_pool_lock);
+        src = virtual_pool[virtual_page].phys_page;
+        dst = virtual_pool[copy].phys_page;
+        if (src >= 0 && phys_pool[src].state == PAGE_IN_USE
+            && dst >= 0 && phys_pool[dst].state == PAGE_IN_USE)
+            break;
+        lock_release(phys_pool_lock);
+    }
+
+    DEBUG("swapdebug", "Copying virtual page %d -> %d\n", virtual_page, copy);
+    memcopy(PAGE_SIZE, (void *)ADDR_PHYS_TO_KERNEL(phys_pool[dst].phys_address),
+            (void *)ADDR_PHYS_TO_KERNEL(phys_pool[src].phys_address));
+    virtual_pool[copy].zero_fill = 0;
+    phys_pool[dst].dirty = 1;
+    phys_pool[dst].referenced = 1;
+
+    lock_release(phys_pool_lock);
+    return copy;
+}
+
 #endif
 
 
@@ -343,7 +770,11 @@ void vm_ensure_page_in_memory(int virtual_page, int dirty)
  *
  */
 
+#ifdef CHANGED_4
+pagetable_t *vm_create_pagetable(void)
+#else
 pagetable_t *vm_create_pagetable(uint32_t asid)
+#endif
 {
     pagetable_t *table;
     uint32_t addr;
@@ -359,8 +790,25 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
        physical memory. */
     table = (pagetable_t *) (ADDR_PHYS_TO_KERNEL(addr));
 
+#ifdef CHANGED_4
+    /* ASIDs are assigned when the table is first used on a CPU */
+    memoryset(table->asid, 0, sizeof(table->asid));
+#else
     table->ASID        = asid;
+#endif
     table->valid_count = 0;
+#ifdef CHANGED_4
+    table->memlimit    = 0;
+    table->readahead_next   = 0;
+    table->readahead_end    = 0;
+    table->readahead_window = 0;
+    memoryset(table->leaves, 0, sizeof(table->leaves));
+    table->cow_lock = lock_create();
+    if (table->cow_lock == NULL) {
+        pagepool_free_phys_page(addr);
+        return NULL;
+    }
+#endif
 
     return table;
 }
@@ -375,11 +823,58 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
 
 void vm_destroy_pagetable(pagetable_t *pagetable)
 {
+#ifdef CHANGED_4
+    int i;
+
+    for (i = 0; i < PAGETABLE_DIR_ENTRIES; i++) {
+        if (pagetable->leaves[i] != NULL)
+            pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) pagetable->leaves[i]));
+    }
+    lock_destroy(pagetable->cow_lock);
+#endif
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) pagetable));
 }
 
 #if CHANGED_4
 
+// returns the pagetable entry of the page pair containing vaddr. if
+// create is set, a missing leaf is allocated, otherwise NULL is
+// returned for it. NULL is also returned for addresses outside the
+// user segment and when there is no memory for a new leaf
+pagetable_entry_t *vm_pagetable_entry(pagetable_t *pagetable, uint32_t vaddr,
+                                      int create)
+{
+    uint32_t vpn2 = vaddr >> 13;
+    pagetable_entry_t *leaf;
+
+    if (PAGETABLE_DIR_INDEX(vpn2) >= PAGETABLE_DIR_ENTRIES)
+        return NULL;
+
+    leaf = pagetable->leaves[PAGETABLE_DIR_INDEX(vpn2)];
+    if (leaf == NULL) {
+        uint32_t addr;
+        int i;
+
+        if (!create)
+            return NULL;
+        addr = pagepool_get_phys_page();
+        if (addr == 0)
+            return NULL;
+        leaf = (pagetable_entry_t *) ADDR_PHYS_TO_KERNEL(addr);
+        for (i = 0; i < PAGETABLE_LEAF_ENTRIES; i++) {
+            leaf[i].even_page = -1;
+            leaf[i].even_write_protect = 0;
+            leaf[i].even_cow = 0;
+            leaf[i].odd_page = -1;
+            leaf[i].odd_write_protect = 0;
+            leaf[i].odd_cow = 0;
+        }
+        pagetable->leaves[PAGETABLE_DIR_INDEX(vpn2)] = leaf;
+    }
+
+    return &leaf[PAGETABLE_LEAF_INDEX(vpn2)];
+}
+
 /**
  * Maps given virtual address to given physical address in given page
  * table. Does not modify TLB. The mapping is done in 4k chunks (pages).
@@ -392,72 +887,50 @@ void vm_destroy_pagetable(pagetable_t *pagetable)
  * @param virtual_page Virtual page to map to given virtual address.
  * This value should have come from vm_get_virtual_page()
  *
+ * @return 0 on success, negative if there was no memory left for
+ * the pagetable
  */
 
-void vm_map(pagetable_t *pagetable, 
-            int virtual_page, 
-            uint32_t vaddr,
-            int write_protected)
+int vm_map(pagetable_t *pagetable, 
+           int virtual_page, 
+           uint32_t vaddr,
+           int write_protected)
 {
-    unsigned int i;
+    pagetable_entry_t *entry;
 
     KERNEL_ASSERT(write_protected == 0 || write_protected == 1);
 
     if (virtual_page < 0 || virtual_page >= (int)virtual_pool_size)
         KERNEL_PANIC("Tried to map an unexistant virtual page!");
 
-    for(i=0; i<pagetable->valid_count; i++) {
-        if(pagetable->entries[i].VPN == (vaddr >> 13)) {
-            /* TLB has separate mappings for even and odd 
-               virtual pages. Let's handle them separately here,
-               and we have much more fun when updating the TLB later.*/
-            if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-                if(pagetable->entries[i].even_page >= 0) {
-                    KERNEL_PANIC("Tried to re-map same virtual page");
-                } else {
-                    /* Map the page on a pair entry */
-                    pagetable->entries[i].even_page = virtual_page;
-                    pagetable->entries[i].even_write_protect = write_protected;
-                    return;
-                }
-            } else {
-                if(pagetable->entries[i].odd_page >= 0) {
-                    KERNEL_PANIC("Tried to re-map same virtual page");
-                } else {
-                    /* Map the page on a pair entry */
-                    pagetable->entries[i].odd_page = virtual_page;
-                    pagetable->entries[i].odd_write_protect = write_protected;
-                    return;
-                }
-            }
-        }
-    }
-    /* No previous or pairing mapping was found */
-
-    /* Make sure that pagetable is not full */
-    if(pagetable->valid_count >= PAGETABLE_ENTRIES) {
-        kprintf("Thread with ASID=%d run out of pagetable mapping entries\n",
-                pagetable->ASID);
+    entry = vm_pagetable_entry(pagetable, vaddr, 1);
+    if (entry == NULL) {
+        kprintf("Thread %d could not get a pagetable leaf\n",
+                thread_get_current_thread());
         kprintf("during an attempt to map vaddr 0x%8.8x => virtual page %d\n",
                 vaddr, virtual_page);
-        KERNEL_PANIC("Thread run out of pagetable mapping entries.");
+        return -1;
     }
 
-    /* Map the page on a new entry */
-
-    pagetable->entries[pagetable->valid_count].VPN = vaddr >> 13;
-
+    /* TLB has separate mappings for even and odd 
+       virtual pages. Let's handle them separately here,
+       and we have much more fun when updating the TLB later.*/
     if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-        pagetable->entries[pagetable->valid_count].even_page = virtual_page;
-        pagetable->entries[pagetable->valid_count].even_write_protect = write_protected;
-        pagetable->entries[pagetable->valid_count].odd_page = -1;
+        if(entry->even_page >= 0)
+            KERNEL_PANIC("Tried to re-map same virtual page");
+        entry->even_page = virtual_page;
+        entry->even_write_protect = write_protected;
+        entry->even_cow = 0;
     } else {
-        pagetable->entries[pagetable->valid_count].odd_page = virtual_page;
-        pagetable->entries[pagetable->valid_count].odd_write_protect = write_protected;
-        pagetable->entries[pagetable->valid_count].even_page = -1;
+        if(entry->odd_page >= 0)
+            KERNEL_PANIC("Tried to re-map same virtual page");
+        entry->odd_page = virtual_page;
+        entry->odd_write_protect = write_protected;
+        entry->odd_cow = 0;
     }
 
     pagetable->valid_count++;
+    return 0;
 }
 
 #else
@@ -478,36 +951,56 @@ void vm_map(pagetable_t *pagetable,
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
 {
     #ifdef CHANGED_4
-    uint32_t i;
-    for (i = 0; i < pagetable->valid_count; i++) {
-        if(pagetable->entries[i].VPN == (vaddr >> 13)) {
-            // free the virtual page and remove the mapping 
-            if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-                if (pagetable->entries[i].even_page >= 0) {
-                    vm_free_virtual_page(pagetable->entries[i].even_page);
-                    pagetable->entries[i].even_page = -1;
-                }
-            } else {
-                if (pagetable->entries[i].odd_page >= 0) {
-                    vm_free_virtual_page(pagetable->entries[i].odd_page);
-                    pagetable->entries[i].odd_page = -1;
-                }
-            }
+    pagetable_entry_t *entry = vm_pagetable_entry(pagetable, vaddr, 0);
+    if (entry == NULL)
+        return;
 
-            // check if we're at the end of the list
-            if (i == pagetable->valid_count - 1) {
-                // check if we can remove empty entries from the end of the list
-                while (pagetable->entries[pagetable->valid_count - 1].even_page < 0 && 
-                        pagetable->entries[pagetable->valid_count - 1].odd_page < 0) {
-                    pagetable->valid_count--;
-                }
-            }
+    // free the virtual page and remove the mapping 
+    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
+        if (entry->even_page >= 0) {
+            vm_free_virtual_page(entry->even_page);
+            entry->even_page = -1;
+            pagetable->valid_count--;
+        }
+    } else {
+        if (entry->odd_page >= 0) {
+            vm_free_virtual_page(entry->odd_page);
+            entry->odd_page = -1;
+            pagetable->valid_count--;
         }
     }
     #endif
 }
 
 #ifdef CHANGED_4
+/**
+ * Unmaps everything in the given pagetable and frees the virtual
+ * pages. The leaves stay allocated until vm_destroy_pagetable().
+ *
+ * @param pagetable Page table to operate on
+ */
+void vm_unmap_all(pagetable_t *pagetable)
+{
+    int i, j;
+
+    for (i = 0; i < PAGETABLE_DIR_ENTRIES; i++) {
+        pagetable_entry_t *leaf = pagetable->leaves[i];
+        if (leaf == NULL)
+            continue;
+        for (j = 0; j < PAGETABLE_LEAF_ENTRIES; j++) {
+            if (leaf[j].even_page >= 0) {
+                vm_free_virtual_page(leaf[j].even_page);
+                leaf[j].even_page = -1;
+            }
+            if (leaf[j].odd_page >= 0) {
+                vm_free_virtual_page(leaf[j].odd_page);
+                leaf[j].odd_page = -1;
+            }
+        }
+    }
+    pagetable->valid_count = 0;
+}
+
 /**
  * Sets the write protected bit for the given virtual page in the given
  * pagetable. The page must already be mapped in the pagetable.
@@ -522,35 +1015,185 @@ void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
  */
 void vm_set_write_protected(pagetable_t *pagetable, uint32_t vaddr, int write_protected)
 {
-    uint32_t i;
+    pagetable_entry_t *entry;
 
     KERNEL_ASSERT(write_protected == 0 || write_protected == 1);
 
-    for(i=0; i < pagetable->valid_count; i++) {
-        if(pagetable->entries[i].VPN == (vaddr >> 13)) {
-            /* Check whether this is an even or odd page */
-            if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-                if(pagetable->entries[i].even_page < 0) {
-                    KERNEL_PANIC("Tried to set write protected bit of an unmapped "
-                                 "entry");
-                } else {
-                    pagetable->entries[i].even_write_protect = write_protected;
-                    return;
+    entry = vm_pagetable_entry(pagetable, vaddr, 0);
+    if (entry != NULL) {
+        /* Check whether this is an even or odd page */
+        if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
+            if(entry->even_page >= 0) {
+                entry->even_write_protect = write_protected;
+                return;
+            }
+        } else {
+            if(entry->odd_page >= 0) {
+                entry->odd_write_protect = write_protected;
+                return;
+            }
+        }
+    }
+    /* No mapping was found */
+
+    KERNEL_PANIC("Tried to set write protected bit of an unmapped entry");
+}
+
+/**
+ * Finds the virtual page mapped at the given address.
+ *
+ * @param pagetable The pagetable to look from.
+ *
+ * @param vaddr The virtual address.
+ *
+ * @return The virtual page, or negative if vaddr is not mapped.
+ */
+int vm_lookup(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pagetable_entry_t *entry = vm_pagetable_entry(pagetable, vaddr, 0);
+
+    if (entry == NULL)
+        return -1;
+    if(ADDR_IS_ON_EVEN_PAGE(vaddr))
+        return entry->even_page;
+    else
+        return entry->odd_page;
+}
+
+/**
+ * Maps every page of the parent pagetable into the child pagetable,
+ * which must be empty. Writable pages are shared copy-on-write: both
+ * mappings are marked so that the first write to either of them makes
+ * a private copy. Write protected pages and pages of shared memory
+ * segments are simply shared. The caller must drop the writable TLB
+ * entries of the parent.
+ *
+ * @param parent The pagetable to copy.
+ *
+ * @param child The pagetable to map the pages into.
+ *
+ * @return 0 on success, negative if there was no memory left for the
+ * child pagetable. The child is then partially mapped and should be
+ * freed with vm_unmap_all().
+ */
+int vm_fork_pagetable(pagetable_t *parent, pagetable_t *child)
+{
+    int i, j;
+
+    // keep the other threads of the parent from resolving cow faults
+    // while the bits are being set
+    lock_acquire(parent->cow_lock);
+    for (i = 0; i < PAGETABLE_DIR_ENTRIES; i++) {
+        pagetable_entry_t *leaf = parent->leaves[i];
+        if (leaf == NULL)
+            continue;
+        for (j = 0; j < PAGETABLE_LEAF_ENTRIES; j++) {
+            uint32_t vaddr = (uint32_t)(i * PAGETABLE_LEAF_ENTRIES + j) << 13;
+            pagetable_entry_t *entry;
+
+            if (leaf[j].even_page >= 0) {
+                vm_ref_virtual_page(leaf[j].even_page);
+                if (vm_map(child, leaf[j].even_page, vaddr,
+                           leaf[j].even_write_protect) < 0) {
+                    vm_free_virtual_page(leaf[j].even_page);
+                    lock_release(parent->cow_lock);
+                    return -1;
                 }
-            } else {
-                if(pagetable->entries[i].odd_page < 0) {
-                    KERNEL_PANIC("Tried to set write protected bit of an unmapped "
-                                 "entry");
-                } else {
-                    pagetable->entries[i].odd_write_protect = write_protected;
-                    return;
+                if (!leaf[j].even_write_protect
+                    && !virtual_pool[leaf[j].even_page].shared) {
+                    entry = vm_pagetable_entry(child, vaddr, 0);
+                    entry->even_cow = 1;
+                    leaf[j].even_cow = 1;
+                }
+            }
+            if (leaf[j].odd_page >= 0) {
+                vm_ref_virtual_page(leaf[j].odd_page);
+                if (vm_map(child, leaf[j].odd_page, vaddr | PAGE_SIZE,
+                           leaf[j].odd_write_protect) < 0) {
+                    vm_free_virtual_page(leaf[j].odd_page);
+                    lock_release(parent->cow_lock);
+                    return -1;
+                }
+                if (!leaf[j].odd_write_protect
+                    && !virtual_pool[leaf[j].odd_page].shared) {
+                    entry = vm_pagetable_entry(child, vaddr, 0);
+                    entry->odd_cow = 1;
+                    leaf[j].odd_cow = 1;
                 }
             }
         }
     }
-    /* No mapping was found */
 
-    KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+    lock_release(parent->cow_lock);
+    child->memlimit = parent->memlimit;
+    return 0;
+}
+
+/**
+ * Resolves a write to a copy-on-write page. If the page is still
+ * shared, the mapping is replaced with a private copy and the TLB
+ * entries of the address space are dropped, otherwise the page is
+ * just taken over. Interrupts must be disabled.
+ *
+ * @param pagetable The pagetable where the mapping resides.
+ *
+ * @param vaddr The virtual address written to.
+ *
+ * @return The virtual page now mapped writable at vaddr, or negative
+ * if there were no virtual pages left for the copy.
+ */
+int vm_cow_fault(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pagetable_entry_t *entry = vm_pagetable_entry(pagetable, vaddr, 0);
+    int even = ADDR_IS_ON_EVEN_PAGE(vaddr);
+    int virtual_page, refcount;
+
+    KERNEL_ASSERT(entry != NULL);
+
+    // another thread of the process may have resolved the fault, or
+    // be resolving it, since the caller looked at the entry. the lock
+    // keeps two threads from both copying the page and freeing our
+    // reference to the original twice
+    lock_acquire(pagetable->cow_lock);
+    virtual_page = even ? entry->even_page : entry->odd_page;
+    if (virtual_page < 0) {
+        lock_release(pagetable->cow_lock);
+        return -1;
+    }
+    if (!(even ? entry->even_cow : entry->odd_cow)) {
+        lock_release(pagetable->cow_lock);
+        return virtual_page;
+    }
+
+    spinlock_acquire(&virtual_free_slock);
+    refcount = virtual_pool[virtual_page].refcount;
+    spinlock_release(&virtual_free_slock);
+
+    // if the others have gone, nobody can see our writes any more.
+    // the other sharers are other address spaces holding their own
+    // references, so they may copy at the same time without harm
+    if (refcount > 1) {
+        int copy = vm_copy_virtual_page(virtual_page);
+        if (copy < 0) {
+            lock_release(pagetable->cow_lock);
+            return -1;
+        }
+        if (even)
+            entry->even_page = copy;
+        else
+            entry->odd_page = copy;
+        vm_free_virtual_page(virtual_page);
+        virtual_page = copy;
+        // the other threads of the process may still map the original
+        tlb_flush_pagetable(pagetable);
+    }
+
+    if (even)
+        entry->even_cow = 0;
+    else
+        entry->odd_cow = 0;
+    lock_release(pagetable->cow_lock);
+    return virtual_page;
 }
 #else
 /**
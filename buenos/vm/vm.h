@@ -52,8 +52,23 @@
 typedef struct virtual_page_struct_t {
     // flag that tells if this virtual page is in use or free
     uint8_t in_use;
+    // flag that tells if this page has never been written to swap. its
+    // contents are all zero, so a fault on it zeroes a physical page
+    // instead of reading the swap
+    uint8_t zero_fill:1;
+    // flag that tells if this page belongs to a shared memory segment.
+    // such pages stay shared on fork instead of being copied on write.
+    // only set while the page is not mapped anywhere, so it doesn't
+    // race with the writers of zero_fill
+    uint8_t shared:1;
+    // number of mappings of this page. the page is freed when the
+    // last one goes away, or when the IO on its physical page then in
+    // flight completes
+    uint16_t refcount;
     // index to phys_pool if this page is currently in memory. -1 otherwise
     int phys_page;
+    // next page in the free list when not in use, -1 at the end
+    int next_free;
 } virtual_page_t;
 
 typedef enum {
@@ -74,35 +89,52 @@ typedef struct phys_page_struct_t {
 
     // the virtual page that is currently in this physical page
     uint32_t virtual_page;
-    // last time when this page was participant in TLB exception
-    uint32_t ticks;
+    // reference bit for the clock replacer. set on every TLB miss or
+    // modification exception to this page, cleared by the clock hand
+    uint8_t referenced;
     // a flag that tells if this page has had a TLB modification
     // exception since loading from disk
     // (i.e. do we need to write this page to disk when swapping it out?)
     uint8_t dirty;
+    // next page in the free list when state is PAGE_FREE, -1 at the end
+    int next_free;
 } phys_page_t;
 
 #endif
 
 void vm_init(void);
 
+#ifdef CHANGED_4
+pagetable_t *vm_create_pagetable(void);
+#else
 pagetable_t *vm_create_pagetable(uint32_t asid);
+#endif
 void vm_destroy_pagetable(pagetable_t *pagetable);
 
 #ifdef CHANGED_4
 int vm_get_virtual_page();
 void vm_free_virtual_page(int virtual_page);
+void vm_ref_virtual_page(int virtual_page);
 void vm_virtual_page_modified(int virtual_page);
 void vm_ensure_page_in_memory(int virtual_page, int dirty);
-void vm_map(pagetable_t *pagetable, int virtual_page, 
-            uint32_t vaddr, int write_protected);
+int vm_copy_virtual_page(int virtual_page);
+void vm_share_virtual_page(int virtual_page);
+void vm_readahead(int virtual_page);
+int vm_map(pagetable_t *pagetable, int virtual_page, 
+           uint32_t vaddr, int write_protected);
+pagetable_entry_t *vm_pagetable_entry(pagetable_t *pagetable, uint32_t vaddr,
+                                      int create);
 #else
 void vm_map(pagetable_t *pagetable, uint32_t physaddr, 
 	    uint32_t vaddr, int dirty);
 #endif
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr);
 #ifdef CHANGED_4 
+void vm_unmap_all(pagetable_t *pagetable);
 void vm_set_write_protected(pagetable_t *pagetable, uint32_t vaddr, int write_protected);
+int vm_lookup(pagetable_t *pagetable, uint32_t vaddr);
+int vm_fork_pagetable(pagetable_t *parent, pagetable_t *child);
+int vm_cow_fault(pagetable_t *pagetable, uint32_t vaddr);
 // set dirty is misleading now, as the word dirty is reserved
 // for virtual pages whose memory version differs from their disk version
 // HOX: the old dirty flag is exactly reverse of the new write_protected flag